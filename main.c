@@ -1,332 +1,557 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
-#include <linux/fb.h>
-#include <sys/ioctl.h>
-#include <fcntl.h>
-#include <sys/mman.h>
 #include <termios.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <math.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+
+#include "zfbv.h"
+
+// keyboard input: evdev devices (/dev/input/event*) are read directly, with
+// press, autorepeat and release, so held zoom and pan keys move smoothly at a
+// speed that builds up the longer they are held, independent of the console's
+// key repeat. Devices are grabbed, so their keys do not also reach the
+// console (and the shell after exit). The terminal is read as well, as the
+// fallback when no device can be opened (no permission, or a remote session).
+
+#define INPUT_MAX_DEVICES 16
+#define HOLD_DELAY 0.25      // seconds a key is held before it acts continuously
+#define ACCEL_SECONDS 1.5    // from the start speed to the top speed after that
+#define ZOOM_RATE 1.8f       // scale factor per second, at the start
+#define ZOOM_RATE_MAX 6.0f   // and at the top
+#define PAN_SPEED 0.4f       // display widths per second, at the start
+#define PAN_SPEED_MAX 3.0f   // and at the top
+#define FRAME_MS 16          // input is sampled at this interval while keys are held
+
+typedef struct input_devices {
+    int fds[INPUT_MAX_DEVICES];
+    unsigned held[INPUT_MAX_DEVICES]; // bit per action the device has a key down for
+    int dropped[INPUT_MAX_DEVICES];   // events lost: skipping to the next SYN_REPORT
+    int count;
+} input_devices;
+
+static int test_bit(const unsigned long *bits, int bit) {
+    return (bits[bit / (8 * sizeof(long))] >> (bit % (8 * sizeof(long)))) & 1;
+}
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
-
-typedef struct framebuffer {
-    int fd;
-    char *fbp;
-    char *buffer;
-    int width;
-    int height;
-    int bpp;
-} framebuffer;
+// a device with the keys zfbv uses, rather than a mouse or power button
+static int input_is_keyboard(int fd) {
+    unsigned long keys[KEY_CNT / (8 * sizeof(long)) + 1] = { 0 };
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) == -1) return 0;
+    return test_bit(keys, KEY_Q) && test_bit(keys, KEY_MINUS);
+}
 
+// 'device' NULL opens every keyboard under /dev/input; returns the number opened
+static int input_open(input_devices *in, const char *device) {
+    in->count = 0;
+    if (device != NULL) {
+        int fd = open(device, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd == -1) {
+            printf("Failed to open input device %s: %s\n", device, strerror(errno));
+            return 0;
+        }
+        ioctl(fd, EVIOCGRAB, 1); // not an evdev device when testing with a pipe
+        in->held[in->count] = 0;
+        in->dropped[in->count] = 0;
+        in->fds[in->count++] = fd;
+        return 1;
+    }
+    for (int i = 0; i < 64 && in->count < INPUT_MAX_DEVICES; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/dev/input/event%d", i);
+        int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd == -1) continue;
+        if (input_is_keyboard(fd) && ioctl(fd, EVIOCGRAB, 1) == 0) {
+            in->held[in->count] = 0;
+            in->dropped[in->count] = 0;
+            in->fds[in->count++] = fd;
+        }
+        else {
+            close(fd);
+        }
+    }
+    return in->count;
+}
 
-typedef struct Image {
-    int width;
-    int height;
-    int bpp;
-    int stride;
-    uint8_t *data;
-} Image;
+static int input_find(const input_devices *in, int fd) {
+    for (int i = 0; i < in->count; i++) {
+        if (in->fds[i] == fd) return i;
+    }
+    return -1;
+}
 
-framebuffer *framebuffer_create(const char *device);
-void framebuffer_destroy(framebuffer *fb);
-void framebuffer_update(framebuffer *fb);
-void framebuffer_clear_color(framebuffer *fb, uint8_t r, uint8_t g, uint8_t b);
-void framebuffer_draw_image(framebuffer *image, int x, int y, Image *img);
+static void input_remove(input_devices *in, int i) {
+    in->count--;
+    in->fds[i] = in->fds[in->count];
+    in->held[i] = in->held[in->count];
+    in->dropped[i] = in->dropped[in->count];
+}
 
+static void input_close(input_devices *in) {
+    for (int i = 0; i < in->count; i++) {
+        close(in->fds[i]);
+    }
+    in->count = 0;
+}
 
-Image *Image_load(const char *filename);
-void Image_free(Image *img);
+typedef enum action {
+    ACTION_NONE,
+    ACTION_ZOOM_IN,
+    ACTION_ZOOM_OUT,
+    ACTION_LEFT,
+    ACTION_RIGHT,
+    ACTION_UP,
+    ACTION_DOWN,
+    ACTION_RESET,
+    ACTION_LOUPE,
+    ACTION_QUIT,
+    ACTIONS
+} action;
+
+static action key_action(int code) {
+    switch (code) {
+    case KEY_EQUAL: case KEY_KPPLUS: return ACTION_ZOOM_IN;
+    case KEY_MINUS: case KEY_KPMINUS: return ACTION_ZOOM_OUT;
+    case KEY_LEFT: return ACTION_LEFT;
+    case KEY_RIGHT: return ACTION_RIGHT;
+    case KEY_UP: return ACTION_UP;
+    case KEY_DOWN: return ACTION_DOWN;
+    case KEY_R: return ACTION_RESET;
+    case KEY_L: return ACTION_LOUPE;
+    case KEY_Q: case KEY_ESC: return ACTION_QUIT;
+    default: return ACTION_NONE;
+    }
+}
 
-Image *Image_resize_linear(Image *src, int new_width, int new_height);
+static action char_action(char ch) {
+    switch (ch) {
+    case '+': case '=': return ACTION_ZOOM_IN;
+    case '-': return ACTION_ZOOM_OUT;
+    case 'r': return ACTION_RESET;
+    case 'l': return ACTION_LOUPE;
+    case 'q': return ACTION_QUIT;
+    default: return ACTION_NONE;
+    }
+}
 
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
+// speed of a key held since 'pressed', 'start' to 'top' with an ease-in
+static float held_speed(double pressed, double now, float start, float top) {
+    double t = (now - pressed - HOLD_DELAY) / ACCEL_SECONDS;
+    t = t < 0.0 ? 0.0 : t > 1.0 ? 1.0 : t;
+    return start + (top - start) * (float) (t * t);
+}
 
+typedef struct view {
+    zfbv_transform transform;
+    float default_scale;
+    int width, height; // of the display
+    double held[ACTIONS]; // when each held key went down, 0 when up
+    int loupe; // zoom and the arrows work on the lens instead of the image
+    zfbv_loupe lens;
+} view;
+
+// a square lens a third of the display high, in its centre, at 1:1
+static void view_reset_lens(view *v) {
+    int side = (v->width < v->height ? v->width : v->height) / 3;
+    v->lens = (zfbv_loupe) { v->width / 2, v->height / 2, side, side, 1.0f };
+}
 
+// zooms the lens by 'factor' or moves it by 'step' display pixels
+static void lens_move(zfbv_loupe *lens, action a, float factor, int step) {
+    if (a == ACTION_ZOOM_IN) lens->scale *= factor;
+    else if (a == ACTION_ZOOM_OUT) lens->scale /= factor;
+    else if (a == ACTION_LEFT) lens->x -= step;
+    else if (a == ACTION_RIGHT) lens->x += step;
+    else if (a == ACTION_UP) lens->y -= step;
+    else if (a == ACTION_DOWN) lens->y += step;
+}
 
+// one step for a key press or a character from the terminal
+static void view_step(view *v, action a) {
+    float pan = 0.1f * v->width;
+    if (a == ACTION_LOUPE) v->loupe = !v->loupe;
+    else if (v->loupe && a >= ACTION_ZOOM_IN && a <= ACTION_DOWN) lens_move(&v->lens, a, 1.2f, (int) pan);
+    else if (a == ACTION_ZOOM_IN) v->transform.scale *= 1.2f;
+    else if (a == ACTION_ZOOM_OUT) v->transform.scale /= 1.2f;
+    else if (a == ACTION_LEFT) v->transform.offset_x += (int) pan;
+    else if (a == ACTION_RIGHT) v->transform.offset_x -= (int) pan;
+    else if (a == ACTION_UP) v->transform.offset_y += (int) pan;
+    else if (a == ACTION_DOWN) v->transform.offset_y -= (int) pan;
+    else if (a == ACTION_RESET) {
+        v->transform.scale = v->default_scale;
+        v->transform.offset_x = 0;
+        v->transform.offset_y = 0;
+        view_reset_lens(v);
+    }
+}
 
-int main(int argc, char **argv) {
-    if (argc < 3) {
-        printf("Usage: zfbv <device> <input>\nExample: zfbv /dev/fb0 images/test2.jpg\n");
-        return 1;
+// moves held keys on by 'dt' seconds; 1 if the view changed
+static int view_hold(view *v, double now, double dt) {
+    int changed = 0;
+    for (int a = ACTION_ZOOM_IN; a <= ACTION_DOWN; a++) {
+        if (v->held[a] == 0.0 || now - v->held[a] < HOLD_DELAY) continue;
+        if (a == ACTION_ZOOM_IN || a == ACTION_ZOOM_OUT) {
+            float rate = held_speed(v->held[a], now, ZOOM_RATE, ZOOM_RATE_MAX);
+            float factor = powf(rate, (float) dt);
+            if (v->loupe) lens_move(&v->lens, a, factor, 0);
+            else v->transform.scale = a == ACTION_ZOOM_IN ? v->transform.scale * factor : v->transform.scale / factor;
+        }
+        else {
+            int step = (int) (held_speed(v->held[a], now, PAN_SPEED, PAN_SPEED_MAX) * v->width * dt + 0.5);
+            if (v->loupe) lens_move(&v->lens, a, 1.0f, step);
+            else if (a == ACTION_LEFT) v->transform.offset_x += step;
+            else if (a == ACTION_RIGHT) v->transform.offset_x -= step;
+            else if (a == ACTION_UP) v->transform.offset_y += step;
+            else v->transform.offset_y -= step;
+        }
+        changed = 1;
     }
+    return changed;
+}
 
-    // framebuffer
-    framebuffer *fb = framebuffer_create(argv[1]);
-    if (fb == NULL) {
-        return 1;
+static int view_holding(const view *v) {
+    for (int a = 0; a < ACTIONS; a++) {
+        if (v->held[a] != 0.0) return 1;
     }
+    return 0;
+}
 
-    // image
-    Image *img = Image_load(argv[2]);
-    if (img == NULL) {
-        framebuffer_destroy(fb);
-        return 1;
+// the actions device 'fd' has a key down for, from the kernel's key state
+static unsigned input_keys_down(int fd) {
+    unsigned long keys[KEY_CNT / (8 * sizeof(long)) + 1] = { 0 };
+    unsigned down = 0;
+    if (ioctl(fd, EVIOCGKEY(sizeof(keys)), keys) == -1) return 0;
+    for (int code = 0; code < KEY_CNT; code++) {
+        if (test_bit(keys, code)) down |= 1u << key_action(code);
     }
+    return down & ~(1u << ACTION_NONE);
+}
 
-    // resized image
-    int resized_width, resized_height;
-    float scale_w = (float) fb->width / (float) img->width;
-    float scale_h = (float) fb->height / (float) img->height;
-    float scale = scale_w < scale_h ? scale_w : scale_h;
-    float default_scale = scale * 0.8f;
-    scale = default_scale;
-
-    resized_width = (int) (img->width * scale);
-    resized_height = (int) (img->height * scale);
-    
-    Image *resized = Image_resize_linear(img, resized_width, resized_height);
-    if (resized == NULL) {
-        Image_free(img);
-        framebuffer_destroy(fb);
-        return 1;
+// 1 if some device still has a key down for action 'a'
+static int input_holding(const input_devices *in, action a) {
+    for (int d = 0; d < in->count; d++) {
+        if (in->held[d] & (1u << a)) return 1;
     }
+    return 0;
+}
 
-    float prev_scale = scale;
+// device 'd' now has 'down' held: releases what it let go of meanwhile and
+// holds what it pressed, without the step a seen press makes
+static void view_sync_device(view *v, input_devices *in, int d, unsigned down, double now) {
+    unsigned was = in->held[d];
+    in->held[d] = down;
+    for (int a = ACTION_ZOOM_IN; a < ACTIONS; a++) {
+        unsigned bit = 1u << a;
+        if ((was & bit) && !(down & bit) && !input_holding(in, a)) v->held[a] = 0.0;
+        if (!(was & bit) && (down & bit) && v->held[a] == 0.0) v->held[a] = now;
+    }
+}
 
 
-    // config terminal
-    struct termios oldt, newt;
-    tcgetattr(STDIN_FILENO, &oldt);
-    newt = oldt;
-    newt.c_lflag &= ~(ICANON | ECHO);
-    tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-
-
-    // main loop
-    char ch;
-    while (1) {
-        int pos_x = (fb->width - resized->width) / 2;
-        int pos_y = (fb->height - resized->height) / 2;
-        
-        framebuffer_clear_color(fb, 0, 0, 0);
-        framebuffer_draw_image(fb, pos_x, pos_y, resized);
-        framebuffer_update(fb);
-
-        // handle input
-        ch = getchar();
-        
-        if (ch == 'r') {
-            scale = default_scale;
+int main(int argc, char **argv) {
+    zfbv_options opt;
+    zfbv_default_options(&opt);
+    int bench = 0;
+    zfbv_benchmark_options bench_opt;
+    zfbv_default_benchmark_options(&bench_opt);
+    const char *trace = NULL;
+    zfbv_realtime_options rt = { 0 };
+    int realtime = 0;
+    const char *input_device = NULL;
+    int opt_char;
+    while ((opt_char = getopt(argc, argv, "pd:ct:bm:s:l:T:n:B:C:x:R:A:i:")) != -1) {
+        if (opt_char == 'p') {
+            opt.progressive = 1;
         }
-        else if (ch == '+') {
-            scale *= 1.2f;
+        else if (opt_char == 'b') {
+            bench = 1;
         }
-        else if (ch == '-') {
-            scale /= 1.2f;
+        else if (opt_char == 'c') {
+            opt.diff_present = 1;
         }
-        else if (ch == 'q') {
-            break;
+        else if (opt_char == 'd') {
+            opt.dither = atoi(optarg);
         }
-
-        
-
-        // clamp scale
-        scale = scale < 0.1f ? 0.1f : scale;
-        scale = scale > 5.0f ? 5.0f : scale;
-        if (scale == prev_scale) { // no change
-            continue;
+        else if (opt_char == 't') {
+            opt.threads = atoi(optarg);
+        }
+        else if (opt_char == 'm') {
+            opt.panel_profile = optarg;
+        }
+        else if (opt_char == 's') {
+            opt.sharpen = atof(optarg);
+            if (opt.sharpen < 0.0f || opt.sharpen > 4.0f) {
+                argc = 0;
+            }
+        }
+        else if (opt_char == 'l') {
+            if (sscanf(optarg, "%lf,%lf,%lf", &opt.limit_megapixels, &opt.limit_megabytes, &opt.limit_seconds) != 3 ||
+                opt.limit_megapixels < 0 || opt.limit_megabytes < 0 || opt.limit_seconds < 0) {
+                argc = 0;
+            }
+        }
+        else if (opt_char == 'n') {
+            bench_opt.runs = atoi(optarg);
+        }
+        else if (opt_char == 'B') {
+            bench_opt.save = optarg;
         }
-        prev_scale = scale;
-
-        // resize image
-        resized_width = (int) (img->width * scale);
-        resized_height = (int) (img->height * scale);
-        Image *new_resized = Image_resize_linear(img, resized_width, resized_height);
-        if (new_resized != NULL) {
-            Image_free(resized);
-            resized = new_resized;
+        else if (opt_char == 'C') {
+            bench_opt.baseline = optarg;
+        }
+        else if (opt_char == 'x') {
+            bench_opt.threshold = atof(optarg);
+        }
+        else if (opt_char == 'R') {
+            rt.priority = atoi(optarg);
+            rt.lock_memory = 1;
+            realtime = 1;
+        }
+        else if (opt_char == 'A') {
+            // render CPUs, then optionally '/' and the workers' CPUs
+            static char cpus[256];
+            snprintf(cpus, sizeof(cpus), "%s", optarg);
+            char *workers = strchr(cpus, '/');
+            if (workers != NULL) {
+                *workers++ = '\0';
+                rt.worker_cpus = workers;
+            }
+            rt.render_cpus = cpus[0] != '\0' ? cpus : NULL;
+            realtime = 1;
+        }
+        else if (opt_char == 'i') {
+            input_device = optarg;
+        }
+        else if (opt_char == 'T') {
+            trace = optarg;
+        }
+        else {
+            argc = 0; // print usage
         }
     }
 
-    // cleanup
-    Image_free(img);
-    Image_free(resized);
-    framebuffer_destroy(fb);
-
-    // restore terminal
-    tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-    return 0;
-}
-
-
-
-framebuffer *framebuffer_create(const char *device) {
-    framebuffer *fb = malloc(sizeof(framebuffer));
-    if (fb == NULL) {
-        printf("Failed to allocate framebuffer struct\n");
-        return NULL;
+    if (trace != NULL) {
+        zfbv_trace_start();
     }
 
-    fb->fd = open(device, O_RDWR);
-    if (fb->fd == -1) {
-        printf("Failed to open framebuffer device\n");
-        free(fb);
-        return NULL;
+    if (bench && argc - optind == 1) {
+        int ret = zfbv_benchmark_run(argv[optind], &opt, &bench_opt);
+        if (trace != NULL && !zfbv_trace_write(trace)) {
+            ret = 1;
+        }
+        return ret;
     }
 
-    struct fb_var_screeninfo vinfo;
-    if (ioctl(fb->fd, FBIOGET_VSCREENINFO, &vinfo) == -1) {
-        printf("Failed to get variable screen info\n");
-        close(fb->fd);
-        free(fb);
-        return NULL;
+    if (argc - optind < 2 || (opt.dither != 0 && opt.dither != 4 && opt.dither != 8)) {
+        printf("Usage: zfbv [-p] [-d 0|4|8] [-c] [-t threads] [-m panel.icc] [-s amount] [-l mp,mb,s] [-T trace.json]\n"
+               "            [-R priority] [-A cpus[/cpus]] [-i event|none] <device> <input>\n"
+               "       zfbv [-t threads] [-s amount] [-l mp,mb,s] [-T trace.json]\n"
+               "            [-n runs] [-B save.json] [-C baseline.json] [-x percent] -b <input>\n"
+               "  <device> is an fbdev node (/dev/fb0) or a DRM card (/dev/dri/card0)\n"
+               "  -p  show interlaced PNGs pass by pass while loading\n"
+               "  -d  ordered dither matrix size on 16 and 8 bpp displays (default 4, 0 = off)\n"
+               "  -c  only write changed spans to the framebuffer (slow deferred-I/O displays)\n"
+               "  -t  task pool worker threads (default: one less than the number of CPUs)\n"
+               "  -m  ICC profile of the display; images are converted to it from their embedded\n"
+               "      profile (or sRGB), and to sRGB from their profile when -m is not given\n"
+               "  -s  sharpen downscaled images with an unsharp mask of this amount (0 to 4, default 0 = off)\n"
+               "  -l  refuse images over mp megapixels, or that take more than mb megabytes or s CPU\n"
+               "      seconds to decode (default 256,2048,10; 0 = no limit)\n"
+               "  -R  real time: present under SCHED_FIFO at this priority (1 to 99), lock memory\n"
+               "      and fault in the buffers up front (needs root)\n"
+               "  -A  pin the render thread to these CPUs (\"3\", \"2-3\"), and the task pool to the\n"
+               "      ones after a '/' (\"3/0-2\")\n"
+               "  -i  read keys from this evdev device instead of every keyboard under /dev/input,\n"
+               "      or only from the terminal with 'none'\n"
+               "  -T  write a timeline of every thread to this file on exit (chrome://tracing)\n"
+               "  -b  benchmark resizing <input> to 3840x2160 on 1 to 16 threads, no display needed\n"
+               "  -n  timed runs of each benchmark case, after a warm-up (default 15)\n"
+               "  -B  save the benchmark samples to this JSON file\n"
+               "  -C  compare with a saved benchmark and exit with 2 if a case got slower by more\n"
+               "      than -x percent (default 5) beyond noise\n"
+               "Example: zfbv /dev/fb0 images/test2.jpg\n");
+        return 1;
     }
 
-    fb->width = vinfo.xres;
-    fb->height = vinfo.yres;
-    fb->bpp = vinfo.bits_per_pixel / 8;
-
-    int screensize = fb->width * fb->height * fb->bpp;
-    fb->fbp = (char *) mmap(0, screensize, PROT_READ | PROT_WRITE, MAP_SHARED, fb->fd, 0);
-    if (fb->fbp == MAP_FAILED) {
-        printf("Failed to map framebuffer\n");
-        close(fb->fd);
-        free(fb);
-        return NULL;
+    zfbv_display *display = zfbv_open(argv[optind], &opt);
+    if (display == NULL) {
+        return 1;
     }
-
-    fb->buffer = malloc(screensize);
-    if (fb->buffer == NULL) {
-        printf("Failed to allocate framebuffer buffer\n");
-        munmap(fb->fbp, screensize);
-        close(fb->fd);
-        free(fb);        return NULL;
+    if (realtime && !zfbv_realtime(display, &rt)) {
+        printf("Continuing without all of the real-time settings\n");
     }
-    printf("Framebuffer opened: %dx%d, %d bpp\n", fb->width, fb->height, fb->bpp);
-    return fb;
-}
-
-void framebuffer_destroy(framebuffer *fb) {
-    if (fb == NULL) return;
-    int screensize = fb->width * fb->height * fb->bpp;
-    munmap(fb->fbp, screensize);
-    close(fb->fd);
-    free(fb->buffer);
-    free(fb);
-}
-
-void framebuffer_update(framebuffer *fb) {
-    if (fb == NULL || fb->buffer == NULL || fb->fbp == NULL) return;
-    int screensize = fb->width * fb->height * fb->bpp;
-    memcpy(fb->fbp, fb->buffer, screensize);
-}
-
-void framebuffer_clear_color(framebuffer *fb, uint8_t r, uint8_t g, uint8_t b) {
-    if (fb == NULL || fb->fbp == NULL) return;
-    int screensize = fb->width * fb->height * fb->bpp;
-    int bpp = fb->bpp;
-    
-    if (bpp < 3) {
-        printf("Unsupported bits per pixel: %d\n", bpp * 8);
-        return;
+    zfbv_image *img = zfbv_load(display, argv[optind + 1]);
+    if (img == NULL) {
+        zfbv_close(display);
+        return 1;
     }
 
-    for (int i = 0; i < screensize; i += fb->bpp) {
-        fb->buffer[i] = b;
-        fb->buffer[i + 1] = g;
-        fb->buffer[i + 2] = r;
+    view v = { { 0.0f, 0, 0 }, zfbv_fit_scale(display, img), 0, 0, { 0 }, 0, { 0 } };
+    v.transform.scale = v.default_scale;
+    if (!zfbv_render(display, img, &v.transform)) {
+        zfbv_image_free(img);
+        zfbv_close(display);
+        return 1;
     }
-}
-
-void framebuffer_draw_image(framebuffer *fb, int x_offset, int y_offset, Image *img) {
-    if (fb == NULL || img == NULL) return;
-
-    int screen_x_start = (x_offset < 0) ? 0 : x_offset;
-    int screen_y_start = (y_offset < 0) ? 0 : y_offset;
-    int screen_x_end = (x_offset + img->width > fb->width) ? fb->width : x_offset + img->width;
-    int screen_y_end = (y_offset + img->height > fb->height) ? fb->height : y_offset + img->height;
-
-    if (screen_x_start >= screen_x_end || screen_y_start >= screen_y_end) {
-        return;
+    zfbv_stats stats;
+    zfbv_get_stats(display, &stats);
+    v.width = stats.width;
+    v.height = stats.height;
+    view_reset_lens(&v);
+
+    input_devices in = { 0 };
+    if (input_device == NULL || strcmp(input_device, "none") != 0) {
+        input_open(&in, input_device);
     }
 
-
-    int bpp = fb->bpp;
-    if (bpp < 3) {
-        printf("Unsupported bits per pixel: %d\n", bpp * 8);
-        return;
+    // config terminal
+    struct termios oldt, newt;
+    int tty = tcgetattr(STDIN_FILENO, &oldt) == 0;
+    newt = oldt;
+    newt.c_lflag &= ~(ICANON | ECHO);
+    if (tty) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &newt);
     }
 
 
-    for (int y = screen_y_start; y < screen_y_end; y++) {
-        int fb_row_offset = y * fb->width * fb->bpp;
-    
-        int img_y = y - y_offset;
-        int img_row_offset = img_y * img->width * img->bpp;
+    // main loop: present, then wait for input; while keys are held the
+    // view moves on every FRAME_MS
+    int running = 1;
+    int stdin_open = 1;
+    double last = now_seconds();
+    zfbv_present(display);
+    while (running && (stdin_open || in.count > 0)) {
+        struct pollfd fds[1 + INPUT_MAX_DEVICES];
+        int nfds = 0;
+        if (stdin_open) {
+            fds[nfds++] = (struct pollfd) { STDIN_FILENO, POLLIN, 0 };
+        }
+        for (int i = 0; i < in.count; i++) {
+            fds[nfds++] = (struct pollfd) { in.fds[i], POLLIN, 0 };
+        }
+        if (poll(fds, nfds, view_holding(&v) ? FRAME_MS : -1) == -1 && errno != EINTR) {
+            break;
+        }
 
-        for (int x = screen_x_start; x < screen_x_end; x++) {
-            int img_x = x - x_offset;
-            
-            int fb_idx = fb_row_offset + (x * fb->bpp);
-            int img_idx = img_row_offset + (img_x * img->bpp);
+        double now = now_seconds();
+        view before = v;
+        for (int i = 0; i < nfds && running; i++) {
+            if (fds[i].revents == 0) continue;
+            if (fds[i].fd == STDIN_FILENO) {
+                char chars[64];
+                ssize_t len = read(STDIN_FILENO, chars, sizeof(chars));
+                if (len <= 0) {
+                    stdin_open = 0;
+                }
+                for (ssize_t k = 0; k < len; k++) {
+                    action a = char_action(chars[k]);
+                    running = running && a != ACTION_QUIT;
+                    view_step(&v, a);
+                }
+                continue;
+            }
 
-            for (int c = 0; c < img->bpp; c++) {
-                fb->buffer[fb_idx + c] = img->data[img_idx + img->bpp - 1 - c];
+            int d = input_find(&in, fds[i].fd);
+            struct input_event events[64];
+            ssize_t len = read(fds[i].fd, events, sizeof(events));
+            if (len == -1 && errno != EAGAIN && errno != EINTR) {
+                // unplugged: stop listening to it, and its keys are up
+                close(fds[i].fd);
+                view_sync_device(&v, &in, d, 0, now);
+                input_remove(&in, d);
+                continue;
             }
+            for (ssize_t k = 0; k < len / (ssize_t) sizeof(struct input_event); k++) {
+                if (events[k].type == EV_SYN && events[k].code == SYN_DROPPED) {
+                    in.dropped[d] = 1;
+                    continue;
+                }
+                if (in.dropped[d]) {
+                    // the kernel's buffer overran: drop the rest of the report,
+                    // then take the key state from the device
+                    if (events[k].type == EV_SYN && events[k].code == SYN_REPORT) {
+                        in.dropped[d] = 0;
+                        view_sync_device(&v, &in, d, input_keys_down(fds[i].fd), now);
+                    }
+                    continue;
+                }
+                if (events[k].type != EV_KEY) continue;
+                action a = key_action(events[k].code);
+                if (a == ACTION_NONE) continue;
+                if (events[k].value == 1) { // press: one step now, continuous after HOLD_DELAY
+                    running = running && a != ACTION_QUIT;
+                    view_step(&v, a);
+                    v.held[a] = now;
+                    in.held[d] |= 1u << a;
+                }
+                else if (events[k].value == 0) {
+                    // another keyboard may still hold the same action
+                    in.held[d] &= ~(1u << a);
+                    if (!input_holding(&in, a)) v.held[a] = 0.0;
+                }
+                // value 2 is the kernel's autorepeat, which the hold timing replaces
+            }
+        }
+        if (!running) break;
+
+        int changed = view_hold(&v, now, now - last);
+        last = now;
+        changed = changed || memcmp(&v.transform, &before.transform, sizeof(v.transform)) != 0 ||
+                  v.loupe != before.loupe || memcmp(&v.lens, &before.lens, sizeof(v.lens)) != 0;
+        if (!changed) continue;
+
+        // clamp scale, and keep the lens centre on the display
+        v.transform.scale = v.transform.scale < 0.1f ? 0.1f : v.transform.scale;
+        v.transform.scale = v.transform.scale > 5.0f ? 5.0f : v.transform.scale;
+        v.lens.scale = v.lens.scale < 0.25f ? 0.25f : v.lens.scale > 16.0f ? 16.0f : v.lens.scale;
+        v.lens.x = v.lens.x < 0 ? 0 : v.lens.x > v.width ? v.width : v.lens.x;
+        v.lens.y = v.lens.y < 0 ? 0 : v.lens.y > v.height ? v.height : v.lens.y;
+
+        // the loupe only redraws and presents the old and new lens areas
+        // while the image stays put
+        if (v.loupe) {
+            zfbv_render_loupe(display, img, &v.transform, &v.lens);
+        }
+        else {
+            zfbv_render(display, img, &v.transform);
         }
+        zfbv_present(display);
     }
-}
+    input_close(&in);
 
+    zfbv_get_stats(display, &stats);
 
+    // cleanup
+    zfbv_image_free(img);
+    zfbv_close(display);
 
-Image *Image_load(const char *filename) {
-    Image *img = malloc(sizeof(Image));
-    if (img == NULL) {
-        printf("Failed to allocate Image struct\n");
-        return NULL;
+    // restore terminal
+    if (tty) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
     }
 
-    img->data = stbi_load(filename, &img->width, &img->height, NULL, 3);
-    if (img->data == NULL) {
-        printf("Failed to load image: %s\n", filename);
-        free(img);
-        return NULL;
+    if (trace != NULL) {
+        zfbv_trace_write(trace);
     }
-    img->bpp = 3;
-    img->stride = img->width * img->bpp;
-    return img;
-}
 
-void Image_free(Image *img) {
-    if (img == NULL) return;
-    if (img->data != NULL) {
-        stbi_image_free(img->data);
+    if (stats.updates > 0) {
+        printf("%d updates, %zu bytes written to the framebuffer (%.1f%% of full-frame copies)\n",
+               stats.updates, stats.total_bytes_written,
+               100.0 * stats.total_bytes_written / ((double) stats.frame_bytes * stats.updates));
+        printf("worst present %.2f ms, %d late (missed a vblank)\n", stats.worst_present_seconds * 1e3,
+               stats.late_presents);
     }
-    free(img);
+    return 0;
 }
-
-Image *Image_resize_linear(Image *src, int new_width, int new_height) {
-    Image *resized = malloc(sizeof(Image));
-    if (resized == NULL) {
-        printf("Failed to allocate resized Image struct\n");
-        return NULL;
-    }
-
-    resized->width = new_width;
-    resized->height = new_height;
-    resized->bpp = src->bpp;
-    resized->stride = resized->width * resized->bpp;
-    resized->data = malloc(resized->height * resized->stride);
-    if (resized->data == NULL) {
-        printf("Failed to allocate resized image data\n");
-        free(resized);
-        return NULL;    
-    }
-
-    float x_ratio = (float) src->width / (float) new_width;
-    float y_ratio = (float) src->height / (float) new_height;
-
-    for (int y = 0; y < new_height; y++) {
-        for (int x = 0; x < new_width; x++) {
-            int src_x = (int) (x * x_ratio);
-            int src_y = (int) (y * y_ratio);
-            int src_index = src_y * src->stride + src_x * src->bpp;
-            int dst_index = y * resized->stride + x * resized->bpp;
-            for (int c = 0; c < src->bpp; c++) {
-                resized->data[dst_index + c] = src->data[src_index + c];
-            }
-        }
-    }
-
-    return resized;
-}
\ No newline at end of file
@@ -524,6 +524,77 @@ STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpre
 STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert);
 STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
 
+#ifndef STBI_NO_PNG
+// progressive display of Adam7-interlaced PNGs: after each of the first six
+// passes the callback receives a full-size preview in which every pixel
+// decoded so far is replicated over the part of its 8x8 interlace block that
+// later passes have not filled yet. Previews are 8 bits per channel with the
+// requested channel count and are not vertically flipped. For streamed input
+// the IDAT data is inflated as it arrives, so the pass-1 preview shows up
+// after roughly 1/64 of the image data. Pass NULL to disable. The callback
+// is per thread (where thread-local storage is available): it only applies
+// to loads made on the thread that set it.
+typedef void stbi_png_pass_callback(void *user, stbi_uc const *pixels, int x, int y, int channels, int pass);
+STBIDEF void stbi_set_png_pass_callback(stbi_png_pass_callback *callback, void *user);
+#endif
+
+#ifndef STBI_NO_JPEG
+// multithreaded JPEG decoding. With a pool set, baseline JPEGs are decoded as
+// a pipeline: the calling thread does the Huffman decoding while the IDCT,
+// upsampling and colour conversion of earlier MCU rows run as tasks. 'start'
+// runs fn(arg, index) on another thread and returns a handle for 'finish',
+// which waits for it (it may also run the task itself and return NULL).
+// 'threads' is how many tasks can make progress at once; below 2 the pool
+// is not used. Output is identical to single-threaded decoding. The pool is
+// global, not per thread; pass NULL to disable.
+typedef void stbi_task_func(void *arg, int index);
+typedef struct
+{
+   void *(*start)(void *user, stbi_task_func *fn, void *arg, int index);
+   void  (*finish)(void *user, void *task);
+   int   threads;
+   void *user;
+} stbi_thread_pool;
+STBIDEF void stbi_set_thread_pool(stbi_thread_pool const *pool);
+
+// JPEG loading without colour conversion. For JPEGs stored as YCbCr with
+// full-resolution luma and two equally subsampled chroma planes, returns the
+// planes as they are in the file, back to back: Y (x*y bytes), then Cb and Cr
+// (cx*cy bytes each, cx = ceil(x / chroma_x), cy = ceil(y / chroma_y)). Any
+// other JPEG is returned as interleaved RGB like stbi_load(..., 3), with
+// *chroma_x and *chroma_y set to 0. Fails for non-JPEG input. The result is
+// never flipped vertically; free it with stbi_image_free.
+STBIDEF stbi_uc *stbi_load_jpeg_ycbcr_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *chroma_x, int *chroma_y);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_jpeg_ycbcr(char const *filename, int *x, int *y, int *chroma_x, int *chroma_y);
+#endif
+#endif
+
+// embedded ICC colour profiles (JPEG APP2 ICC_PROFILE segments, PNG iCCP).
+// Returns the profile of the last image loaded on this thread, or NULL if
+// it had none, and hands it over to the caller: free it with
+// stbi_image_free. Every load replaces it; the profile of a failed load is
+// dropped. Profiles are returned as stored, not parsed or validated.
+STBIDEF stbi_uc *stbi_icc_profile(int *len);
+
+// runtime limits for untrusted input, on top of STBI_MAX_DIMENSIONS. A load
+// fails with "over budget" once the image is larger than max_pixels (width
+// times height), once it has allocated more than max_bytes in total, or once
+// it has used more than max_seconds of processor time. Time is the decoding
+// thread's own (CLOCK_THREAD_CPUTIME_ID) plus that of the tasks it runs on
+// the thread pool, wherever they run, and not the pool's other work, and is
+// checked cooperatively between MCU rows, scanlines, deflate blocks and runs
+// of GIF codes. Every load is charged separately, also one that starts on a
+// thread waiting for another load's pool tasks. A field of 0 means no limit.
+// The limits are global, not per thread; pass NULL to remove them.
+typedef struct
+{
+   double max_pixels;
+   size_t max_bytes;
+   double max_seconds;
+} stbi_decode_limits;
+STBIDEF void stbi_set_decode_limits(stbi_decode_limits const *limits);
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -589,6 +660,7 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>  // clock_gettime, clock
 
 #if !defined(STBI_NO_LINEAR) || !defined(STBI_NO_HDR)
 #include <math.h>  // ldexp, pow
@@ -750,7 +822,7 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_HDR)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
@@ -761,7 +833,7 @@ static int stbi__sse2_available(void)
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_HDR)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -940,6 +1012,7 @@ static int      stbi__psd_is16(stbi__context *s);
 #ifndef STBI_NO_HDR
 static int      stbi__hdr_test(stbi__context *s);
 static float   *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri);
+static stbi_uc *stbi__hdr_load_ldr(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri);
 static int      stbi__hdr_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
@@ -974,6 +1047,35 @@ STBIDEF const char *stbi_failure_reason(void)
    return stbi__g_failure_reason;
 }
 
+static
+#ifdef STBI_THREAD_LOCAL
+STBI_THREAD_LOCAL
+#endif
+stbi_uc *stbi__g_icc;
+
+static
+#ifdef STBI_THREAD_LOCAL
+STBI_THREAD_LOCAL
+#endif
+int stbi__g_icc_len;
+
+// takes ownership of 'profile' (NULL to clear)
+static void stbi__set_icc(stbi_uc *profile, int len)
+{
+   STBI_FREE(stbi__g_icc);
+   stbi__g_icc = profile;
+   stbi__g_icc_len = profile ? len : 0;
+}
+
+STBIDEF stbi_uc *stbi_icc_profile(int *len)
+{
+   stbi_uc *profile = stbi__g_icc;
+   if (len) *len = stbi__g_icc_len;
+   stbi__g_icc = NULL;
+   stbi__g_icc_len = 0;
+   return profile;
+}
+
 #ifndef STBI_NO_FAILURE_STRINGS
 static int stbi__err(const char *str)
 {
@@ -982,11 +1084,21 @@ static int stbi__err(const char *str)
 }
 #endif
 
+static int stbi__budget_alloc(size_t size);
+
 static void *stbi__malloc(size_t size)
 {
+    if (!stbi__budget_alloc(size)) return NULL;
     return STBI_MALLOC(size);
 }
 
+// STBI_REALLOC_SIZED, charging any growth to the decode budget
+static void *stbi__realloc_sized(void *p, size_t oldsz, size_t newsz)
+{
+   if (newsz > oldsz && !stbi__budget_alloc(newsz - oldsz)) return NULL;
+   return STBI_REALLOC_SIZED(p, oldsz, newsz);
+}
+
 // stb_image uses ints pervasively, including for offset calculations.
 // therefore the largest decoded image size we can support with the
 // current code, even on 64-bit targets, is INT_MAX. this is not a
@@ -1098,6 +1210,104 @@ static int stbi__mul2shorts_valid(int a, int b)
 #define stbi__errpf(x,y)   ((float *)(size_t) (stbi__err(x,y)?NULL:NULL))
 #define stbi__errpuc(x,y)  ((unsigned char *)(size_t) (stbi__err(x,y)?NULL:NULL))
 
+// decode budget of the load running on this thread (see stbi_set_decode_limits)
+typedef struct stbi__budget
+{
+   size_t bytes;
+   double start;  // thread processor time when the load began
+   double waited; // of that, spent starting and waiting for pool tasks
+   double tasks;  // processor time of the load's own pool tasks
+   int exceeded;
+   struct stbi__budget *outer; // of the load this one is nested in
+} stbi__budget;
+
+static stbi_decode_limits stbi__decode_limits;
+
+static
+#ifdef STBI_THREAD_LOCAL
+STBI_THREAD_LOCAL
+#endif
+stbi__budget *stbi__g_budget;
+
+// processor time of the calling thread, in seconds
+static double stbi__thread_seconds(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+   struct timespec ts;
+   if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+      return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+   return (double) clock() / CLOCKS_PER_SEC; // the whole process
+}
+
+STBIDEF void stbi_set_decode_limits(stbi_decode_limits const *limits)
+{
+   if (limits) stbi__decode_limits = *limits;
+   else memset(&stbi__decode_limits, 0, sizeof(stbi__decode_limits));
+}
+
+// starts charging this thread to 'b', or to nothing when there are no
+// limits. A load nested in another one on the same thread (the pool running
+// another image's load while this thread waits) gets a budget of its own,
+// and the outer one is set aside until stbi__budget_end.
+static void stbi__budget_begin(stbi__budget *b)
+{
+   stbi_decode_limits *l = &stbi__decode_limits;
+   int limited = l->max_pixels > 0 || l->max_bytes != 0 || l->max_seconds > 0;
+   b->outer = stbi__g_budget;
+   b->bytes = 0;
+   b->start = limited || b->outer ? stbi__thread_seconds() : 0;
+   b->waited = 0;
+   b->tasks = 0;
+   b->exceeded = 0;
+   stbi__g_budget = limited ? b : NULL;
+}
+
+static int stbi__budget_fail(void)
+{
+   stbi__g_budget->exceeded = 1;
+   return stbi__err("over budget","Image exceeds the decode limits");
+}
+
+static void stbi__budget_end(stbi__budget *b)
+{
+   // the failure usually surfaces as some other error (e.g. "outofmem" from
+   // the allocation that was refused), so restate the real reason
+   if (b->exceeded) stbi__err("over budget","Image exceeds the decode limits");
+   // a nested load's time is not the outer load's own
+   if (b->outer) b->outer->waited += stbi__thread_seconds() - b->start;
+   stbi__g_budget = b->outer;
+}
+
+static int stbi__budget_alloc(size_t size)
+{
+   stbi__budget *b = stbi__g_budget;
+   if (!b || stbi__decode_limits.max_bytes == 0) return 1;
+   if (b->exceeded || size > stbi__decode_limits.max_bytes - b->bytes) return stbi__budget_fail();
+   b->bytes += size;
+   return 1;
+}
+
+static int stbi__budget_pixels(int w, int h)
+{
+   if (!stbi__g_budget || stbi__decode_limits.max_pixels <= 0) return 1;
+   if ((double) w * h > stbi__decode_limits.max_pixels) return stbi__budget_fail();
+   return 1;
+}
+
+// called from the decode loops; 0 once the load is out of time (or has
+// already failed its budget)
+static int stbi__budget_ok(void)
+{
+   stbi__budget *b = stbi__g_budget;
+   if (!b) return 1;
+   if (b->exceeded) return 0;
+   if (stbi__decode_limits.max_seconds > 0 &&
+       stbi__thread_seconds() - b->start - b->waited + b->tasks > stbi__decode_limits.max_seconds)
+      return stbi__budget_fail();
+   return 1;
+}
+
 STBIDEF void stbi_image_free(void *retval_from_stbi_load)
 {
    STBI_FREE(retval_from_stbi_load);
@@ -1140,6 +1350,7 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
    ri->bits_per_channel = 8; // default is 8 so most paths don't have to be changed
    ri->channel_order = STBI_ORDER_RGB; // all current input & output are this, but this is here so we can add BGR order
    ri->num_channels = 0;
+   stbi__set_icc(NULL, 0);
 
    // test the formats with a very explicit header first (at least a FOURCC
    // or distinctive magic number first)
@@ -1173,7 +1384,10 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
 
    #ifndef STBI_NO_HDR
    if (stbi__hdr_test(s)) {
-      float *hdr = stbi__hdr_load(s, x,y,comp,req_comp, ri);
+      float *hdr;
+      if (req_comp == 0 || req_comp >= 3)
+         return stbi__hdr_load_ldr(s, x,y,comp,req_comp, ri);
+      hdr = stbi__hdr_load(s, x,y,comp,req_comp, ri);
       return stbi__hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp);
    }
    #endif
@@ -1260,7 +1474,11 @@ static void stbi__vertical_flip_slices(void *image, int w, int h, int z, int byt
 static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
-   void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
+   stbi__budget budget;
+   void *result;
+   stbi__budget_begin(&budget);
+   result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
+   stbi__budget_end(&budget);
 
    if (result == NULL)
       return NULL;
@@ -1286,7 +1504,11 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
-   void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
+   stbi__budget budget;
+   void *result;
+   stbi__budget_begin(&budget);
+   result = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
+   stbi__budget_end(&budget);
 
    if (result == NULL)
       return NULL;
@@ -1445,9 +1667,12 @@ STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int *
 {
    unsigned char *result;
    stbi__context s;
+   stbi__budget budget;
    stbi__start_mem(&s,buffer,len);
 
+   stbi__budget_begin(&budget);
    result = (unsigned char*) stbi__load_gif_main(&s, delays, x, y, z, comp, req_comp);
+   stbi__budget_end(&budget);
    if (stbi__vertically_flip_on_load) {
       stbi__vertical_flip_slices( result, *x, *y, *z, *comp );
    }
@@ -1463,7 +1688,11 @@ static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int
    #ifndef STBI_NO_HDR
    if (stbi__hdr_test(s)) {
       stbi__result_info ri;
-      float *hdr_data = stbi__hdr_load(s,x,y,comp,req_comp, &ri);
+      stbi__budget budget;
+      float *hdr_data;
+      stbi__budget_begin(&budget);
+      hdr_data = stbi__hdr_load(s,x,y,comp,req_comp, &ri);
+      stbi__budget_end(&budget);
       if (hdr_data)
          stbi__float_postprocess(hdr_data,x,y,comp,req_comp);
       return hdr_data;
@@ -1660,7 +1889,7 @@ static void stbi__skip(stbi__context *s, int n)
 }
 #endif
 
-#if defined(STBI_NO_PNG) && defined(STBI_NO_TGA) && defined(STBI_NO_HDR) && defined(STBI_NO_PNM)
+#if defined(STBI_NO_PNG) && defined(STBI_NO_TGA) && defined(STBI_NO_HDR) && defined(STBI_NO_PNM) && defined(STBI_NO_GIF)
 // nothing
 #else
 static int stbi__getn(stbi__context *s, stbi_uc *buffer, int n)
@@ -1994,9 +2223,20 @@ typedef struct
    int scan_n, order[4];
    int restart_interval, todo;
 
+   int req_comp;
+   stbi_uc *pipe_output; // set when the image was decoded and converted by stbi__jpeg_pipeline_scan
+   int planar;           // return YCbCr planes when possible (stbi_load_jpeg_ycbcr)
+   int chroma_x, chroma_y;
+
+   stbi_uc *icc;         // ICC profile from the APP2 segments seen so far
+   int icc_len;
+   int icc_segments;     // segments appended, -1 once they came out of order
+
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
+   void (*CMYK_to_RGB_kernel)(stbi_uc *out, const stbi_uc *c, const stbi_uc *m, const stbi_uc *y, const stbi_uc *k, int count, int step);
+   void (*YCCK_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, const stbi_uc *k, int count, int step);
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
 } stbi__jpeg;
 
@@ -2961,6 +3201,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
          for (j=0; j < h; ++j) {
+            if (!stbi__budget_ok()) return 0;
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
                if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
@@ -2980,6 +3221,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          int i,j,k,x,y;
          STBI_SIMD_ALIGN(short, data[64]);
          for (j=0; j < z->img_mcu_y; ++j) {
+            if (!stbi__budget_ok()) return 0;
             for (i=0; i < z->img_mcu_x; ++i) {
                // scan an interleaved mcu... process scan_n components in order
                for (k=0; k < z->scan_n; ++k) {
@@ -3018,6 +3260,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
          for (j=0; j < h; ++j) {
+            if (!stbi__budget_ok()) return 0;
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
                if (z->spec_start == 0) {
@@ -3040,6 +3283,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
       } else { // interleaved
          int i,j,k,x,y;
          for (j=0; j < z->img_mcu_y; ++j) {
+            if (!stbi__budget_ok()) return 0;
             for (i=0; i < z->img_mcu_x; ++i) {
                // scan an interleaved mcu... process scan_n components in order
                for (k=0; k < z->scan_n; ++k) {
@@ -3077,25 +3321,156 @@ static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
       data[i] *= dequant[i];
 }
 
-static void stbi__jpeg_finish(stbi__jpeg *z)
+static stbi_thread_pool stbi__thread_pool;
+
+STBIDEF void stbi_set_thread_pool(stbi_thread_pool const *pool)
 {
-   if (z->progressive) {
-      // dequantize and idct the data
-      int i,j,n;
-      for (n=0; n < z->s->img_n; ++n) {
-         int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
-         for (j=0; j < h; ++j) {
-            for (i=0; i < w; ++i) {
-               short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-               stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
-            }
+   if (pool) stbi__thread_pool = *pool;
+   else memset(&stbi__thread_pool, 0, sizeof(stbi__thread_pool));
+}
+
+// a pool task of the load on this thread. The thread's own processor time
+// spent in the pool's start and finish (running this or other tasks while
+// it waits) is not the load's; the task's time, wherever it ran, is. Tasks
+// run without a budget, also when the pool runs them on a loading thread.
+typedef struct
+{
+   stbi_task_func *fn;
+   void *arg;
+   void *handle;
+   double seconds;
+} stbi__task;
+
+static void stbi__task_timed(void *arg, int index)
+{
+   stbi__task *t = (stbi__task *) arg;
+   stbi__budget *b = stbi__g_budget;
+   double start = stbi__thread_seconds();
+   stbi__g_budget = NULL;
+   t->fn(t->arg, index);
+   stbi__g_budget = b;
+   t->seconds = stbi__thread_seconds() - start;
+}
+
+static void *stbi__task_start(stbi_task_func *fn, void *arg, int index)
+{
+   stbi__task *t = (stbi__task *) STBI_MALLOC(sizeof(stbi__task));
+   stbi__budget *b = stbi__g_budget;
+   double start, waited;
+   if (!t) {
+      fn(arg, index);
+      return NULL;
+   }
+   t->fn = fn;
+   t->arg = arg;
+   t->seconds = 0;
+   // set rather than added to, as loads nested in the call also add theirs
+   start = stbi__thread_seconds();
+   waited = b ? b->waited : 0;
+   t->handle = stbi__thread_pool.start(stbi__thread_pool.user, stbi__task_timed, t, index);
+   if (b) b->waited = waited + stbi__thread_seconds() - start;
+   return t;
+}
+
+static void stbi__task_finish(void **task)
+{
+   stbi__task *t = (stbi__task *) *task;
+   stbi__budget *b = stbi__g_budget;
+   double start, waited;
+   if (!t) return;
+   start = stbi__thread_seconds();
+   waited = b ? b->waited : 0;
+   if (t->handle) stbi__thread_pool.finish(stbi__thread_pool.user, t->handle);
+   if (b) {
+      b->waited = waited + stbi__thread_seconds() - start;
+      b->tasks += t->seconds;
+   }
+   STBI_FREE(t);
+   *task = NULL;
+}
+
+#define STBI__MAX_BANDS 64
+
+// number of bands to split 'rows' rows into for the thread pool, or 1
+static int stbi__task_bands(int rows, int min_rows)
+{
+   int bands = stbi__thread_pool.threads * 2;
+   if (!stbi__thread_pool.start || stbi__thread_pool.threads < 2) return 1;
+   if (bands > STBI__MAX_BANDS) bands = STBI__MAX_BANDS;
+   if (bands > rows / min_rows) bands = rows / min_rows;
+   return bands > 1 ? bands : 1;
+}
+
+// runs fn(arg, 0..count-1) on the thread pool and waits for all of them
+static void stbi__task_run(stbi_task_func *fn, void *arg, int count)
+{
+   void *task[STBI__MAX_BANDS];
+   int i;
+   for (i=1; i < count; ++i)
+      task[i] = stbi__task_start(fn, arg, i);
+   fn(arg, 0);
+   for (i=1; i < count; ++i)
+      stbi__task_finish(&task[i]);
+}
+
+typedef struct
+{
+   stbi__jpeg *z;
+   int bands;
+} stbi__jpeg_finish_job;
+
+// dequantize and idct band b of the block rows of every component
+static void stbi__jpeg_finish_band(void *arg, int b)
+{
+   stbi__jpeg_finish_job *job = (stbi__jpeg_finish_job *) arg;
+   stbi__jpeg *z = job->z;
+   int i,j,n;
+   for (n=0; n < z->s->img_n; ++n) {
+      int w = (z->img_comp[n].x+7) >> 3;
+      int h = (z->img_comp[n].y+7) >> 3;
+      for (j=h*b/job->bands; j < h*(b+1)/job->bands; ++j) {
+         for (i=0; i < w; ++i) {
+            short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+            stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
+            z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
          }
       }
    }
 }
 
+static void stbi__jpeg_finish(stbi__jpeg *z)
+{
+   if (z->progressive) {
+      // dequantize and idct the data, in bands of block rows when there is a pool
+      stbi__jpeg_finish_job job;
+      job.z = z;
+      job.bands = stbi__task_bands(z->img_mcu_y, 2);
+      stbi__task_run(stbi__jpeg_finish_band, &job, job.bands);
+   }
+}
+
+// appends the 'len' bytes of ICC profile segment 'seq' to z->icc. Profiles
+// whose segments are not in order are dropped rather than reassembled.
+static int stbi__jpeg_add_icc(stbi__jpeg *z, int seq, int len)
+{
+   stbi_uc *p;
+   if (z->icc_segments < 0 || seq != z->icc_segments + 1) {
+      STBI_FREE(z->icc);
+      z->icc = NULL;
+      z->icc_len = 0;
+      z->icc_segments = -1;
+      stbi__skip(z->s, len);
+      return 1;
+   }
+   p = (stbi_uc *) stbi__realloc_sized(z->icc, z->icc_len, z->icc_len + len);
+   if (!p) return stbi__err("outofmem", "Out of memory");
+   z->icc = p;
+   if (!stbi__getn(z->s, z->icc + z->icc_len, len)) return stbi__err("bad APP len", "Corrupt JPEG");
+   z->icc_len += len;
+   z->icc_segments = seq;
+   return 1;
+}
+
 static int stbi__process_marker(stbi__jpeg *z, int m)
 {
    int L;
@@ -3190,6 +3565,21 @@ static int stbi__process_marker(stbi__jpeg *z, int m)
             z->app14_color_transform = stbi__get8(z->s); // color transform
             L -= 6;
          }
+      } else if (m == 0xE2 && L >= 14) { // ICC profile APP2 segment
+         static const unsigned char tag[12] = {'I','C','C','_','P','R','O','F','I','L','E','\0'};
+         int ok = 1;
+         int i;
+         for (i=0; i < 12; ++i)
+            if (stbi__get8(z->s) != tag[i])
+               ok = 0;
+         L -= 12;
+         if (ok) {
+            int seq = stbi__get8(z->s); // 1-based segment number
+            stbi__get8(z->s); // number of segments
+            L -= 2;
+            if (!stbi__jpeg_add_icc(z, seq, L)) return 0;
+            L = 0;
+         }
       }
 
       stbi__skip(z->s, L);
@@ -3271,6 +3661,7 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
    s->img_x = stbi__get16be(s);   if (s->img_x == 0) return stbi__err("0 width","Corrupt JPEG"); // JPEG requires
    if (s->img_y > STBI_MAX_DIMENSIONS) return stbi__err("too large","Very large image (corrupt?)");
    if (s->img_x > STBI_MAX_DIMENSIONS) return stbi__err("too large","Very large image (corrupt?)");
+   if (!stbi__budget_pixels(s->img_x, s->img_y)) return 0;
    c = stbi__get8(s);
    if (c != 3 && c != 1 && c != 4) return stbi__err("bad component count","Corrupt JPEG");
    s->img_n = c;
@@ -3408,10 +3799,12 @@ static stbi_uc stbi__skip_jpeg_junk_at_end(stbi__jpeg *j)
    return STBI__MARKER_none;
 }
 
+static int stbi__jpeg_pipeline_scan(stbi__jpeg *z);
+
 // decode image to YCbCr format
 static int stbi__decode_jpeg_image(stbi__jpeg *j)
 {
-   int m;
+   int m, r;
    for (m = 0; m < 4; m++) {
       j->img_comp[m].raw_data = NULL;
       j->img_comp[m].raw_coeff = NULL;
@@ -3422,7 +3815,9 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
          if (!stbi__process_scan_header(j)) return 0;
-         if (!stbi__parse_entropy_coded_data(j)) return 0;
+         r = stbi__jpeg_pipeline_scan(j); // -1 if the scan can't be pipelined
+         if (r < 0) r = stbi__parse_entropy_coded_data(j);
+         if (!r) return 0;
          if (j->marker == STBI__MARKER_none ) {
          j->marker = stbi__skip_jpeg_junk_at_end(j);
             // if we reach eof without hitting a marker, stbi__get_marker() below will fail and we'll eventually return 0
@@ -3682,6 +4077,45 @@ static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc
    }
 }
 
+#ifdef STBI_SSE2
+// YCbCr to RGB of the 8 pixels in the low halves of y/cb/cr_bytes, as
+// unclamped 16-bit R, G, B; bit-exact with stbi__YCbCr_to_RGB_row
+static void stbi__YCbCr_to_RGB_sse2(__m128i y_bytes, __m128i cb_bytes, __m128i cr_bytes, __m128i *rw, __m128i *gw, __m128i *bw)
+{
+   // this is a fairly straightforward implementation and not super-optimized.
+   __m128i signflip  = _mm_set1_epi8(-0x80);
+   __m128i cr_const0 = _mm_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+   __m128i cr_const1 = _mm_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+   __m128i cb_const0 = _mm_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+   __m128i cb_const1 = _mm_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+   __m128i y_bias = _mm_set1_epi8((char) (unsigned char) 128);
+
+   __m128i cr_biased = _mm_xor_si128(cr_bytes, signflip); // -128
+   __m128i cb_biased = _mm_xor_si128(cb_bytes, signflip); // -128
+
+   // unpack to short (and left-shift cr, cb by 8)
+   __m128i yw  = _mm_unpacklo_epi8(y_bias, y_bytes);
+   __m128i crw = _mm_unpacklo_epi8(_mm_setzero_si128(), cr_biased);
+   __m128i cbw = _mm_unpacklo_epi8(_mm_setzero_si128(), cb_biased);
+
+   // color transform
+   __m128i yws = _mm_srli_epi16(yw, 4);
+   __m128i cr0 = _mm_mulhi_epi16(cr_const0, crw);
+   __m128i cb0 = _mm_mulhi_epi16(cb_const0, cbw);
+   __m128i cb1 = _mm_mulhi_epi16(cbw, cb_const1);
+   __m128i cr1 = _mm_mulhi_epi16(crw, cr_const1);
+   __m128i rws = _mm_add_epi16(cr0, yws);
+   __m128i gwt = _mm_add_epi16(cb0, yws);
+   __m128i bws = _mm_add_epi16(yws, cb1);
+   __m128i gws = _mm_add_epi16(gwt, cr1);
+
+   // descale
+   *rw = _mm_srai_epi16(rws, 4);
+   *bw = _mm_srai_epi16(bws, 4);
+   *gw = _mm_srai_epi16(gws, 4);
+}
+#endif
+
 #if defined(STBI_SSE2) || defined(STBI_NEON)
 static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
 {
@@ -3692,43 +4126,12 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
    // it's useful in practice (you wouldn't use it for textures, for example).
    // so just accelerate step == 4 case.
    if (step == 4) {
-      // this is a fairly straightforward implementation and not super-optimized.
-      __m128i signflip  = _mm_set1_epi8(-0x80);
-      __m128i cr_const0 = _mm_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
-      __m128i cr_const1 = _mm_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
-      __m128i cb_const0 = _mm_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
-      __m128i cb_const1 = _mm_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
-      __m128i y_bias = _mm_set1_epi8((char) (unsigned char) 128);
       __m128i xw = _mm_set1_epi16(255); // alpha channel
 
       for (; i+7 < count; i += 8) {
-         // load
-         __m128i y_bytes = _mm_loadl_epi64((__m128i *) (y+i));
-         __m128i cr_bytes = _mm_loadl_epi64((__m128i *) (pcr+i));
-         __m128i cb_bytes = _mm_loadl_epi64((__m128i *) (pcb+i));
-         __m128i cr_biased = _mm_xor_si128(cr_bytes, signflip); // -128
-         __m128i cb_biased = _mm_xor_si128(cb_bytes, signflip); // -128
-
-         // unpack to short (and left-shift cr, cb by 8)
-         __m128i yw  = _mm_unpacklo_epi8(y_bias, y_bytes);
-         __m128i crw = _mm_unpacklo_epi8(_mm_setzero_si128(), cr_biased);
-         __m128i cbw = _mm_unpacklo_epi8(_mm_setzero_si128(), cb_biased);
-
-         // color transform
-         __m128i yws = _mm_srli_epi16(yw, 4);
-         __m128i cr0 = _mm_mulhi_epi16(cr_const0, crw);
-         __m128i cb0 = _mm_mulhi_epi16(cb_const0, cbw);
-         __m128i cb1 = _mm_mulhi_epi16(cbw, cb_const1);
-         __m128i cr1 = _mm_mulhi_epi16(crw, cr_const1);
-         __m128i rws = _mm_add_epi16(cr0, yws);
-         __m128i gwt = _mm_add_epi16(cb0, yws);
-         __m128i bws = _mm_add_epi16(yws, cb1);
-         __m128i gws = _mm_add_epi16(gwt, cr1);
-
-         // descale
-         __m128i rw = _mm_srai_epi16(rws, 4);
-         __m128i bw = _mm_srai_epi16(bws, 4);
-         __m128i gw = _mm_srai_epi16(gws, 4);
+         __m128i rw, gw, bw;
+         stbi__YCbCr_to_RGB_sse2(_mm_loadl_epi64((__m128i *) (y+i)), _mm_loadl_epi64((__m128i *) (pcb+i)),
+                                 _mm_loadl_epi64((__m128i *) (pcr+i)), &rw, &gw, &bw);
 
          // back to byte, set up for transpose
          __m128i brb = _mm_packus_epi16(rw, bw);
@@ -3817,17 +4220,137 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 }
 #endif
 
+// fast 0..255 * 0..255 => 0..255 rounded multiplication
+static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
+{
+   unsigned int t = x*y + 128;
+   return (stbi_uc) ((t + (t >>8)) >> 8);
+}
+
+// Adobe CMYK (APP14 transform 0): the stored channels are inverted inks, so
+// R, G, B are C, M, Y scaled by K. YCCK (transform 2) stores C, M, Y as
+// YCbCr of their inverses. Both write one byte past the row when step is 3,
+// like the YCbCr converters.
+static void stbi__CMYK_to_RGB_row(stbi_uc *out, stbi_uc const *c, stbi_uc const *m, stbi_uc const *y, stbi_uc const *k, int count, int step)
+{
+   int i;
+   for (i=0; i < count; ++i) {
+      out[0] = stbi__blinn_8x8(c[i], k[i]);
+      out[1] = stbi__blinn_8x8(m[i], k[i]);
+      out[2] = stbi__blinn_8x8(y[i], k[i]);
+      out[3] = 255;
+      out += step;
+   }
+}
+
+static void stbi__YCCK_to_RGB_row(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, stbi_uc const *k, int count, int step)
+{
+   int i;
+   stbi__YCbCr_to_RGB_row(out, y, pcb, pcr, count, step);
+   for (i=0; i < count; ++i) {
+      out[0] = stbi__blinn_8x8(255 - out[0], k[i]);
+      out[1] = stbi__blinn_8x8(255 - out[1], k[i]);
+      out[2] = stbi__blinn_8x8(255 - out[2], k[i]);
+      out += step;
+   }
+}
+
+#ifdef STBI_SSE2
+// stbi__blinn_8x8 of 16 byte pairs
+static __m128i stbi__blinn_8x8_sse2(__m128i x, __m128i k)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i bias = _mm_set1_epi16(128);
+   __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(x, zero), _mm_unpacklo_epi8(k, zero)), bias);
+   __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(x, zero), _mm_unpackhi_epi8(k, zero)), bias);
+   lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+   hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+   return _mm_packus_epi16(lo, hi);
+}
+
+// interleaves 16 pixels of R, G, B bytes into 'out' with alpha 255 (step 4)
+// or without (step 3). Step 3 writes 4 bytes past the 16 pixels, so there
+// must be at least one more pixel in the row after them.
+static void stbi__store_rgb_sse2(stbi_uc *out, __m128i r, __m128i g, __m128i b, int step)
+{
+   __m128i x = _mm_set1_epi8(-1);
+   __m128i rg0 = _mm_unpacklo_epi8(r, g), rg1 = _mm_unpackhi_epi8(r, g);
+   __m128i bx0 = _mm_unpacklo_epi8(b, x), bx1 = _mm_unpackhi_epi8(b, x);
+   __m128i p[4];
+   int q;
+   p[0] = _mm_unpacklo_epi16(rg0, bx0);
+   p[1] = _mm_unpackhi_epi16(rg0, bx0);
+   p[2] = _mm_unpacklo_epi16(rg1, bx1);
+   p[3] = _mm_unpackhi_epi16(rg1, bx1);
+   if (step == 4) {
+      for (q=0; q < 4; ++q)
+         _mm_storeu_si128((__m128i *) (out + 16*q), p[q]);
+   } else {
+      // drop every fourth byte: pixel j of each group of 4 moves down j bytes
+      __m128i m0 = _mm_setr_epi32(0x00ffffff, 0, 0, 0);
+      __m128i m1 = _mm_setr_epi32((int) 0xff000000, 0x0000ffff, 0, 0);
+      __m128i m2 = _mm_setr_epi32(0, (int) 0xffff0000, 0x000000ff, 0);
+      __m128i m3 = _mm_setr_epi32(0, 0, (int) 0xffffff00, 0);
+      for (q=0; q < 4; ++q) {
+         __m128i v = _mm_and_si128(p[q], m0);
+         v = _mm_or_si128(v, _mm_and_si128(_mm_srli_si128(p[q], 1), m1));
+         v = _mm_or_si128(v, _mm_and_si128(_mm_srli_si128(p[q], 2), m2));
+         v = _mm_or_si128(v, _mm_and_si128(_mm_srli_si128(p[q], 3), m3));
+         _mm_storeu_si128((__m128i *) (out + 12*q), v);
+      }
+   }
+}
+
+static void stbi__CMYK_to_RGB_simd(stbi_uc *out, stbi_uc const *c, stbi_uc const *m, stbi_uc const *y, stbi_uc const *k, int count, int step)
+{
+   int i = 0;
+   // step 3 stores overrun into the next pixel, so the last one is left to the scalar loop
+   for (; i+16 < count || (step == 4 && i+16 == count); i += 16) {
+      __m128i kb = _mm_loadu_si128((__m128i const *) (k+i));
+      __m128i r = stbi__blinn_8x8_sse2(_mm_loadu_si128((__m128i const *) (c+i)), kb);
+      __m128i g = stbi__blinn_8x8_sse2(_mm_loadu_si128((__m128i const *) (m+i)), kb);
+      __m128i b = stbi__blinn_8x8_sse2(_mm_loadu_si128((__m128i const *) (y+i)), kb);
+      stbi__store_rgb_sse2(out + i*step, r, g, b, step);
+   }
+   stbi__CMYK_to_RGB_row(out + i*step, c+i, m+i, y+i, k+i, count-i, step);
+}
+
+static void stbi__YCCK_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, stbi_uc const *k, int count, int step)
+{
+   int i = 0;
+   __m128i ones = _mm_set1_epi8(-1);
+   for (; i+16 < count || (step == 4 && i+16 == count); i += 16) {
+      __m128i r0, g0, b0, r1, g1, b1, r, g, b;
+      __m128i kb = _mm_loadu_si128((__m128i const *) (k+i));
+      stbi__YCbCr_to_RGB_sse2(_mm_loadl_epi64((__m128i const *) (y+i)), _mm_loadl_epi64((__m128i const *) (pcb+i)),
+                              _mm_loadl_epi64((__m128i const *) (pcr+i)), &r0, &g0, &b0);
+      stbi__YCbCr_to_RGB_sse2(_mm_loadl_epi64((__m128i const *) (y+i+8)), _mm_loadl_epi64((__m128i const *) (pcb+i+8)),
+                              _mm_loadl_epi64((__m128i const *) (pcr+i+8)), &r1, &g1, &b1);
+      // clamp, invert, scale by K
+      r = stbi__blinn_8x8_sse2(_mm_xor_si128(_mm_packus_epi16(r0, r1), ones), kb);
+      g = stbi__blinn_8x8_sse2(_mm_xor_si128(_mm_packus_epi16(g0, g1), ones), kb);
+      b = stbi__blinn_8x8_sse2(_mm_xor_si128(_mm_packus_epi16(b0, b1), ones), kb);
+      stbi__store_rgb_sse2(out + i*step, r, g, b, step);
+   }
+   stbi__YCCK_to_RGB_row(out + i*step, y+i, pcb+i, pcr+i, k+i, count-i, step);
+}
+#endif
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
    j->idct_block_kernel = stbi__idct_block;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
+   j->CMYK_to_RGB_kernel = stbi__CMYK_to_RGB_row;
+   j->YCCK_to_RGB_kernel = stbi__YCCK_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
 
 #ifdef STBI_SSE2
    if (stbi__sse2_available()) {
       j->idct_block_kernel = stbi__idct_simd;
       j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
+      j->CMYK_to_RGB_kernel = stbi__CMYK_to_RGB_simd;
+      j->YCCK_to_RGB_kernel = stbi__YCCK_to_RGB_simd;
       j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
    }
 #endif
@@ -3843,6 +4366,11 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
 static void stbi__cleanup_jpeg(stbi__jpeg *j)
 {
    stbi__free_jpeg_components(j, j->s->img_n, 0);
+   STBI_FREE(j->icc);
+   j->icc = NULL;
+   // only still set if the decode failed after a pipelined scan
+   STBI_FREE(j->pipe_output);
+   j->pipe_output = NULL;
 }
 
 typedef struct
@@ -3855,11 +4383,195 @@ typedef struct
    int ypos;    // which pre-expansion row we're on
 } stbi__resample;
 
-// fast 0..255 * 0..255 => 0..255 rounded multiplication
-static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
+static void stbi__jpeg_output_comps(stbi__jpeg *z, int req_comp, int *n, int *decode_n, int *is_rgb)
 {
-   unsigned int t = x*y + 128;
-   return (stbi_uc) ((t + (t >>8)) >> 8);
+   // determine actual number of components to generate
+   *n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
+
+   *is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+
+   if (z->s->img_n == 3 && *n < 3 && !*is_rgb)
+      *decode_n = 1;
+   else
+      *decode_n = z->s->img_n;
+}
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc *output;
+   stbi_uc *buf; // per band: 4 line buffers, then a row for stbi__jpeg_convert_rows' 'tail'
+   int bands, line_size, band_size;
+   int n, decode_n, is_rgb;
+} stbi__jpeg_convert_job;
+
+// set up the resampler of component k as it is when output row j is reached
+static void stbi__jpeg_resample_init(stbi__jpeg *z, stbi__resample *r, int k, int j)
+{
+   int t, line0, line1, last = z->img_comp[k].y - 1;
+   r->hs      = z->img_h_max / z->img_comp[k].h;
+   r->vs      = z->img_v_max / z->img_comp[k].v;
+   r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
+
+   t = (r->vs >> 1) + j;
+   r->ystep = t % r->vs;
+   r->ypos  = t / r->vs;
+   line1 = r->ypos < last ? r->ypos : last;
+   line0 = r->ypos == 0 ? 0 : r->ypos - 1 < last ? r->ypos - 1 : last;
+   r->line0 = z->img_comp[k].data + line0 * z->img_comp[k].w2;
+   r->line1 = z->img_comp[k].data + line1 * z->img_comp[k].w2;
+
+   if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+   else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+   else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+   else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+   else                               r->resample = stbi__resample_row_generic;
+}
+
+// resample and color-convert output rows j0..j1-1; linebuf holds one line
+// buffer of img_x+3 bytes per component. The 3-channel converters write one
+// byte past the end of each row; if 'tail' is given, the last row goes through
+// it (n*img_x+1 bytes) so that byte can't land in a row another thread owns
+static void stbi__jpeg_convert_rows(stbi__jpeg *z, stbi_uc *output, int n, int decode_n, int is_rgb, stbi_uc **linebuf, stbi_uc *tail, int j0, int j1)
+{
+   int k, j;
+   unsigned int i;
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+   stbi__resample res_comp[4];
+
+   for (k=0; k < decode_n; ++k)
+      stbi__jpeg_resample_init(z, &res_comp[k], k, j0);
+
+   for (j=j0; j < j1; ++j) {
+      stbi_uc *out = tail && j == j1-1 ? tail : output + n * z->s->img_x * j;
+      for (k=0; k < decode_n; ++k) {
+         stbi__resample *r = &res_comp[k];
+         int y_bot = r->ystep >= (r->vs >> 1);
+         coutput[k] = r->resample(linebuf[k],
+                                  y_bot ? r->line1 : r->line0,
+                                  y_bot ? r->line0 : r->line1,
+                                  r->w_lores, r->hs);
+         if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if (++r->ypos < z->img_comp[k].y)
+               r->line1 += z->img_comp[k].w2;
+         }
+      }
+      if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (is_rgb) {
+               for (i=0; i < z->s->img_x; ++i) {
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  out[3] = 255;
+                  out += n;
+               }
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
+               z->CMYK_to_RGB_kernel(out, coutput[0], coutput[1], coutput[2], coutput[3], z->s->img_x, n);
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCCK_to_RGB_kernel(out, y, coutput[1], coutput[2], coutput[3], z->s->img_x, n);
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               out[3] = 255; // not used if n==3
+               out += n;
+            }
+      } else {
+         if (is_rgb) {
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < z->s->img_x; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                  out[1] = 255;
+               }
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < z->s->img_x; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               out[1] = 255;
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+            else
+               for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
+         }
+      }
+   }
+   if (tail && j0 < j1)
+      memcpy(output + n * z->s->img_x * (j1-1), tail, n * z->s->img_x);
+}
+
+// can the planes go to stbi_load_jpeg_ycbcr as they are?
+static int stbi__jpeg_planar_ok(stbi__jpeg *z)
+{
+   int n, decode_n, is_rgb;
+   if (!z->planar || z->s->img_n != 3) return 0;
+   stbi__jpeg_output_comps(z, 3, &n, &decode_n, &is_rgb);
+   if (is_rgb) return 0;
+   if (z->img_comp[0].h != z->img_h_max || z->img_comp[0].v != z->img_v_max) return 0;
+   if (z->img_comp[1].h != z->img_comp[2].h || z->img_comp[1].v != z->img_comp[2].v) return 0;
+   return z->img_h_max % z->img_comp[1].h == 0 && z->img_v_max % z->img_comp[1].v == 0;
+}
+
+// copy the Y, Cb and Cr planes back to back without their MCU padding
+static stbi_uc *stbi__jpeg_pack_planes(stbi__jpeg *z)
+{
+   int k, j, size = 0;
+   stbi_uc *output, *out;
+   for (k=0; k < 3; ++k) {
+      if (!stbi__mad2sizes_valid(z->img_comp[k].x, z->img_comp[k].y, size)) return stbi__errpuc("too large", "Image too large to decode");
+      size += z->img_comp[k].x * z->img_comp[k].y;
+   }
+   output = (stbi_uc *) stbi__malloc(size);
+   if (!output) return stbi__errpuc("outofmem", "Out of memory");
+   out = output;
+   for (k=0; k < 3; ++k) {
+      for (j=0; j < z->img_comp[k].y; ++j) {
+         memcpy(out, z->img_comp[k].data + j * z->img_comp[k].w2, z->img_comp[k].x);
+         out += z->img_comp[k].x;
+      }
+   }
+   z->chroma_x = z->img_h_max / z->img_comp[1].h;
+   z->chroma_y = z->img_v_max / z->img_comp[1].v;
+   return output;
+}
+
+static void stbi__jpeg_convert_band(void *arg, int b)
+{
+   stbi__jpeg_convert_job *job = (stbi__jpeg_convert_job *) arg;
+   stbi__jpeg *z = job->z;
+   stbi_uc *band = job->buf + (size_t) b * job->band_size;
+   stbi_uc *linebuf[4];
+   int k, rows = z->s->img_y;
+   for (k=0; k < job->decode_n; ++k)
+      linebuf[k] = band + k * job->line_size;
+   stbi__jpeg_convert_rows(z, job->output, job->n, job->decode_n, job->is_rgb, linebuf,
+                           band + 4 * job->line_size, rows*b/job->bands, rows*(b+1)/job->bands);
 }
 
 static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
@@ -3869,19 +4581,13 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
 
    // validate req_comp
    if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+   z->req_comp = req_comp;
 
    // load a jpeg image from whichever source, but leave in YCbCr format
+   // (or, if it was pipelined, already converted in z->pipe_output)
    if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
 
-   // determine actual number of components to generate
-   n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
-
-   is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
-
-   if (z->s->img_n == 3 && n < 3 && !is_rgb)
-      decode_n = 1;
-   else
-      decode_n = z->s->img_n;
+   stbi__jpeg_output_comps(z, req_comp, &n, &decode_n, &is_rgb);
 
    // nothing to do if no components requested; check this now to avoid
    // accessing uninitialized coutput[0] later
@@ -3890,141 +4596,258 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // resample and color-convert
    {
       int k;
-      unsigned int i,j;
-      stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
-
-      stbi__resample res_comp[4];
+      stbi_uc *output = z->pipe_output;
+      stbi_uc *linebuf[4];
+      z->pipe_output = NULL; // the caller's now
+
+      if (stbi__jpeg_planar_ok(z)) {
+         output = stbi__jpeg_pack_planes(z);
+      } else if (!output) {
+         stbi__jpeg_convert_job job;
+         job.bands = stbi__task_bands(z->s->img_y, 16);
+         job.buf = NULL;
+         if (job.bands > 1) {
+            job.line_size = z->s->img_x + 3;
+            job.band_size = 4 * job.line_size + n * z->s->img_x + 1;
+            job.buf = (stbi_uc *) stbi__malloc_mad2(job.bands, job.band_size, 0);
+         }
 
-      for (k=0; k < decode_n; ++k) {
-         stbi__resample *r = &res_comp[k];
+         for (k=0; k < decode_n; ++k) {
+            // allocate line buffer big enough for upsampling off the edges
+            // with upsample factor of 4
+            z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
+            if (!z->img_comp[k].linebuf) { STBI_FREE(job.buf); stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+            linebuf[k] = z->img_comp[k].linebuf;
+         }
 
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-         else                               r->resample = stbi__resample_row_generic;
+         // can't error after this so, this is safe
+         output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
+         if (!output) { STBI_FREE(job.buf); stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+
+         // now go ahead and resample, in bands of rows when there is a pool
+         if (job.buf) {
+            job.z = z;
+            job.output = output;
+            job.n = n;
+            job.decode_n = decode_n;
+            job.is_rgb = is_rgb;
+            stbi__task_run(stbi__jpeg_convert_band, &job, job.bands);
+            STBI_FREE(job.buf);
+         } else {
+            stbi__jpeg_convert_rows(z, output, n, decode_n, is_rgb, linebuf, NULL, 0, z->s->img_y);
+         }
       }
+      if (z->icc_segments > 0) {
+         stbi__set_icc(z->icc, z->icc_len);
+         z->icc = NULL;
+      }
+      stbi__cleanup_jpeg(z);
+      *out_x = z->s->img_x;
+      *out_y = z->s->img_y;
+      if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
+      return output;
+   }
+}
 
-      // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+static stbi_uc *stbi__load_jpeg_ycbcr(stbi__context *s, int *x, int *y, int *chroma_x, int *chroma_y)
+{
+   stbi_uc *result;
+   stbi__jpeg *j;
+   stbi__budget budget;
+   stbi__set_icc(NULL, 0);
+   if (!stbi__jpeg_test(s)) return stbi__errpuc("not JPEG", "Image not a JPEG");
+   j = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   if (!j) return stbi__errpuc("outofmem", "Out of memory");
+   memset(j, 0, sizeof(stbi__jpeg));
+   j->s = s;
+   j->planar = 1;
+   stbi__setup_jpeg(j);
+   stbi__budget_begin(&budget);
+   result = load_jpeg_image(j, x, y, NULL, 3);
+   stbi__budget_end(&budget);
+   *chroma_x = j->chroma_x;
+   *chroma_y = j->chroma_y;
+   STBI_FREE(j);
+   return result;
+}
 
-      // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
+STBIDEF stbi_uc *stbi_load_jpeg_ycbcr_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *chroma_x, int *chroma_y)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_jpeg_ycbcr(&s,x,y,chroma_x,chroma_y);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_jpeg_ycbcr(char const *filename, int *x, int *y, int *chroma_x, int *chroma_y)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   stbi__context s;
+   stbi_uc *result;
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   result = stbi__load_jpeg_ycbcr(&s,x,y,chroma_x,chroma_y);
+   fclose(f);
+   return result;
+}
+#endif
+
+// pipelined baseline decoding. The calling thread Huffman-decodes MCU rows
+// into a ring of 'slots' rows of coefficients; each decoded row is handed to
+// a task that does its IDCT into the component planes. Once the IDCT of MCU
+// rows m-1..m+1 is done, a second task upsamples and colour-converts the
+// output rows of MCU row m, using line buffers of its own.
+typedef struct
+{
+   stbi__jpeg *z;
+   short *coeff;
+   stbi_uc *linebuf; // per slot: 4 line buffers, then a row for stbi__jpeg_convert_rows' 'tail'
+   void **idct_task, **convert_task;
+   stbi_uc *output;
+   int blocks, slots, line_size, slot_size;
+   int n, decode_n, is_rgb;
+} stbi__jpeg_pipe;
+
+static void stbi__jpeg_pipe_idct(void *arg, int row)
+{
+   stbi__jpeg_pipe *p = (stbi__jpeg_pipe *) arg;
+   stbi__jpeg *z = p->z;
+   short *data = p->coeff + (size_t) (row % p->slots) * p->blocks * 64;
+   int i,k,x,y;
+   for (i=0; i < z->img_mcu_x; ++i) {
+      for (k=0; k < z->scan_n; ++k) {
+         int n = z->order[k];
+         for (y=0; y < z->img_comp[n].v; ++y) {
+            for (x=0; x < z->img_comp[n].h; ++x) {
+               int x2 = (i*z->img_comp[n].h + x)*8;
+               int y2 = (row*z->img_comp[n].v + y)*8;
+               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+               data += 64;
             }
          }
       }
-      stbi__cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
-      if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
-      return output;
    }
 }
 
+static void stbi__jpeg_pipe_convert(void *arg, int row)
+{
+   stbi__jpeg_pipe *p = (stbi__jpeg_pipe *) arg;
+   stbi__jpeg *z = p->z;
+   stbi_uc *linebuf[4];
+   stbi_uc *slot = p->linebuf + (size_t) (row % p->slots) * p->slot_size;
+   int k, j0 = row * z->img_mcu_h;
+   int j1 = j0 + z->img_mcu_h < (int) z->s->img_y ? j0 + z->img_mcu_h : (int) z->s->img_y;
+   for (k=0; k < p->decode_n; ++k)
+      linebuf[k] = slot + k * p->line_size;
+   stbi__jpeg_convert_rows(z, p->output, p->n, p->decode_n, p->is_rgb, linebuf, slot + 4 * p->line_size, j0, j1);
+}
+
+// start colour conversion of MCU rows up to (not including) 'limit'
+static int stbi__jpeg_pipe_convert_upto(stbi__jpeg_pipe *p, int limit, int converted)
+{
+   while (converted < limit && p->decode_n) {
+      int s = converted % p->slots;
+      stbi__task_finish(&p->convert_task[s]);
+      p->convert_task[s] = stbi__task_start(stbi__jpeg_pipe_convert, p, converted);
+      ++converted;
+   }
+   return converted;
+}
+
+// entropy-decode one MCU row, as stbi__parse_entropy_coded_data does for
+// interleaved baseline scans; *ended is set if the data stops early
+static int stbi__jpeg_pipe_decode_row(stbi__jpeg *z, short *data, int *ended)
+{
+   int i,k,x,y;
+   for (i=0; i < z->img_mcu_x; ++i) {
+      for (k=0; k < z->scan_n; ++k) {
+         int n = z->order[k];
+         for (y=0; y < z->img_comp[n].v; ++y) {
+            for (x=0; x < z->img_comp[n].h; ++x) {
+               int ha = z->img_comp[n].ha;
+               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+               data += 64;
+            }
+         }
+      }
+      if (--z->todo <= 0) {
+         if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+         if (!STBI__RESTART(z->marker)) { *ended = 1; return 1; }
+         stbi__jpeg_reset(z);
+      }
+   }
+   return 1;
+}
+
+static int stbi__jpeg_pipeline_scan(stbi__jpeg *z)
+{
+   stbi__jpeg_pipe p;
+   void *coeff_raw;
+   int j, k, s, ok = 1, ended = 0, converted = 0;
+
+   if (!stbi__thread_pool.start || stbi__thread_pool.threads < 2) return -1;
+   if (z->progressive || z->pipe_output || z->img_mcu_y < 2) return -1;
+   if (z->scan_n != z->s->img_n) return -1;
+   if (z->scan_n == 1 && (z->img_comp[z->order[0]].h != 1 || z->img_comp[z->order[0]].v != 1)) return -1;
+   stbi__jpeg_output_comps(z, z->req_comp, &p.n, &p.decode_n, &p.is_rgb);
+   if (p.decode_n <= 0) return -1;
+   if (stbi__jpeg_planar_ok(z)) p.decode_n = 0; // planes only: IDCT, no conversion
+
+   p.z = z;
+   p.slots = stbi__thread_pool.threads + 2;
+   if (p.slots > 16) p.slots = 16;
+   if (p.slots > z->img_mcu_y) p.slots = z->img_mcu_y;
+   p.blocks = 0;
+   for (k=0; k < z->scan_n; ++k)
+      p.blocks += z->img_comp[z->order[k]].h * z->img_comp[z->order[k]].v;
+   p.blocks *= z->img_mcu_x;
+   p.line_size = z->s->img_x + 3;
+   p.slot_size = 4 * p.line_size + p.n * z->s->img_x + 1;
+
+   // on allocation failure just fall back to serial decoding
+   p.output = p.decode_n ? (stbi_uc *) stbi__malloc_mad3(p.n, z->s->img_x, z->s->img_y, 1) : NULL;
+   coeff_raw = stbi__malloc_mad3(p.slots, p.blocks, 64 * sizeof(short), 15);
+   p.linebuf = p.output ? (stbi_uc *) stbi__malloc_mad2(p.slots, p.slot_size, 0) : NULL;
+   p.idct_task = (void **) stbi__malloc_mad2(p.slots * 2, sizeof(void *), 0);
+   if (!coeff_raw || !p.idct_task || (p.decode_n && (!p.linebuf || !p.output))) {
+      STBI_FREE(coeff_raw); STBI_FREE(p.linebuf); STBI_FREE(p.idct_task); STBI_FREE(p.output);
+      return -1;
+   }
+   p.coeff = (short *) (((size_t) coeff_raw + 15) & ~15);
+   p.convert_task = p.idct_task + p.slots;
+   memset(p.idct_task, 0, p.slots * 2 * sizeof(void *));
+
+   stbi__jpeg_reset(z);
+   for (j=0; j < z->img_mcu_y && !ended; ++j) {
+      short *data = p.coeff + (size_t) (j % p.slots) * p.blocks * 64;
+      // reusing the slot of row j-slots; rows up to it have had their IDCT
+      stbi__task_finish(&p.idct_task[j % p.slots]);
+      converted = stbi__jpeg_pipe_convert_upto(&p, j - p.slots, converted);
+
+      memset(data, 0, (size_t) p.blocks * 64 * sizeof(short));
+      if (!stbi__budget_ok() || !stbi__jpeg_pipe_decode_row(z, data, &ended)) { ok = 0; break; }
+      p.idct_task[j % p.slots] = stbi__task_start(stbi__jpeg_pipe_idct, &p, j);
+   }
+
+   for (s=0; s < p.slots; ++s)
+      stbi__task_finish(&p.idct_task[s]);
+   // like the serial decoder, rows missing from truncated data are converted from whatever the planes hold
+   if (ok)
+      stbi__jpeg_pipe_convert_upto(&p, z->img_mcu_y, converted);
+   for (s=0; s < p.slots; ++s)
+      stbi__task_finish(&p.convert_task[s]);
+
+   STBI_FREE(coeff_raw);
+   STBI_FREE(p.linebuf);
+   STBI_FREE(p.idct_task);
+   if (!ok) {
+      STBI_FREE(p.output);
+      return 0;
+   }
+   z->pipe_output = p.output;
+   return 1;
+}
+
 static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    unsigned char* result;
@@ -4073,6 +4896,7 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
    memset(j, 0, sizeof(stbi__jpeg));
    j->s = s;
    result = stbi__jpeg_info_raw(j, x, y, comp);
+   STBI_FREE(j->icc);
    STBI_FREE(j);
    return result;
 }
@@ -4283,7 +5107,7 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
       if(limit > UINT_MAX / 2) return stbi__err("outofmem", "Out of memory");
       limit *= 2;
    }
-   q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
+   q = (char *) stbi__realloc_sized(z->zout_start, old_limit, limit);
    STBI_NOTUSED(old_limit);
    if (q == NULL) return stbi__err("outofmem", "Out of memory");
    z->zout_start = q;
@@ -4487,6 +5311,7 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
    a->code_buffer = 0;
    a->hit_zeof_once = 0;
    do {
+      if (!stbi__budget_ok()) return 0;
       final = stbi__zreceive(a,1);
       type = stbi__zreceive(a,2);
       if (type == 0) {
@@ -4627,13 +5452,45 @@ static int stbi__check_png_header(stbi__context *s)
    return 1;
 }
 
+// everything needed to turn de-filtered pixels into the final layout
+typedef struct
+{
+   stbi_uc *palette;
+   stbi__uint32 pal_len;
+   int pal_img_n, has_trans, is_iphone, req_comp;
+   stbi_uc tc[3];
+   stbi__uint16 tc16[3];
+} stbi__png_post;
+
 typedef struct
 {
    stbi__context *s;
    stbi_uc *idata, *expanded, *out;
    int depth;
+   stbi__png_post *post;
+   int passes_shown;
+   stbi_uc *icc; // inflated iCCP profile
+   int icc_len;
 } stbi__png;
 
+static
+#ifdef STBI_THREAD_LOCAL
+STBI_THREAD_LOCAL
+#endif
+stbi_png_pass_callback *stbi__png_pass_cb;
+
+static
+#ifdef STBI_THREAD_LOCAL
+STBI_THREAD_LOCAL
+#endif
+void *stbi__png_pass_user;
+
+STBIDEF void stbi_set_png_pass_callback(stbi_png_pass_callback *callback, void *user)
+{
+   stbi__png_pass_cb = callback;
+   stbi__png_pass_user = user;
+}
+
 
 enum {
    STBI__F_none=0,
@@ -4742,6 +5599,11 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
       int nk = width * filter_bytes;
       int filter = *raw++;
 
+      if ((j & 15) == 0 && !stbi__budget_ok()) {
+         all_ok = 0;
+         break;
+      }
+
       // check filter type
       if (filter > 4) {
          all_ok = stbi__err("invalid filter","Corrupt PNG");
@@ -4858,7 +5720,9 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    return 1;
 }
 
-static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced)
+static void stbi__png_preview(stbi__png *z, stbi_uc *final, int out_bytes, int pass);
+
+static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced, int num_passes)
 {
    int bytes = (depth == 16 ? 2 : 1);
    int out_bytes = out_n * bytes;
@@ -4870,7 +5734,7 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    // de-interlacing
    final = (stbi_uc *) stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
    if (!final) return stbi__err("outofmem", "Out of memory");
-   for (p=0; p < 7; ++p) {
+   for (p=0; p < num_passes; ++p) {
       int xorig[] = { 0,4,0,2,0,1,0 };
       int yorig[] = { 0,0,4,0,2,0,1 };
       int xspc[]  = { 8,8,4,4,2,2,1 };
@@ -4897,6 +5761,12 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
          image_data += img_len;
          image_data_len -= img_len;
       }
+      // a partial decode only previews its newest pass; the final one
+      // catches up on any passes that were never shown
+      if (a->post && p < 6 && p >= a->passes_shown && (p == num_passes-1 || num_passes == 7)) {
+         stbi__png_preview(a, final, out_bytes, p);
+         a->passes_shown = p+1;
+      }
    }
    a->out = final;
 
@@ -5075,18 +5945,146 @@ static void stbi__de_iphone(stbi__png *z)
 
 #define STBI__PNG_TYPE(a,b,c,d)  (((unsigned) (a) << 24) + ((unsigned) (b) << 16) + ((unsigned) (c) << 8) + (unsigned) (d))
 
+// applies tRNS, iphone and palette handling to z->out
+static int stbi__png_post_process(stbi__png *z, stbi__png_post *pp)
+{
+   stbi__context *s = z->s;
+   if (pp->has_trans) {
+      if (z->depth == 16) {
+         if (!stbi__compute_transparency16(z, pp->tc16, s->img_out_n)) return 0;
+      } else {
+         if (!stbi__compute_transparency(z, pp->tc, s->img_out_n)) return 0;
+      }
+   }
+   if (pp->is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
+      stbi__de_iphone(z);
+   if (pp->pal_img_n) {
+      // pal_img_n == 3 or 4
+      s->img_n = pp->pal_img_n; // record the actual colors we had
+      s->img_out_n = pp->pal_img_n;
+      if (pp->req_comp >= 3) s->img_out_n = pp->req_comp;
+      if (!stbi__expand_png_palette(z, pp->palette, pp->pal_len, s->img_out_n))
+         return 0;
+   } else if (pp->has_trans) {
+      // non-paletted image with tRNS -> source image has (constant) alpha
+      ++s->img_n;
+   }
+   return 1;
+}
+
+// hands a block-replicated copy of the partially de-interlaced image to the
+// pass callback. 'pass' is the last Adam7 pass (0-based) present in 'final'.
+static void stbi__png_preview(stbi__png *z, stbi_uc *final, int out_bytes, int pass)
+{
+   // spacing of the pixel lattice known after each pass
+   static const int dx[] = { 8,4,4,2,2,1,1 };
+   static const int dy[] = { 8,8,4,4,2,2,1 };
+   stbi__context *s = z->s;
+   stbi__png pz = *z;
+   int img_n = s->img_n, img_out_n = s->img_out_n;
+   stbi__uint32 x, y, w = s->img_x, h = s->img_y;
+   size_t row_bytes = (size_t) w * out_bytes;
+   stbi_uc *preview;
+   int channels, err = 0;
+
+   preview = (stbi_uc *) stbi__malloc_mad3(w, h, out_bytes, 0);
+   if (!preview) return;
+   for (y=0; y < h; ++y) {
+      stbi_uc *dst = preview + y * row_bytes;
+      if (y % dy[pass]) {
+         memcpy(dst, dst - row_bytes, row_bytes);
+         continue;
+      }
+      for (x=0; x < w; ++x)
+         memcpy(dst + x * out_bytes, final + y * row_bytes + (x - x % dx[pass]) * out_bytes, out_bytes);
+   }
+
+   pz.out = preview;
+   if (!stbi__png_post_process(&pz, z->post)) err = 1;
+   preview = pz.out;
+   channels = s->img_out_n;
+   if (!err && z->depth == 16)
+      preview = stbi__convert_16_to_8((stbi__uint16 *) preview, w, h, channels);
+   if (preview && !err && z->post->req_comp && z->post->req_comp != channels) {
+      preview = stbi__convert_format(preview, channels, z->post->req_comp, w, h);
+      channels = z->post->req_comp;
+   }
+   if (preview && !err)
+      stbi__png_pass_cb(stbi__png_pass_user, preview, w, h, channels, pass+1);
+
+   STBI_FREE(preview);
+   s->img_n = img_n;
+   s->img_out_n = img_out_n;
+}
+
+// called as IDAT data arrives: inflates what is there so far and previews
+// any interlace passes that are now complete. The stream is truncated, so
+// zlib reports failure, but everything it produced before that is valid.
+// Failures here only cost the preview, so they leave the failure reason as
+// it was.
+static void stbi__png_progress(stbi__png *z, stbi__uint32 ioff, int color)
+{
+   stbi__context *s = z->s;
+   const char *reason = stbi__g_failure_reason;
+   stbi__zbuf a;
+   size_t bpl, have, need = 0, guess;
+   int p, img_out_n = s->img_out_n;
+   char *buf;
+
+   // the inflate buffer's size is an int
+   bpl = ((size_t) s->img_x * z->depth + 7) / 8 * s->img_n;
+   if (s->img_y == 0 || bpl > (INT_MAX - s->img_y) / s->img_y) return;
+   guess = bpl * s->img_y + s->img_y;
+   buf = (char *) stbi__malloc(guess);
+   if (!buf) {
+      stbi__g_failure_reason = reason;
+      return;
+   }
+   a.zbuffer = z->idata;
+   a.zbuffer_end = z->idata + ioff;
+   stbi__do_zlib(&a, buf, (int) guess, 1, !z->post->is_iphone);
+   have = a.zout - a.zout_start;
+
+   for (p=0; p < 7; ++p) {
+      int xorig[] = { 0,4,0,2,0,1,0 };
+      int yorig[] = { 0,0,4,0,2,0,1 };
+      int xspc[]  = { 8,8,4,4,2,2,1 };
+      int yspc[]  = { 8,8,8,4,4,2,2 };
+      stbi__uint32 x = (s->img_x - xorig[p] + xspc[p]-1) / xspc[p];
+      stbi__uint32 y = (s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
+      size_t img_len = (x && y) ? ((((s->img_n * x * z->depth) + 7) >> 3) + 1) * (size_t) y : 0;
+      if (need + img_len > have) break;
+      need += img_len;
+   }
+
+   if (p > z->passes_shown && p < 7) {
+      if (stbi__create_png_image(z, (stbi_uc *) a.zout_start, (stbi__uint32) need, s->img_out_n, z->depth, color, 1, p)) {
+         STBI_FREE(z->out);
+         z->out = NULL;
+      }
+   }
+   STBI_FREE(a.zout_start);
+   s->img_out_n = img_out_n;
+   stbi__g_failure_reason = reason;
+}
+
 static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 {
    stbi_uc palette[1024], pal_img_n=0;
    stbi_uc has_trans=0, tc[3]={0};
    stbi__uint16 tc16[3];
-   stbi__uint32 ioff=0, idata_limit=0, i, pal_len=0;
+   stbi__uint32 ioff=0, idata_limit=0, i, pal_len=0, progress_at=0;
    int first=1,k,interlace=0, color=0, is_iphone=0;
    stbi__context *s = z->s;
+   stbi__png_post post;
 
    z->expanded = NULL;
    z->idata = NULL;
    z->out = NULL;
+   z->post = NULL;
+   z->passes_shown = 0;
+   z->icc = NULL;
+   z->icc_len = 0;
 
    if (!stbi__check_png_header(s)) return 0;
 
@@ -5108,6 +6106,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             s->img_y = stbi__get32be(s);
             if (s->img_y > STBI_MAX_DIMENSIONS) return stbi__err("too large","Very large image (corrupt?)");
             if (s->img_x > STBI_MAX_DIMENSIONS) return stbi__err("too large","Very large image (corrupt?)");
+            if (!stbi__budget_pixels(s->img_x, s->img_y)) return 0;
             z->depth = stbi__get8(s);  if (z->depth != 1 && z->depth != 2 && z->depth != 4 && z->depth != 8 && z->depth != 16)  return stbi__err("1/2/4/8/16-bit only","PNG not supported: 1/2/4/8/16-bit only");
             color = stbi__get8(s);  if (color > 6)         return stbi__err("bad ctype","Corrupt PNG");
             if (color == 3 && z->depth == 16)                  return stbi__err("bad ctype","Corrupt PNG");
@@ -5170,6 +6169,27 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             break;
          }
 
+         case STBI__PNG_TYPE('i','C','C','P'): {
+            // profile name (1-79 bytes and a NUL), compression method 0, zlib data
+            stbi_uc *chunk;
+            stbi__uint32 name_len = 0;
+            if (first) return stbi__err("first not IHDR", "Corrupt PNG");
+            if (scan != STBI__SCAN_load || z->icc || c.length > (1u << 24)) {
+               stbi__skip(s, c.length);
+               break;
+            }
+            chunk = (stbi_uc *) stbi__malloc(c.length ? c.length : 1);
+            if (!chunk) return stbi__err("outofmem", "Out of memory");
+            if (!stbi__getn(s, chunk, c.length)) { STBI_FREE(chunk); return stbi__err("outofdata","Corrupt PNG"); }
+            while (name_len < c.length && chunk[name_len] != 0)
+               ++name_len;
+            // a broken profile only loses colour management, not the image
+            if (name_len + 2 < c.length && chunk[name_len+1] == 0)
+               z->icc = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) chunk + name_len + 2, c.length - name_len - 2, 4096, &z->icc_len, 1);
+            STBI_FREE(chunk);
+            break;
+         }
+
          case STBI__PNG_TYPE('I','D','A','T'): {
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (pal_img_n && !pal_len) return stbi__err("no PLTE","Corrupt PNG");
@@ -5188,11 +6208,26 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                while (ioff + c.length > idata_limit)
                   idata_limit *= 2;
                STBI_NOTUSED(idata_limit_old);
-               p = (stbi_uc *) STBI_REALLOC_SIZED(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
+               p = (stbi_uc *) stbi__realloc_sized(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
                z->idata = p;
             }
             if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
             ioff += c.length;
+            if (interlace && stbi__png_pass_cb && scan == STBI__SCAN_load && ioff >= progress_at) {
+               // retry at geometrically spaced sizes so the re-inflating stays O(n)
+               progress_at = ioff > 0x7fffffff ? 0xffffffff : ioff * 2;
+               if (!z->post) {
+                  post.palette = palette; post.pal_len = pal_len; post.pal_img_n = pal_img_n;
+                  post.has_trans = has_trans; post.is_iphone = is_iphone; post.req_comp = req_comp;
+                  memcpy(post.tc, tc, sizeof(tc)); memcpy(post.tc16, tc16, sizeof(tc16));
+                  z->post = &post;
+               }
+               if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
+                  s->img_out_n = s->img_n+1;
+               else
+                  s->img_out_n = s->img_n;
+               stbi__png_progress(z, ioff, color);
+            }
             break;
          }
 
@@ -5211,27 +6246,13 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
-            if (has_trans) {
-               if (z->depth == 16) {
-                  if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
-               } else {
-                  if (!stbi__compute_transparency(z, tc, s->img_out_n)) return 0;
-               }
-            }
-            if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
-               stbi__de_iphone(z);
-            if (pal_img_n) {
-               // pal_img_n == 3 or 4
-               s->img_n = pal_img_n; // record the actual colors we had
-               s->img_out_n = pal_img_n;
-               if (req_comp >= 3) s->img_out_n = req_comp;
-               if (!stbi__expand_png_palette(z, palette, pal_len, s->img_out_n))
-                  return 0;
-            } else if (has_trans) {
-               // non-paletted image with tRNS -> source image has (constant) alpha
-               ++s->img_n;
-            }
+            post.palette = palette; post.pal_len = pal_len; post.pal_img_n = pal_img_n;
+            post.has_trans = has_trans; post.is_iphone = is_iphone; post.req_comp = req_comp;
+            memcpy(post.tc, tc, sizeof(tc)); memcpy(post.tc16, tc16, sizeof(tc16));
+            if (interlace && stbi__png_pass_cb)
+               z->post = &post;
+            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace, 7)) return 0;
+            if (!stbi__png_post_process(z, &post)) return 0;
             STBI_FREE(z->expanded); z->expanded = NULL;
             // end of PNG chunk, read and skip CRC
             stbi__get32be(s);
@@ -5279,12 +6300,17 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
          else
             result = stbi__convert_format16((stbi__uint16 *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
          p->s->img_out_n = req_comp;
-         if (result == NULL) return result;
+         if (result == NULL) { STBI_FREE(p->icc); p->icc = NULL; return result; }
       }
       *x = p->s->img_x;
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
+      if (p->icc) {
+         stbi__set_icc(p->icc, p->icc_len);
+         p->icc = NULL;
+      }
    }
+   STBI_FREE(p->icc);      p->icc      = NULL;
    STBI_FREE(p->out);      p->out      = NULL;
    STBI_FREE(p->expanded); p->expanded = NULL;
    STBI_FREE(p->idata);    p->idata    = NULL;
@@ -5547,6 +6573,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
 
    if (s->img_y > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
    if (s->img_x > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
+   if (!stbi__budget_pixels(s->img_x, s->img_y)) return NULL;
 
    mr = info.mr;
    mg = info.mg;
@@ -5900,6 +6927,7 @@ static void *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req
 
    if (tga_height > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
    if (tga_width > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
+   if (!stbi__budget_pixels(tga_width, tga_height)) return NULL;
 
    //   do a tiny bit of precessing
    if ( tga_image_type >= 8 )
@@ -6155,6 +7183,7 @@ static void *stbi__psd_load(stbi__context *s, int *x, int *y, int *comp, int req
 
    if (h > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
    if (w > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
+   if (!stbi__budget_pixels(w, h)) return NULL;
 
    // Make sure the depth is 8 bits.
    bitdepth = stbi__get16be(s);
@@ -6513,6 +7542,7 @@ static void *stbi__pic_load(stbi__context *s,int *px,int *py,int *comp,int req_c
 
    if (y > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
    if (x > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
+   if (!stbi__budget_pixels(x, y)) return NULL;
 
    if (stbi__at_eof(s))  return stbi__errpuc("bad file","file too short (pic header)");
    if (!stbi__mad3sizes_valid(x, y, 4, 0)) return stbi__errpuc("too large", "PIC image too large to decode");
@@ -6553,6 +7583,7 @@ static int stbi__pic_test(stbi__context *s)
 typedef struct
 {
    stbi__int16 prefix;
+   stbi__uint16 length;          // length of the string this code expands to
    stbi_uc first;
    stbi_uc suffix;
 } stbi__gif_lzw;
@@ -6567,6 +7598,7 @@ typedef struct
    stbi_uc  pal[256][4];
    stbi_uc lpal[256][4];
    stbi__gif_lzw codes[8192];
+   stbi_uc string[8192];         // scratch for strings that wrap past the end of a row
    stbi_uc *color_table;
    int parse, step;
    int lflags;
@@ -6625,6 +7657,7 @@ static int stbi__gif_header(stbi__context *s, stbi__gif *g, int *comp, int is_in
 
    if (g->w > STBI_MAX_DIMENSIONS) return stbi__err("too large","Very large image (corrupt?)");
    if (g->h > STBI_MAX_DIMENSIONS) return stbi__err("too large","Very large image (corrupt?)");
+   if (!stbi__budget_pixels(g->w, g->h)) return 0;
 
    if (comp != 0) *comp = 4;  // can't actually tell whether it's 3 or 4 until we parse the comments
 
@@ -6651,39 +7684,65 @@ static int stbi__gif_info_raw(stbi__context *s, int *x, int *y, int *comp)
    return 1;
 }
 
-static void stbi__out_gif_code(stbi__gif *g, stbi__uint16 code)
+static void stbi__gif_next_row(stbi__gif *g)
 {
-   stbi_uc *p, *c;
-   int idx;
-
-   // recurse to decode the prefixes, since the linked-list is backwards,
-   // and working backwards through an interleaved image would be nasty
-   if (g->codes[code].prefix >= 0)
-      stbi__out_gif_code(g, g->codes[code].prefix);
+   g->cur_x = g->start_x;
+   g->cur_y += g->step;
 
-   if (g->cur_y >= g->max_y) return;
+   while (g->cur_y >= g->max_y && g->parse > 0) {
+      g->step = (1 << g->parse) * g->line_size;
+      g->cur_y = g->start_y + (g->step >> 1);
+      --g->parse;
+   }
+}
 
-   idx = g->cur_x + g->cur_y;
-   p = &g->out[idx];
+stbi_inline static void stbi__out_gif_pixel(stbi__gif *g, int idx, stbi_uc index)
+{
+   stbi_uc *p = &g->out[idx];
+   stbi_uc *c = &g->color_table[index * 4];
    g->history[idx / 4] = 1;
-
-   c = &g->color_table[g->codes[code].suffix * 4];
    if (c[3] > 128) { // don't render transparent pixels;
       p[0] = c[2];
       p[1] = c[1];
       p[2] = c[0];
       p[3] = c[3];
    }
-   g->cur_x += 4;
+}
 
-   if (g->cur_x >= g->max_x) {
-      g->cur_x = g->start_x;
-      g->cur_y += g->step;
+static void stbi__out_gif_code(stbi__gif *g, stbi__uint16 code)
+{
+   int len = g->codes[code].length;
+   int i;
+
+   if (g->cur_y >= g->max_y) return;
 
-      while (g->cur_y >= g->max_y && g->parse > 0) {
-         g->step = (1 << g->parse) * g->line_size;
-         g->cur_y = g->start_y + (g->step >> 1);
-         --g->parse;
+   if (g->cur_x + len * 4 <= g->max_x) {
+      // the whole string lands on the current row, so walk the prefix chain
+      // once and write it into the output back to front
+      int idx = g->cur_x + g->cur_y + (len - 1) * 4;
+      for (i = 0; i < len; ++i) {
+         stbi__out_gif_pixel(g, idx, g->codes[code].suffix);
+         code = (stbi__uint16) g->codes[code].prefix;
+         idx -= 4;
+      }
+      g->cur_x += len * 4;
+      if (g->cur_x >= g->max_x)
+         stbi__gif_next_row(g);
+   } else {
+      // string wraps onto following (possibly interlaced) rows; unpack it
+      // back to front into a scratch buffer, then emit it in order
+      stbi_uc *str = g->string;
+      for (i = len - 1; i >= 0; --i) {
+         str[i] = g->codes[code].suffix;
+         code = (stbi__uint16) g->codes[code].prefix;
+      }
+      for (i = 0; i < len; ++i) {
+         stbi__out_gif_pixel(g, g->cur_x + g->cur_y, str[i]);
+         g->cur_x += 4;
+         if (g->cur_x >= g->max_x) {
+            stbi__gif_next_row(g);
+            if (g->cur_y >= g->max_y) return;
+         }
       }
    }
 }
@@ -6691,10 +7750,11 @@ static void stbi__out_gif_code(stbi__gif *g, stbi__uint16 code)
 static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
 {
    stbi_uc lzw_cs;
-   stbi__int32 len, init_code;
-   stbi__uint32 first;
-   stbi__int32 codesize, codemask, avail, oldcode, bits, valid_bits, clear;
+   stbi__int32 len, pos, init_code;
+   stbi__uint32 first, bits;
+   stbi__int32 codesize, codemask, avail, oldcode, valid_bits, clear;
    stbi__gif_lzw *p;
+   stbi_uc block[255];
 
    lzw_cs = stbi__get8(s);
    if (lzw_cs > 12) return NULL;
@@ -6706,6 +7766,7 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
    valid_bits = 0;
    for (init_code = 0; init_code < clear; init_code++) {
       g->codes[init_code].prefix = -1;
+      g->codes[init_code].length = 1;
       g->codes[init_code].first = (stbi_uc) init_code;
       g->codes[init_code].suffix = (stbi_uc) init_code;
    }
@@ -6714,22 +7775,29 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
    avail = clear+2;
    oldcode = -1;
 
+   // data sub-blocks are read whole into 'block', and the bit buffer is
+   // topped up from there a byte at a time without going back to the context
    len = 0;
+   pos = 0;
    for(;;) {
       if (valid_bits < codesize) {
-         if (len == 0) {
+         if (pos == len) {
+            if (!stbi__budget_ok()) return NULL;
             len = stbi__get8(s); // start new block
             if (len == 0)
                return g->out;
+            if (!stbi__getn(s, block, len))
+               return g->out; // truncated; keep what was decoded so far
+            pos = 0;
+         }
+         while (valid_bits <= 24 && pos < len) {
+            bits |= (stbi__uint32) block[pos++] << valid_bits;
+            valid_bits += 8;
          }
-         --len;
-         bits |= (stbi__int32) stbi__get8(s) << valid_bits;
-         valid_bits += 8;
       } else {
          stbi__int32 code = bits & codemask;
          bits >>= codesize;
          valid_bits -= codesize;
-         // @OPTIMIZE: is there some way we can accelerate the non-clear path?
          if (code == clear) {  // clear code
             codesize = lzw_cs + 1;
             codemask = (1 << codesize) - 1;
@@ -6737,7 +7805,6 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
             oldcode = -1;
             first = 0;
          } else if (code == clear + 1) { // end of stream code
-            stbi__skip(s, len);
             while ((len = stbi__get8(s)) > 0)
                stbi__skip(s,len);
             return g->out;
@@ -6753,8 +7820,9 @@ static stbi_uc *stbi__process_gif_raster(stbi__context *s, stbi__gif *g)
                }
 
                p->prefix = (stbi__int16) oldcode;
+               p->length = g->codes[oldcode].length + 1;
                p->first = g->codes[oldcode].first;
-               p->suffix = (code == avail) ? p->first : g->codes[code].first;
+               p->suffix = g->codes[code].first; // == p->first when code is the entry just added
             } else if (code == avail)
                return stbi__errpuc("illegal code in raster", "Corrupt GIF");
 
@@ -6991,7 +8059,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
             stride = g.w * g.h * 4;
 
             if (out) {
-               void *tmp = (stbi_uc*) STBI_REALLOC_SIZED( out, out_size, layers * stride );
+               void *tmp = (stbi_uc*) stbi__realloc_sized( out, out_size, layers * stride );
                if (!tmp)
                   return stbi__load_gif_main_outofmem(&g, out, delays);
                else {
@@ -7000,7 +8068,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
                }
 
                if (delays) {
-                  int *new_delays = (int*) STBI_REALLOC_SIZED( *delays, delays_size, sizeof(int) * layers );
+                  int *new_delays = (int*) stbi__realloc_sized( *delays, delays_size, sizeof(int) * layers );
                   if (!new_delays)
                      return stbi__load_gif_main_outofmem(&g, out, delays);
                   *delays = new_delays;
@@ -7128,51 +8196,241 @@ static char *stbi__hdr_gettoken(stbi__context *z, char *buffer)
    return buffer;
 }
 
-static void stbi__hdr_convert(float *output, stbi_uc *input, int req_comp)
+// 2^(e-136), the scale of a mantissa with exponent e (the mantissa's 1/256
+// folded in, so the product cannot overflow where the result does not),
+// assembled directly in the float exponent field. Exponents below 10 give
+// denormals and go through ldexp.
+static float stbi__hdr_exp2(int e)
+{
+   stbi__uint32 bits;
+   float f;
+   if (e < 10) return (float) ldexp(1.0f, e - 136);
+   bits = (stbi__uint32) (e - 9) << 23;
+   memcpy(&f, &bits, 4);
+   return f;
+}
+
+// one pixel of stbi__hdr_convert_row
+static void stbi__hdr_convert_pixel(float *o, int r, int g, int b, int e, int req_comp)
 {
-   if ( input[3] != 0 ) {
-      float f1;
-      // Exponent
-      f1 = (float) ldexp(1.0f, input[3] - (int)(128 + 8));
+   if (e != 0) {
+      float f1 = stbi__hdr_exp2(e);
       if (req_comp <= 2)
-         output[0] = (input[0] + input[1] + input[2]) * f1 / 3;
+         o[0] = (r + g + b) * f1 / 3;
       else {
-         output[0] = input[0] * f1;
-         output[1] = input[1] * f1;
-         output[2] = input[2] * f1;
+         o[0] = r * f1;
+         o[1] = g * f1;
+         o[2] = b * f1;
       }
-      if (req_comp == 2) output[1] = 1;
-      if (req_comp == 4) output[3] = 1;
+      if (req_comp == 2) o[1] = 1;
+      if (req_comp == 4) o[3] = 1;
    } else {
       switch (req_comp) {
-         case 4: output[3] = 1; /* fallthrough */
-         case 3: output[0] = output[1] = output[2] = 0;
+         case 4: o[3] = 1; /* fallthrough */
+         case 3: o[0] = o[1] = o[2] = 0;
                  break;
-         case 2: output[1] = 1; /* fallthrough */
-         case 1: output[0] = 0;
+         case 2: o[1] = 1; /* fallthrough */
+         case 1: o[0] = 0;
                  break;
       }
    }
 }
 
-static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+// converts one scanline held as four planes (R, G, B, E) of 'width' bytes each
+static void stbi__hdr_convert_row(float *output, stbi_uc *planes, int width, int req_comp)
+{
+   stbi_uc *r = planes, *g = planes + width, *b = planes + width*2, *e = planes + width*3;
+   int i = 0;
+
+#ifdef STBI_SSE2
+   if (req_comp >= 3 && stbi__sse2_available()) {
+      __m128i zero = _mm_setzero_si128();
+      __m128i nine = _mm_set1_epi32(9);
+      __m128i ten = _mm_set1_epi32(10);
+      // with 3 components each pixel store spills one float into the next
+      // pixel, so leave at least one pixel for the scalar tail
+      int end = req_comp == 4 ? width - 3 : width - 4;
+      for (; i < end; i += 4) {
+         __m128i ri, gi, bi, ei;
+         __m128 scale, rf, gf, bf, af;
+         stbi__uint32 w;
+         int k, denormal;
+         #define stbi__hdr_load4(dst, src) \
+            memcpy(&w, (src) + i, 4); \
+            dst = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int) w), zero), zero)
+         stbi__hdr_load4(ri, r);
+         stbi__hdr_load4(gi, g);
+         stbi__hdr_load4(bi, b);
+         stbi__hdr_load4(ei, e);
+         #undef stbi__hdr_load4
+
+         // same exponent trick as stbi__hdr_exp2; lanes with e < 10 come out
+         // zero here, and the denormal ones (e != 0) are redone below
+         scale = _mm_castsi128_ps(_mm_and_si128(_mm_slli_epi32(_mm_sub_epi32(ei, nine), 23), _mm_cmpgt_epi32(ei, nine)));
+         denormal = _mm_movemask_ps(_mm_castsi128_ps(_mm_andnot_si128(_mm_cmpeq_epi32(ei, zero), _mm_cmplt_epi32(ei, ten))));
+         rf = _mm_mul_ps(_mm_cvtepi32_ps(ri), scale);
+         gf = _mm_mul_ps(_mm_cvtepi32_ps(gi), scale);
+         bf = _mm_mul_ps(_mm_cvtepi32_ps(bi), scale);
+         af = _mm_set1_ps(1.0f);
+         _MM_TRANSPOSE4_PS(rf, gf, bf, af);
+
+         _mm_storeu_ps(output + (i+0) * req_comp, rf);
+         _mm_storeu_ps(output + (i+1) * req_comp, gf);
+         _mm_storeu_ps(output + (i+2) * req_comp, bf);
+         _mm_storeu_ps(output + (i+3) * req_comp, af);
+         for (k=0; denormal; ++k, denormal >>= 1)
+            if (denormal & 1)
+               stbi__hdr_convert_pixel(output + (i+k) * req_comp, r[i+k], g[i+k], b[i+k], e[i+k], req_comp);
+      }
+   }
+#endif
+
+   for (; i < width; ++i)
+      stbi__hdr_convert_pixel(output + i * req_comp, r[i], g[i], b[i], e[i], req_comp);
+}
+
+// converts one planar scanline straight to 8-bit through the hdr->ldr gamma
+// curve. The curve only depends on (exponent, mantissa), so it is tabulated
+// in 'lut' one 256-entry exponent row at a time, as exponents show up.
+static void stbi__hdr_convert_row_ldr(stbi_uc *output, stbi_uc *planes, int width, int req_comp, stbi_uc *lut, stbi_uc *lut_ready)
+{
+   stbi_uc *r = planes, *g = planes + width, *b = planes + width*2, *e = planes + width*3;
+   int i, m;
+
+   for (i=0; i < width; ++i) {
+      stbi_uc *row = lut + e[i] * 256;
+      stbi_uc *o = output + i * req_comp;
+      if (!lut_ready[e[i]]) {
+         float f1 = stbi__hdr_exp2(e[i]);
+         for (m=0; m < 256; ++m) {
+            float z = (float) pow(m * f1 * stbi__h2l_scale_i, stbi__h2l_gamma_i) * 255 + 0.5f;
+            if (z < 0) z = 0;
+            if (z > 255) z = 255;
+            row[m] = (stbi_uc) stbi__float2int(z);
+         }
+         lut_ready[e[i]] = 1;
+      }
+      o[0] = row[r[i]];
+      o[1] = row[g[i]];
+      o[2] = row[b[i]];
+      if (req_comp == 4) o[3] = 255;
+   }
+}
+
+// decodes one run-length encoded channel of a scanline into 'out'
+static int stbi__hdr_rle_channel(stbi__context *s, stbi_uc *out, int width)
+{
+   int i = 0;
+   while (i < width) {
+      int nleft = width - i;
+      int count = stbi__get8(s);
+      if (count > 128) {
+         // Run
+         count -= 128;
+         if (count > nleft) return 0;
+         memset(out + i, stbi__get8(s), count);
+      } else {
+         // Dump
+         if ((count == 0) || (count > nleft)) return 0;
+         if (!stbi__getn(s, out + i, count))
+            memset(out + i, 0, count);
+      }
+      i += count;
+   }
+   return 1;
+}
+
+// reads pixels [start, width) of an uncompressed scanline into the planes
+static void stbi__hdr_flat_row(stbi__context *s, stbi_uc *planes, stbi_uc *tmp, int width, int start)
+{
+   int i, k, n = (width - start) * 4;
+   if (!stbi__getn(s, tmp, n))
+      memset(tmp, 0, n);
+   for (i=start; i < width; ++i)
+      for (k=0; k < 4; ++k)
+         planes[k * width + i] = tmp[(i - start) * 4 + k];
+}
+
+// decodes the pixel data into either 'hdr' (float) or 'ldr' (8-bit) output
+static int stbi__hdr_decode(stbi__context *s, int width, int height, int req_comp, float *hdr, stbi_uc *ldr)
+{
+   stbi_uc *scanline, *planes, *tmp, *lut = NULL;
+   stbi_uc lut_ready[256];
+   int j, k, c1, c2, len, start = 0;
+
+   scanline = (stbi_uc *) stbi__malloc_mad2(width, 8, 0);
+   if (!scanline) return stbi__err("outofmem", "Out of memory");
+   planes = scanline;
+   tmp = scanline + width * 4;
+   if (ldr) {
+      lut = (stbi_uc *) stbi__malloc(256 * 256);
+      if (!lut) { STBI_FREE(scanline); return stbi__err("outofmem", "Out of memory"); }
+      memset(lut_ready, 0, sizeof(lut_ready));
+   }
+
+   #define STBI__HDR_EMIT_ROW(j) \
+      if (hdr) stbi__hdr_convert_row(hdr + (size_t) (j) * width * req_comp, planes, width, req_comp); \
+      else     stbi__hdr_convert_row_ldr(ldr + (size_t) (j) * width * req_comp, planes, width, req_comp, lut, lut_ready)
+
+   // image data is stored as some number of scanlines
+   j = 0;
+   if (width >= 8 && width < 32768) {
+      // Read RLE-encoded data
+      for (; j < height; ++j) {
+         c1 = stbi__get8(s);
+         c2 = stbi__get8(s);
+         len = stbi__get8(s);
+         if (c1 != 2 || c2 != 2 || (len & 0x80)) {
+            // not run-length encoded, so we have to actually use THIS data as a decoded
+            // pixel (note this can't be a valid pixel--one of RGB must be >= 128); like
+            // the original loader, restart from the top as flat data (yes, this makes no sense)
+            planes[0] = (stbi_uc) c1;
+            planes[width] = (stbi_uc) c2;
+            planes[width*2] = (stbi_uc) len;
+            planes[width*3] = (stbi_uc) stbi__get8(s);
+            j = 0;
+            start = 1;
+            break;
+         }
+         len <<= 8;
+         len |= stbi__get8(s);
+         if (len != width) { STBI_FREE(scanline); STBI_FREE(lut); return stbi__err("invalid decoded scanline length", "corrupt HDR"); }
+
+         for (k = 0; k < 4; ++k) {
+            if (!stbi__hdr_rle_channel(s, planes + k * width, width)) {
+               STBI_FREE(scanline); STBI_FREE(lut);
+               return stbi__err("corrupt", "bad RLE data in HDR");
+            }
+         }
+         STBI__HDR_EMIT_ROW(j);
+      }
+   }
+
+   // Read flat data
+   for (; j < height; ++j) {
+      stbi__hdr_flat_row(s, planes, tmp, width, start);
+      start = 0;
+      STBI__HDR_EMIT_ROW(j);
+   }
+   #undef STBI__HDR_EMIT_ROW
+
+   STBI_FREE(scanline);
+   STBI_FREE(lut);
+   return 1;
+}
+
+static int stbi__hdr_parse_header(stbi__context *s, int *x, int *y)
 {
    char buffer[STBI__HDR_BUFLEN];
    char *token;
    int valid = 0;
    int width, height;
-   stbi_uc *scanline;
-   float *hdr_data;
-   int len;
-   unsigned char count, value;
-   int i, j, k, c1,c2, z;
    const char *headerToken;
-   STBI_NOTUSED(ri);
 
    // Check identifier
    headerToken = stbi__hdr_gettoken(s,buffer);
    if (strcmp(headerToken, "#?RADIANCE") != 0 && strcmp(headerToken, "#?RGBE") != 0)
-      return stbi__errpf("not HDR", "Corrupt HDR image");
+      return stbi__err("not HDR", "Corrupt HDR image");
 
    // Parse header
    for(;;) {
@@ -7181,21 +8439,35 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
       if (strcmp(token, "FORMAT=32-bit_rle_rgbe") == 0) valid = 1;
    }
 
-   if (!valid)    return stbi__errpf("unsupported format", "Unsupported HDR format");
+   if (!valid)    return stbi__err("unsupported format", "Unsupported HDR format");
 
    // Parse width and height
    // can't use sscanf() if we're not using stdio!
    token = stbi__hdr_gettoken(s,buffer);
-   if (strncmp(token, "-Y ", 3))  return stbi__errpf("unsupported data layout", "Unsupported HDR format");
+   if (strncmp(token, "-Y ", 3))  return stbi__err("unsupported data layout", "Unsupported HDR format");
    token += 3;
    height = (int) strtol(token, &token, 10);
    while (*token == ' ') ++token;
-   if (strncmp(token, "+X ", 3))  return stbi__errpf("unsupported data layout", "Unsupported HDR format");
+   if (strncmp(token, "+X ", 3))  return stbi__err("unsupported data layout", "Unsupported HDR format");
    token += 3;
    width = (int) strtol(token, NULL, 10);
 
-   if (height > STBI_MAX_DIMENSIONS) return stbi__errpf("too large","Very large image (corrupt?)");
-   if (width > STBI_MAX_DIMENSIONS) return stbi__errpf("too large","Very large image (corrupt?)");
+   if (height > STBI_MAX_DIMENSIONS) return stbi__err("too large","Very large image (corrupt?)");
+   if (width > STBI_MAX_DIMENSIONS) return stbi__err("too large","Very large image (corrupt?)");
+   if (!stbi__budget_pixels(width, height)) return 0;
+
+   *x = width;
+   *y = height;
+   return 1;
+}
+
+static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+{
+   int width, height;
+   float *hdr_data;
+   STBI_NOTUSED(ri);
+
+   if (!stbi__hdr_parse_header(s, &width, &height)) return NULL;
 
    *x = width;
    *y = height;
@@ -7211,79 +8483,41 @@ static float *stbi__hdr_load(stbi__context *s, int *x, int *y, int *comp, int re
    if (!hdr_data)
       return stbi__errpf("outofmem", "Out of memory");
 
-   // Load image data
-   // image data is stored as some number of sca
-   if ( width < 8 || width >= 32768) {
-      // Read flat data
-      for (j=0; j < height; ++j) {
-         for (i=0; i < width; ++i) {
-            stbi_uc rgbe[4];
-           main_decode_loop:
-            stbi__getn(s, rgbe, 4);
-            stbi__hdr_convert(hdr_data + j * width * req_comp + i * req_comp, rgbe, req_comp);
-         }
-      }
-   } else {
-      // Read RLE-encoded data
-      scanline = NULL;
+   if (!stbi__hdr_decode(s, width, height, req_comp, hdr_data, NULL)) {
+      STBI_FREE(hdr_data);
+      return NULL;
+   }
+   return hdr_data;
+}
 
-      for (j = 0; j < height; ++j) {
-         c1 = stbi__get8(s);
-         c2 = stbi__get8(s);
-         len = stbi__get8(s);
-         if (c1 != 2 || c2 != 2 || (len & 0x80)) {
-            // not run-length encoded, so we have to actually use THIS data as a decoded
-            // pixel (note this can't be a valid pixel--one of RGB must be >= 128)
-            stbi_uc rgbe[4];
-            rgbe[0] = (stbi_uc) c1;
-            rgbe[1] = (stbi_uc) c2;
-            rgbe[2] = (stbi_uc) len;
-            rgbe[3] = (stbi_uc) stbi__get8(s);
-            stbi__hdr_convert(hdr_data, rgbe, req_comp);
-            i = 1;
-            j = 0;
-            STBI_FREE(scanline);
-            goto main_decode_loop; // yes, this makes no sense
-         }
-         len <<= 8;
-         len |= stbi__get8(s);
-         if (len != width) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
-         if (scanline == NULL) {
-            scanline = (stbi_uc *) stbi__malloc_mad2(width, 4, 0);
-            if (!scanline) {
-               STBI_FREE(hdr_data);
-               return stbi__errpf("outofmem", "Out of memory");
-            }
-         }
+// 8-bit load for 3/4 components that goes through the gamma curve while
+// decoding instead of building (and then converting) a float image
+static stbi_uc *stbi__hdr_load_ldr(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
+{
+   int width, height;
+   stbi_uc *ldr_data;
+   STBI_NOTUSED(ri);
 
-         for (k = 0; k < 4; ++k) {
-            int nleft;
-            i = 0;
-            while ((nleft = width - i) > 0) {
-               count = stbi__get8(s);
-               if (count > 128) {
-                  // Run
-                  value = stbi__get8(s);
-                  count -= 128;
-                  if ((count == 0) || (count > nleft)) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
-                  for (z = 0; z < count; ++z)
-                     scanline[i++ * 4 + k] = value;
-               } else {
-                  // Dump
-                  if ((count == 0) || (count > nleft)) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
-                  for (z = 0; z < count; ++z)
-                     scanline[i++ * 4 + k] = stbi__get8(s);
-               }
-            }
-         }
-         for (i=0; i < width; ++i)
-            stbi__hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
-      }
-      if (scanline)
-         STBI_FREE(scanline);
-   }
+   if (!stbi__hdr_parse_header(s, &width, &height)) return NULL;
 
-   return hdr_data;
+   *x = width;
+   *y = height;
+
+   if (comp) *comp = 3;
+   if (req_comp == 0) req_comp = 3;
+
+   if (!stbi__mad3sizes_valid(width, height, req_comp, 0))
+      return stbi__errpuc("too large", "HDR image is too large");
+
+   ldr_data = (stbi_uc *) stbi__malloc_mad3(width, height, req_comp, 0);
+   if (!ldr_data)
+      return stbi__errpuc("outofmem", "Out of memory");
+
+   if (!stbi__hdr_decode(s, width, height, req_comp, NULL, ldr_data)) {
+      STBI_FREE(ldr_data);
+      return NULL;
+   }
+   return ldr_data;
 }
 
 static int stbi__hdr_info(stbi__context *s, int *x, int *y, int *comp)
@@ -7514,6 +8748,7 @@ static void *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int req
 
    if (s->img_y > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
    if (s->img_x > STBI_MAX_DIMENSIONS) return stbi__errpuc("too large","Very large image (corrupt?)");
+   if (!stbi__budget_pixels(s->img_x, s->img_y)) return NULL;
 
    *x = s->img_x;
    *y = s->img_y;
@@ -0,0 +1,101 @@
+// RGBE -> float conversion of the Radiance HDR decoder against the ldexp
+// formula it replaced, for every (exponent, mantissa) pair and every
+// requested channel count. Exponents up to 255 must stay finite and the
+// denormal ones (1..8) must not flush to zero.
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_HDR
+#include "../stb_image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define W 256
+#define H 256
+
+// pixel (x, y): mantissas x, 255-x, x^y, exponent y; flat (not RLE) rows,
+// since no row starts with 2, 2
+static unsigned char *make_hdr(int *len) {
+    static const char header[] = "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y 256 +X 256\n";
+    int n = (int) strlen(header);
+    unsigned char *data = malloc(n + W * H * 4);
+    if (data == NULL) return NULL;
+    memcpy(data, header, n);
+    for (int y = 0; y < H; y++) {
+        for (int x = 0; x < W; x++) {
+            unsigned char *p = data + n + (y * W + x) * 4;
+            p[0] = (unsigned char) x;
+            p[1] = (unsigned char) (255 - x);
+            p[2] = (unsigned char) (x ^ y);
+            p[3] = (unsigned char) y;
+        }
+    }
+    *len = n + W * H * 4;
+    return data;
+}
+
+// the conversion as stb_image had it
+static void reference(float *o, const unsigned char *p, int comp) {
+    if (p[3] != 0) {
+        float f1 = (float) ldexp(1.0f, p[3] - (int) (128 + 8));
+        if (comp <= 2) o[0] = (p[0] + p[1] + p[2]) * f1 / 3;
+        else {
+            o[0] = p[0] * f1;
+            o[1] = p[1] * f1;
+            o[2] = p[2] * f1;
+        }
+        if (comp == 2) o[1] = 1;
+        if (comp == 4) o[3] = 1;
+    }
+    else {
+        for (int c = 0; c < comp; c++) o[c] = 0;
+        if (comp == 2) o[1] = 1;
+        if (comp == 4) o[3] = 1;
+    }
+}
+
+int main(void) {
+    int len, failures = 0;
+    unsigned char *data = make_hdr(&len);
+    if (data == NULL) {
+        printf("Failed to allocate the test image\n");
+        return 1;
+    }
+    const unsigned char *pixels = data + len - W * H * 4;
+    stbi_hdr_to_ldr_gamma(1.0f); // no gamma or scale on the float path
+    stbi_hdr_to_ldr_scale(1.0f);
+
+    for (int comp = 1; comp <= 4; comp++) {
+        int w, h, n;
+        float *img = stbi_loadf_from_memory(data, len, &w, &h, &n, comp);
+        if (img == NULL || w != W || h != H) {
+            printf("comp %d: load failed: %s\n", comp, stbi_failure_reason());
+            failures++;
+            continue;
+        }
+        for (int i = 0; i < W * H; i++) {
+            float want[4];
+            reference(want, pixels + i * 4, comp);
+            if (memcmp(want, img + i * comp, comp * sizeof(float)) != 0) {
+                if (failures < 10) {
+                    printf("comp %d: pixel (%d, %d) e=%d: got %g, want %g\n", comp, i % W, i / W,
+                           pixels[i * 4 + 3], img[i * comp], want[0]);
+                }
+                failures++;
+            }
+            if (!isfinite(img[i * comp])) {
+                printf("comp %d: pixel (%d, %d) is not finite\n", comp, i % W, i / W);
+                failures++;
+            }
+        }
+        stbi_image_free(img);
+    }
+    free(data);
+    if (failures > 0) {
+        printf("hdr_rgbe: %d mismatches\n", failures);
+        return 1;
+    }
+    printf("hdr_rgbe: ok\n");
+    return 0;
+}
@@ -0,0 +1,4510 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // CPU affinity
+#endif
+#include <stdio.h>
+#include <unistd.h>
+#include <linux/fb.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <termios.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <malloc.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifndef ZFBV_NO_DRM
+#include <drm.h>
+#include <drm_mode.h>
+#endif
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include "zfbv.h"
+
+typedef struct drm_output drm_output;
+typedef struct color_lut color_lut;
+typedef struct palette palette;
+
+// task pool priorities, highest first
+typedef enum task_priority {
+    TASK_INTERACTIVE,    // rendering what the user is looking at
+    TASK_VISIBLE,        // decoding the image about to be shown
+    TASK_PREFETCH,       // decoding images that may be shown later
+    TASK_PREFETCH_START, // starting such a decode, after the running ones' subtasks
+    TASK_PRIORITIES
+} task_priority;
+
+typedef struct task_pool task_pool;
+typedef void (*task_fn)(void *arg, int index);
+
+// tasks whose token is cancelled before they start are dropped; running
+// tasks can poll task_cancelled to stop early
+typedef struct task_token {
+    atomic_int cancelled;
+} task_token;
+
+typedef struct task_group {
+    atomic_int pending;
+    atomic_int priority; // the lowest of its tasks'; waiters only run tasks at or above it
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} task_group;
+
+// x0 <= x < x1, y0 <= y < y1
+typedef struct fb_rect {
+    int x0, y0, x1, y1;
+} fb_rect;
+
+typedef struct framebuffer {
+    int fd;
+    char *fbp;
+    char *buffer;
+    int width;
+    int height;
+    int bpp;
+    int stride; // bytes per row of 'buffer'
+    int dither; // ordered dither matrix size for 16 and 8 bpp output: 0 (off), 4 or 8
+    int rgb30;    // 32 bpp with 10-bit channels (2:10:10:10)
+    int shift[3]; // rgb30: bit offsets of red, green and blue
+
+    // 8 bpp: pixels are grey levels or entries of 'pal', which the next
+    // update loads into the colormap (NULL if it cannot be set)
+    int gray;
+    const palette *pal;
+    unsigned pal_shown; // id of the palette in the colormap, 0 for none
+    uint16_t *saved_cmap; // the console's colormap (256 reds, greens, blues), put back on destroy
+
+    // diff present: only spans that differ from 'shadow' (a copy of what is
+    // on screen) are written to fbp, for deferred-I/O and SPI/USB panels
+    int diff_present;
+    char *shadow;
+    size_t bytes_written; // by the last framebuffer_update
+    size_t total_bytes_written;
+    int updates;
+
+    drm_output *drm; // set when presenting through DRM/KMS instead of fbdev
+    double refresh_seconds; // one refresh period when presents wait for vblank, else 0
+
+    const color_lut *lut; // colour transform applied to images as they are drawn, NULL for none
+} framebuffer;
+
+
+typedef enum image_format {
+    IMAGE_RGB,   // interleaved, 'bpp' bytes per pixel
+    IMAGE_RGB16, // interleaved 16-bit samples, 'bpp' bytes (twice the channels) per pixel
+    IMAGE_YCBCR  // JPEG planes, converted to RGB only by the blit
+} image_format;
+
+typedef struct Image {
+    int width;
+    int height;
+    int bpp;
+    int stride;
+    uint8_t *data;
+
+    // IMAGE_YCBCR: 'data' holds the Y plane followed by the Cb and Cr planes at
+    // their native subsampling (chroma_x by chroma_y luma pixels per sample),
+    // each tightly packed; 'planes' point into it and 'stride' is unused
+    int format;
+    uint8_t *planes[3];
+    int plane_width[3];
+    int plane_height[3];
+    int chroma_x, chroma_y;
+
+    uint8_t *icc; // embedded ICC profile, NULL if the file had none
+    int icc_len;
+} Image;
+
+framebuffer *framebuffer_create(const char *device);
+framebuffer *framebuffer_create_drm(const char *device);
+void framebuffer_destroy(framebuffer *fb);
+void framebuffer_destroy_drm(framebuffer *fb);
+void framebuffer_update_drm(framebuffer *fb);
+void framebuffer_update(framebuffer *fb);
+void framebuffer_update_rects(framebuffer *fb, const fb_rect *rects, int count);
+int framebuffer_next_diff(const char *a, const char *b, int start, int len);
+int framebuffer_next_same(const char *a, const char *b, int start, int len);
+void framebuffer_clear_color(framebuffer *fb, uint8_t r, uint8_t g, uint8_t b);
+void framebuffer_clear_rect(framebuffer *fb, const fb_rect *rect, uint8_t r, uint8_t g, uint8_t b);
+void framebuffer_prefault(framebuffer *fb);
+void framebuffer_draw_image(framebuffer *image, int x, int y, Image *img);
+void framebuffer_draw_image_clipped(framebuffer *fb, int x, int y, Image *img, const fb_rect *clip);
+
+void rgb565_dither_row(uint8_t *out, int dither, int x, int y);
+void rgb565_blit_row(uint16_t *dst, const uint8_t *src, int count, int src_bpp, const uint8_t *dither);
+void rgb30_blit_row(uint32_t *dst, const uint8_t *src, int count, int src_bpp, const int shift[3]);
+void rgb30_blit_row16(uint32_t *dst, const uint16_t *src, int count, const int shift[3]);
+void gray_blit_row(uint8_t *dst, const uint8_t *src, int count, int src_bpp);
+
+palette *palette_create(const Image *img, const color_lut *lut);
+void palette_free(palette *pal);
+const palette *palette_uniform(void);
+const palette *palette_gray(void);
+uint8_t palette_lookup(const palette *pal, int r, int g, int b);
+void palette_dither_row(int8_t *out, int dither, const palette *pal, int x, int y);
+void palette_blit_row(uint8_t *dst, const uint8_t *src, int count, int src_bpp, const palette *pal,
+                      const int8_t *dither);
+void framebuffer_show_palette(framebuffer *fb);
+void framebuffer_save_cmap(framebuffer *fb);
+void framebuffer_restore_cmap(framebuffer *fb);
+
+
+Image *Image_load(const char *filename);
+Image *Image_load_deep(const char *filename);
+void Image_decode_on(task_pool *pool);
+void Image_set_planes(Image *img, uint8_t *data, int chroma_x, int chroma_y);
+void Image_ycbcr_row(const Image *img, int y, int x0, int count, uint8_t *rgb, uint8_t *chroma);
+void Image_free(Image *img);
+
+uint8_t *icc_load_file(const char *filename, int *len);
+color_lut *color_lut_create(const uint8_t *src_icc, int src_len, const uint8_t *dst_icc, int dst_len);
+void color_lut_free(color_lut *lut);
+void color_lut_apply_row(const color_lut *lut, uint8_t *dst, const uint8_t *src, int count, int src_bpp);
+void color_lut_apply_row16(const color_lut *lut, uint16_t *dst, const uint16_t *src, int count);
+
+Image *Image_resize_linear(Image *src, int new_width, int new_height);
+Image *Image_resize_linear_pool(Image *src, int new_width, int new_height, task_pool *pool);
+Image *Image_resize_region(Image *src, int x, int y, int width, int height, int new_width, int new_height);
+
+float fit_scale(framebuffer *fb, int width, int height);
+void show_png_pass(void *user, const stbi_uc *pixels, int width, int height, int channels, int pass);
+
+extern float resize_sharpen;
+extern int task_pool_threads;
+task_pool *task_pool_create(int threads);
+void task_pool_destroy(task_pool *pool);
+task_pool *task_pool_shared(void);
+int task_pool_concurrency(task_pool *pool);
+void task_submit(task_pool *pool, task_priority priority, task_token *token, task_group *group,
+                 task_fn fn, void *arg, int index);
+void task_group_init(task_group *group);
+void task_group_destroy(task_group *group);
+void task_group_wait(task_pool *pool, task_group *group);
+void task_parallel_for(task_pool *pool, task_priority priority, task_token *token,
+                       int count, task_fn fn, void *arg);
+int task_bands(task_pool *pool, int rows, int min_rows);
+void task_token_init(task_token *token);
+void task_token_cancel(task_token *token);
+int task_cancelled(task_token *token);
+int task_pool_realtime(task_pool *pool, const cpu_set_t *cpus, int priority);
+
+// timeline tracing: spans are only recorded while trace_enabled is set, so
+// the disabled cost is one relaxed load per span
+extern atomic_int trace_enabled;
+void trace_event(char phase, const char *name, int index);
+int trace_start(void);
+int trace_write(const char *path);
+#define trace_begin(name, index) \
+    do { if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) trace_event('B', name, index); } while (0)
+#define trace_end(name) \
+    do { if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) trace_event('E', name, 0); } while (0)
+
+
+
+framebuffer *framebuffer_create(const char *device) {
+    if (strncmp(device, "/dev/dri/", 9) == 0) {
+        return framebuffer_create_drm(device);
+    }
+
+    framebuffer *fb = malloc(sizeof(framebuffer));
+    if (fb == NULL) {
+        printf("Failed to allocate framebuffer struct\n");
+        return NULL;
+    }
+
+    fb->fd = open(device, O_RDWR);
+    if (fb->fd == -1) {
+        printf("Failed to open framebuffer device\n");
+        free(fb);
+        return NULL;
+    }
+
+    struct fb_var_screeninfo vinfo;
+    if (ioctl(fb->fd, FBIOGET_VSCREENINFO, &vinfo) == -1) {
+        printf("Failed to get variable screen info\n");
+        close(fb->fd);
+        free(fb);
+        return NULL;
+    }
+
+    fb->width = vinfo.xres;
+    fb->height = vinfo.yres;
+    fb->bpp = vinfo.bits_per_pixel / 8;
+    fb->stride = fb->width * fb->bpp;
+    fb->dither = 0;
+    fb->rgb30 = 0;
+    fb->gray = 0;
+    fb->pal = NULL;
+    fb->pal_shown = 0;
+    fb->saved_cmap = NULL;
+    fb->diff_present = 0;
+    fb->shadow = NULL;
+    fb->bytes_written = 0;
+    fb->total_bytes_written = 0;
+    fb->updates = 0;
+    fb->drm = NULL;
+    fb->refresh_seconds = 0.0;
+    fb->lut = NULL;
+
+    if (fb->bpp == 2 && (vinfo.red.offset != 11 || vinfo.red.length != 5 ||
+                         vinfo.green.offset != 5 || vinfo.green.length != 6 ||
+                         vinfo.blue.offset != 0 || vinfo.blue.length != 5)) {
+        printf("Unsupported 16 bpp layout (only RGB565 is supported)\n");
+        close(fb->fd);
+        free(fb);
+        return NULL;
+    }
+    if (fb->bpp == 4 && vinfo.red.length == 10 && vinfo.green.length == 10 && vinfo.blue.length == 10) {
+        fb->rgb30 = 1;
+        fb->shift[0] = vinfo.red.offset;
+        fb->shift[1] = vinfo.green.offset;
+        fb->shift[2] = vinfo.blue.offset;
+    }
+    if (fb->bpp == 1) {
+        struct fb_fix_screeninfo finfo;
+        if (ioctl(fb->fd, FBIOGET_FSCREENINFO, &finfo) == -1) {
+            printf("Failed to get fixed screen info\n");
+            close(fb->fd);
+            free(fb);
+            return NULL;
+        }
+        // a greyscale display without a colormap is taken to be a ramp already
+        fb->gray = vinfo.grayscale != 0;
+        if (!fb->gray && finfo.visual != FB_VISUAL_PSEUDOCOLOR) {
+            printf("Unsupported 8 bpp visual (only pseudocolour and greyscale are supported)\n");
+            close(fb->fd);
+            free(fb);
+            return NULL;
+        }
+        if (finfo.visual == FB_VISUAL_PSEUDOCOLOR) {
+            fb->pal = fb->gray ? palette_gray() : palette_uniform();
+            framebuffer_save_cmap(fb);
+        }
+    }
+
+    int screensize = fb->width * fb->height * fb->bpp;
+    fb->fbp = (char *) mmap(0, screensize, PROT_READ | PROT_WRITE, MAP_SHARED, fb->fd, 0);
+    if (fb->fbp == MAP_FAILED) {
+        printf("Failed to map framebuffer\n");
+        close(fb->fd);
+        free(fb->saved_cmap);
+        free(fb);
+        return NULL;
+    }
+
+    fb->buffer = malloc(screensize);
+    if (fb->buffer == NULL) {
+        printf("Failed to allocate framebuffer buffer\n");
+        munmap(fb->fbp, screensize);
+        close(fb->fd);
+        free(fb->saved_cmap);
+        free(fb);        return NULL;
+    }
+    printf("Framebuffer opened: %dx%d, %d bpp\n", fb->width, fb->height, fb->bpp);
+    return fb;
+}
+
+void framebuffer_destroy(framebuffer *fb) {
+    if (fb == NULL) return;
+    if (fb->drm != NULL) {
+        framebuffer_destroy_drm(fb);
+        return;
+    }
+    int screensize = fb->width * fb->height * fb->bpp;
+    framebuffer_restore_cmap(fb);
+    munmap(fb->fbp, screensize);
+    close(fb->fd);
+    free(fb->buffer);
+    free(fb->shadow);
+    free(fb->saved_cmap);
+    free(fb);
+}
+
+static void framebuffer_update_fbdev(framebuffer *fb, const fb_rect *rects, int count);
+
+void framebuffer_update(framebuffer *fb) {
+    framebuffer_update_rects(fb, NULL, 0);
+}
+
+// shows the buffer when only 'rects' changed since the last update (NULL
+// for anything may have): fbdev then copies just those. DRM flips whole
+// buffers either way.
+void framebuffer_update_rects(framebuffer *fb, const fb_rect *rects, int count) {
+    if (fb == NULL) return;
+    trace_begin("present", fb->updates);
+    if (fb->drm != NULL) {
+        framebuffer_update_drm(fb);
+    }
+    else {
+        framebuffer_update_fbdev(fb, rects, count);
+    }
+    trace_end("present");
+}
+
+// writes the changed spans between bytes 'start' and 'end' of row 'y'
+static size_t framebuffer_diff_span(framebuffer *fb, int y, int start, int end) {
+    const char *src = fb->buffer + (size_t) y * fb->stride + start;
+    char *old = fb->shadow + (size_t) y * fb->stride + start;
+    char *dst = fb->fbp + (size_t) y * fb->stride + start;
+    int len = end - start;
+    size_t written = 0;
+
+    int x = 0;
+    while ((x = framebuffer_next_diff(src, old, x, len)) < len) {
+        int span_end = framebuffer_next_same(src, old, x, len);
+        memcpy(dst + x, src + x, span_end - x);
+        memcpy(old + x, src + x, span_end - x);
+        written += span_end - x;
+        x = span_end;
+    }
+    return written;
+}
+
+static void framebuffer_update_fbdev(framebuffer *fb, const fb_rect *rects, int count) {
+    if (fb->buffer == NULL || fb->fbp == NULL) return;
+    int screensize = fb->width * fb->height * fb->bpp;
+    fb->updates++;
+    if (fb->bpp == 1) {
+        framebuffer_show_palette(fb);
+    }
+
+    // the rects must be clipped to the screen; the first diff present still
+    // needs the full copy below to start its shadow
+    if (rects != NULL && (!fb->diff_present || fb->shadow != NULL)) {
+        size_t written = 0;
+        for (int i = 0; i < count; i++) {
+            int start = rects[i].x0 * fb->bpp, end = rects[i].x1 * fb->bpp;
+            for (int y = rects[i].y0; y < rects[i].y1 && start < end; y++) {
+                if (fb->diff_present) {
+                    written += framebuffer_diff_span(fb, y, start, end);
+                    continue;
+                }
+                size_t offset = (size_t) y * fb->stride + start;
+                memcpy(fb->fbp + offset, fb->buffer + offset, end - start);
+                written += end - start;
+            }
+        }
+        fb->bytes_written = written;
+        fb->total_bytes_written += written;
+        return;
+    }
+
+    if (!fb->diff_present || fb->shadow == NULL) {
+        memcpy(fb->fbp, fb->buffer, screensize);
+        fb->bytes_written = screensize;
+        fb->total_bytes_written += screensize;
+
+        // the first diff present has nothing to compare against, so it
+        // copies everything and starts the shadow from here
+        if (fb->diff_present) {
+            fb->shadow = malloc(screensize);
+            if (fb->shadow == NULL) {
+                printf("Failed to allocate framebuffer shadow, diff present disabled\n");
+                fb->diff_present = 0;
+                return;
+            }
+            memcpy(fb->shadow, fb->buffer, screensize);
+        }
+        return;
+    }
+
+    size_t written = 0;
+    int row_bytes = fb->width * fb->bpp;
+    for (int y = 0; y < fb->height; y++) {
+        written += framebuffer_diff_span(fb, y, 0, row_bytes);
+    }
+    fb->bytes_written = written;
+    fb->total_bytes_written += written;
+}
+
+// faults in every page of 'p', writing to them if 'write' is set (anonymous
+// memory is only backed by its own pages once written)
+static void prefault_pages(char *p, size_t len, int write) {
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < len; i += page) {
+        volatile char *c = p + i;
+        if (write) {
+            *c = *c;
+        }
+        else {
+            (void) *c;
+        }
+    }
+}
+
+// touches every page of both buffers so the first frames do not fault them
+// in, and creates the diff present shadow now (from what is on screen)
+// instead of on the first present. The mapped framebuffer is only read: on
+// deferred-I/O displays a write would mark every page dirty and flush the
+// whole screen, undoing diff present.
+void framebuffer_prefault(framebuffer *fb) {
+    if (fb == NULL || fb->buffer == NULL || fb->fbp == NULL) return;
+    size_t screensize = (size_t) fb->height * fb->stride;
+    prefault_pages(fb->buffer, screensize, 1);
+    prefault_pages(fb->fbp, screensize, 0);
+    if (fb->diff_present && fb->drm == NULL && fb->shadow == NULL) {
+        fb->shadow = malloc(screensize);
+        if (fb->shadow == NULL) {
+            printf("Failed to allocate framebuffer shadow\n");
+            return;
+        }
+        memcpy(fb->shadow, fb->fbp, screensize);
+    }
+}
+
+// diff present works on 16-byte blocks; a changed span only ends once this
+// many unchanged blocks follow it, so nearby changes go out as one write
+#define DIFF_BLOCK 16
+#define DIFF_GAP_BLOCKS 4
+
+static int diff_block_equal(const char *a, const char *b, int start, int len) {
+    if (start + DIFF_BLOCK > len) {
+        return memcmp(a + start, b + start, len - start) == 0;
+    }
+#ifdef __SSE2__
+    __m128i va = _mm_loadu_si128((const __m128i *) (a + start));
+    __m128i vb = _mm_loadu_si128((const __m128i *) (b + start));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) == 0xFFFF;
+#else
+    return memcmp(a + start, b + start, DIFF_BLOCK) == 0;
+#endif
+}
+
+// offset of the first block at or after 'start' where a and b differ, or len
+int framebuffer_next_diff(const char *a, const char *b, int start, int len) {
+#ifdef __SSE2__
+    // four blocks per step over the (usual) long unchanged stretches
+    while (start + 4 * DIFF_BLOCK <= len) {
+        __m128i eq = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + start)),
+                                         _mm_loadu_si128((const __m128i *) (b + start))),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + start + 16)),
+                                         _mm_loadu_si128((const __m128i *) (b + start + 16)))),
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + start + 32)),
+                                         _mm_loadu_si128((const __m128i *) (b + start + 32))),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + start + 48)),
+                                         _mm_loadu_si128((const __m128i *) (b + start + 48)))));
+        if (_mm_movemask_epi8(eq) != 0xFFFF) break;
+        start += 4 * DIFF_BLOCK;
+    }
+#endif
+    while (start < len && diff_block_equal(a, b, start, len)) {
+        start += DIFF_BLOCK;
+    }
+    return start < len ? start : len;
+}
+
+// end of the changed span starting at 'start'
+int framebuffer_next_same(const char *a, const char *b, int start, int len) {
+    int end = start + DIFF_BLOCK;
+    int same = 0;
+    for (int x = end; x < len && same < DIFF_GAP_BLOCKS; x += DIFF_BLOCK) {
+        if (diff_block_equal(a, b, x, len)) {
+            same++;
+        }
+        else {
+            same = 0;
+            end = x + DIFF_BLOCK;
+        }
+    }
+    return end < len ? end : len;
+}
+
+// clear and blit are split into bands of rows run on the shared task pool
+#define BLIT_BAND_ROWS 16
+
+typedef struct blit_job {
+    framebuffer *fb;
+    Image *img;
+    int x_offset, y_offset;
+    int x_start, x_end;
+    int y_start, y_end;
+    int bands;
+    uint8_t r, g, b;
+} blit_job;
+
+static void blit_band_rows(blit_job *job, int band, int *y_start, int *y_end) {
+    int rows = job->y_end - job->y_start;
+    *y_start = job->y_start + (int) ((long) rows * band / job->bands);
+    *y_end = job->y_start + (int) ((long) rows * (band + 1) / job->bands);
+}
+
+// 2:10:10:10 output: 8-bit channels are widened by repeating their top
+// bits, so 255 is still full scale
+static inline uint32_t rgb30_channel(int v) {
+    return (v << 2) | (v >> 6);
+}
+
+// 16-bit channels are rounded to 10 bits; v >> 10 stands in for v / 1025,
+// which scales 65535 to 1023 without a multiply
+static inline uint32_t rgb30_channel16(int v) {
+    return (v + 32 - (v >> 10)) >> 6;
+}
+
+static void clear_band(void *arg, int band) {
+    blit_job *job = arg;
+    framebuffer *fb = job->fb;
+    int y_start, y_end;
+    blit_band_rows(job, band, &y_start, &y_end);
+    trace_begin("clear", band);
+
+    if (fb->bpp == 1) {
+        uint8_t color = fb->gray ? (77 * job->r + 150 * job->g + 29 * job->b + 128) >> 8
+                                 : palette_lookup(fb->pal, job->r, job->g, job->b);
+        for (int y = y_start; y < y_end; y++) {
+            memset(fb->buffer + y * fb->stride + job->x_start, color, job->x_end - job->x_start);
+        }
+    }
+    else if (fb->bpp == 2) {
+        uint16_t color = ((job->r & 0xF8) << 8) | ((job->g & 0xFC) << 3) | (job->b >> 3);
+        for (int y = y_start; y < y_end; y++) {
+            uint16_t *pixels = (uint16_t *) (fb->buffer + y * fb->stride);
+            for (int x = job->x_start; x < job->x_end; x++) {
+                pixels[x] = color;
+            }
+        }
+    }
+    else if (fb->rgb30) {
+        uint32_t color = rgb30_channel(job->r) << fb->shift[0] | rgb30_channel(job->g) << fb->shift[1] |
+                         rgb30_channel(job->b) << fb->shift[2];
+        for (int y = y_start; y < y_end; y++) {
+            uint32_t *pixels = (uint32_t *) (fb->buffer + y * fb->stride);
+            for (int x = job->x_start; x < job->x_end; x++) {
+                pixels[x] = color;
+            }
+        }
+    }
+    else {
+        int row_bytes = (job->x_end - job->x_start) * fb->bpp;
+        for (int y = y_start; y < y_end; y++) {
+            char *row = fb->buffer + y * fb->stride + job->x_start * fb->bpp;
+            for (int i = 0; i < row_bytes; i += fb->bpp) {
+                row[i] = job->b;
+                row[i + 1] = job->g;
+                row[i + 2] = job->r;
+            }
+        }
+    }
+    trace_end("clear");
+}
+
+void framebuffer_clear_color(framebuffer *fb, uint8_t r, uint8_t g, uint8_t b) {
+    if (fb == NULL) return;
+    fb_rect all = { 0, 0, fb->width, fb->height };
+    framebuffer_clear_rect(fb, &all, r, g, b);
+}
+
+// fills 'rect', clipped to the screen
+void framebuffer_clear_rect(framebuffer *fb, const fb_rect *rect, uint8_t r, uint8_t g, uint8_t b) {
+    if (fb == NULL || fb->fbp == NULL) return;
+    if (fb->bpp < 1) {
+        printf("Unsupported bits per pixel: %d\n", fb->bpp * 8);
+        return;
+    }
+
+    int x0 = rect->x0 < 0 ? 0 : rect->x0;
+    int y0 = rect->y0 < 0 ? 0 : rect->y0;
+    int x1 = rect->x1 > fb->width ? fb->width : rect->x1;
+    int y1 = rect->y1 > fb->height ? fb->height : rect->y1;
+    if (x0 >= x1 || y0 >= y1) return;
+
+    task_pool *pool = task_pool_shared();
+    blit_job job = { .fb = fb, .x_start = x0, .x_end = x1, .y_start = y0, .y_end = y1,
+                     .r = r, .g = g, .b = b };
+    job.bands = task_bands(pool, y1 - y0, BLIT_BAND_ROWS);
+    task_parallel_for(pool, TASK_INTERACTIVE, NULL, job.bands, clear_band, &job);
+}
+
+// planar and colour managed images, and everything drawn at 8 bpp, are
+// converted a row at a time into an RGB row that then goes through the same
+// pixel format paths as interleaved images. 16-bit images are colour managed
+// at 16 bits, and only rounded to 8 for displays without 10-bit channels.
+static void draw_band_converted(blit_job *job, int y_start, int y_end) {
+    framebuffer *fb = job->fb;
+    Image *img = job->img;
+    int count = job->x_end - job->x_start;
+    int x0 = job->x_start - job->x_offset;
+    int planar = img->format == IMAGE_YCBCR;
+
+    int deep = img->format == IMAGE_RGB16 && fb->lut != NULL;
+    uint8_t *rgb = malloc(count * 3 + (planar ? 2 * (img->plane_width[1] + 2) : 0) + (deep ? count * 6 : 0));
+    if (rgb == NULL) {
+        printf("Failed to allocate blit row\n");
+        return;
+    }
+    uint8_t *chroma = rgb + count * 3;
+    uint16_t *wide = (uint16_t *) (rgb + count * 3); // deep: the transformed 16-bit row
+
+    uint8_t dither[32];
+    int8_t offsets[8];
+    for (int y = y_start; y < y_end; y++) {
+        const uint8_t *src = rgb;
+        int src_bpp = 3;
+        if (planar) {
+            Image_ycbcr_row(img, y - job->y_offset, x0, count, rgb, chroma);
+        }
+        else if (img->format == IMAGE_RGB16) {
+            const uint16_t *p = (const uint16_t *) (img->data + (size_t) (y - job->y_offset) * img->stride) + x0 * 3;
+            if (deep) {
+                color_lut_apply_row16(fb->lut, wide, p, count);
+                p = wide;
+                if (fb->rgb30) {
+                    rgb30_blit_row16((uint32_t *) (fb->buffer + y * fb->stride) + job->x_start, p, count, fb->shift);
+                    continue;
+                }
+            }
+            for (int i = 0; i < count * 3; i++) {
+                rgb[i] = (p[i] + 128 - (p[i] >> 8)) >> 8;
+            }
+        }
+        else {
+            src = img->data + (size_t) (y - job->y_offset) * img->stride + x0 * img->bpp;
+            src_bpp = img->bpp;
+        }
+        if (fb->lut != NULL && !deep) {
+            color_lut_apply_row(fb->lut, rgb, src, count, src_bpp);
+            src = rgb;
+            src_bpp = 3;
+        }
+
+        if (fb->bpp == 2) {
+            uint16_t *dst = (uint16_t *) (fb->buffer + y * fb->stride) + job->x_start;
+            rgb565_dither_row(dither, fb->dither, job->x_start, y);
+            rgb565_blit_row(dst, src, count, src_bpp, dither);
+            continue;
+        }
+        if (fb->rgb30) {
+            rgb30_blit_row((uint32_t *) (fb->buffer + y * fb->stride) + job->x_start, src, count, src_bpp, fb->shift);
+            continue;
+        }
+        if (fb->bpp == 1) {
+            uint8_t *dst = (uint8_t *) fb->buffer + y * fb->stride + job->x_start;
+            if (fb->gray) {
+                gray_blit_row(dst, src, count, src_bpp);
+            }
+            else {
+                palette_dither_row(offsets, fb->dither, fb->pal, job->x_start, y);
+                palette_blit_row(dst, src, count, src_bpp, fb->pal, offsets);
+            }
+            continue;
+        }
+        char *dst = fb->buffer + y * fb->stride + job->x_start * fb->bpp;
+        for (int x = 0; x < count; x++) {
+            dst[0] = src[x * src_bpp + 2];
+            dst[1] = src[x * src_bpp + 1];
+            dst[2] = src[x * src_bpp];
+            dst += fb->bpp;
+        }
+    }
+    free(rgb);
+}
+
+static void draw_band_rows(blit_job *job, int band) {
+    framebuffer *fb = job->fb;
+    Image *img = job->img;
+    int x_offset = job->x_offset;
+    int y_offset = job->y_offset;
+    int y_start, y_end;
+    blit_band_rows(job, band, &y_start, &y_end);
+
+    if (img->format == IMAGE_YCBCR || fb->lut != NULL || (img->format == IMAGE_RGB16 && !fb->rgb30) || fb->bpp == 1) {
+        draw_band_converted(job, y_start, y_end);
+        return;
+    }
+
+    if (fb->rgb30) {
+        for (int y = y_start; y < y_end; y++) {
+            uint32_t *dst = (uint32_t *) (fb->buffer + y * fb->stride) + job->x_start;
+            uint8_t *src = img->data + (size_t) (y - y_offset) * img->stride + (job->x_start - x_offset) * img->bpp;
+            if (img->format == IMAGE_RGB16) {
+                rgb30_blit_row16(dst, (const uint16_t *) src, job->x_end - job->x_start, fb->shift);
+            }
+            else {
+                rgb30_blit_row(dst, src, job->x_end - job->x_start, img->bpp, fb->shift);
+            }
+        }
+        return;
+    }
+
+    if (fb->bpp == 2) {
+        uint8_t dither[32];
+        for (int y = y_start; y < y_end; y++) {
+            uint16_t *dst = (uint16_t *) (fb->buffer + y * fb->stride) + job->x_start;
+            uint8_t *src = img->data + (y - y_offset) * img->stride + (job->x_start - x_offset) * img->bpp;
+            rgb565_dither_row(dither, fb->dither, job->x_start, y);
+            rgb565_blit_row(dst, src, job->x_end - job->x_start, img->bpp, dither);
+        }
+        return;
+    }
+
+    for (int y = y_start; y < y_end; y++) {
+        int fb_row_offset = y * fb->stride;
+    
+        int img_y = y - y_offset;
+        int img_row_offset = img_y * img->width * img->bpp;
+
+        for (int x = job->x_start; x < job->x_end; x++) {
+            int img_x = x - x_offset;
+            
+            int fb_idx = fb_row_offset + (x * fb->bpp);
+            int img_idx = img_row_offset + (img_x * img->bpp);
+
+            for (int c = 0; c < img->bpp; c++) {
+                fb->buffer[fb_idx + c] = img->data[img_idx + img->bpp - 1 - c];
+            }
+        }
+    }
+}
+
+static void draw_band(void *arg, int band) {
+    trace_begin("blit", band);
+    draw_band_rows(arg, band);
+    trace_end("blit");
+}
+
+void framebuffer_draw_image(framebuffer *fb, int x_offset, int y_offset, Image *img) {
+    framebuffer_draw_image_clipped(fb, x_offset, y_offset, img, NULL);
+}
+
+// draws only the part of 'img' inside 'clip' (NULL for the whole screen)
+void framebuffer_draw_image_clipped(framebuffer *fb, int x_offset, int y_offset, Image *img,
+                                    const fb_rect *clip) {
+    if (fb == NULL || img == NULL) return;
+
+    int screen_x_start = (x_offset < 0) ? 0 : x_offset;
+    int screen_y_start = (y_offset < 0) ? 0 : y_offset;
+    int screen_x_end = (x_offset + img->width > fb->width) ? fb->width : x_offset + img->width;
+    int screen_y_end = (y_offset + img->height > fb->height) ? fb->height : y_offset + img->height;
+    if (clip != NULL) {
+        if (screen_x_start < clip->x0) screen_x_start = clip->x0;
+        if (screen_y_start < clip->y0) screen_y_start = clip->y0;
+        if (screen_x_end > clip->x1) screen_x_end = clip->x1;
+        if (screen_y_end > clip->y1) screen_y_end = clip->y1;
+    }
+
+    if (screen_x_start >= screen_x_end || screen_y_start >= screen_y_end) {
+        return;
+    }
+
+    int bpp = fb->bpp;
+    if (!((bpp == 1 || bpp == 2) && img->bpp >= 3) && bpp < 3) {
+        printf("Unsupported bits per pixel: %d\n", bpp * 8);
+        return;
+    }
+
+    task_pool *pool = task_pool_shared();
+    blit_job job = { .fb = fb, .img = img, .x_offset = x_offset, .y_offset = y_offset,
+                     .x_start = screen_x_start, .x_end = screen_x_end,
+                     .y_start = screen_y_start, .y_end = screen_y_end };
+    job.bands = task_bands(pool, screen_y_end - screen_y_start, BLIT_BAND_ROWS);
+    task_parallel_for(pool, TASK_INTERACTIVE, NULL, job.bands, draw_band, &job);
+}
+
+
+
+#ifndef ZFBV_NO_DRM
+
+// DRM/KMS output: two XRGB8888 dumb buffers, scanned out directly. Drawing
+// goes to the one that is not on screen ('buffer'), and framebuffer_update
+// flips to it on the next vblank and waits for the flip-complete event.
+struct drm_output {
+    uint32_t crtc_id;
+    uint32_t connector_id;
+    uint32_t fb_id[2];
+    uint32_t handle[2];
+    char *map[2];
+    uint64_t size;
+    int front; // index of the buffer being scanned out
+    int flip_pending; // the last flip timed out before its event arrived
+    struct drm_mode_crtc saved_crtc;
+};
+
+static int drm_create_buffer(framebuffer *fb, drm_output *drm, int i) {
+    struct drm_mode_create_dumb create = { 0 };
+    create.width = fb->width;
+    create.height = fb->height;
+    create.bpp = 32;
+    if (ioctl(fb->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) == -1) {
+        printf("Failed to create DRM dumb buffer\n");
+        return -1;
+    }
+    drm->handle[i] = create.handle;
+    drm->size = create.size;
+    fb->stride = create.pitch;
+
+    struct drm_mode_fb_cmd cmd = { 0 };
+    cmd.width = fb->width;
+    cmd.height = fb->height;
+    cmd.pitch = create.pitch;
+    cmd.bpp = 32;
+    cmd.depth = 24;
+    cmd.handle = create.handle;
+    if (ioctl(fb->fd, DRM_IOCTL_MODE_ADDFB, &cmd) == -1) {
+        printf("Failed to add DRM framebuffer\n");
+        return -1;
+    }
+    drm->fb_id[i] = cmd.fb_id;
+
+    struct drm_mode_map_dumb map = { 0 };
+    map.handle = create.handle;
+    if (ioctl(fb->fd, DRM_IOCTL_MODE_MAP_DUMB, &map) == -1) {
+        printf("Failed to prepare DRM dumb buffer mapping\n");
+        return -1;
+    }
+    drm->map[i] = mmap(0, create.size, PROT_READ | PROT_WRITE, MAP_SHARED, fb->fd, map.offset);
+    if (drm->map[i] == MAP_FAILED) {
+        drm->map[i] = NULL;
+        printf("Failed to map DRM dumb buffer\n");
+        return -1;
+    }
+    memset(drm->map[i], 0, create.size);
+    return 0;
+}
+
+// fetches connector 'id' with its modes and encoders into lists the caller
+// frees. A hotplug between the call that counts the lists and the one that
+// fills them can grow them, and then nothing is filled in, so that is retried.
+static int drm_get_connector(int fd, uint32_t id, struct drm_mode_get_connector *conn,
+                             struct drm_mode_modeinfo **modes, uint32_t **encoders) {
+    *modes = NULL;
+    *encoders = NULL;
+    for (int attempt = 0; attempt < 4; attempt++) {
+        memset(conn, 0, sizeof(*conn));
+        conn->connector_id = id;
+        if (ioctl(fd, DRM_IOCTL_MODE_GETCONNECTOR, conn) == -1) break;
+        uint32_t count_modes = conn->count_modes, count_encoders = conn->count_encoders;
+        *modes = calloc(count_modes + 1, sizeof(**modes));
+        *encoders = calloc(count_encoders + 1, sizeof(**encoders));
+        if (*modes == NULL || *encoders == NULL) break;
+        conn->count_props = 0;
+        conn->modes_ptr = (uintptr_t) *modes;
+        conn->encoders_ptr = (uintptr_t) *encoders;
+        if (ioctl(fd, DRM_IOCTL_MODE_GETCONNECTOR, conn) == -1) break;
+        if (conn->count_modes <= count_modes && conn->count_encoders <= count_encoders) return 0;
+        free(*modes);
+        free(*encoders);
+        *modes = NULL;
+        *encoders = NULL;
+    }
+    free(*modes);
+    free(*encoders);
+    *modes = NULL;
+    *encoders = NULL;
+    return -1;
+}
+
+// picks the first connected connector, its preferred mode and a CRTC for it
+static int drm_find_output(int fd, drm_output *drm, struct drm_mode_modeinfo *mode) {
+    struct drm_mode_card_res res = { 0 };
+    if (ioctl(fd, DRM_IOCTL_MODE_GETRESOURCES, &res) == -1) {
+        printf("Failed to get DRM resources\n");
+        return -1;
+    }
+    uint32_t *crtcs = calloc(res.count_crtcs + 1, sizeof(uint32_t));
+    uint32_t *connectors = calloc(res.count_connectors + 1, sizeof(uint32_t));
+    if (crtcs == NULL || connectors == NULL) {
+        free(crtcs);
+        free(connectors);
+        return -1;
+    }
+    res.count_fbs = 0;
+    res.count_encoders = 0;
+    res.crtc_id_ptr = (uintptr_t) crtcs;
+    res.connector_id_ptr = (uintptr_t) connectors;
+    if (ioctl(fd, DRM_IOCTL_MODE_GETRESOURCES, &res) == -1) {
+        printf("Failed to get DRM resources\n");
+        free(crtcs);
+        free(connectors);
+        return -1;
+    }
+
+    int found = -1;
+    for (uint32_t c = 0; c < res.count_connectors && found == -1; c++) {
+        struct drm_mode_get_connector conn;
+        struct drm_mode_modeinfo *modes = NULL;
+        uint32_t *encoders = NULL;
+        if (drm_get_connector(fd, connectors[c], &conn, &modes, &encoders) == -1) continue;
+        if (conn.connection == DRM_MODE_CONNECTED && conn.count_modes > 0) {
+            *mode = modes[0];
+            for (uint32_t m = 0; m < conn.count_modes; m++) {
+                if (modes[m].type & DRM_MODE_TYPE_PREFERRED) {
+                    *mode = modes[m];
+                    break;
+                }
+            }
+
+            // prefer the CRTC already driving this connector (through its
+            // current encoder), then any CRTC one of its encoders can use
+            for (int pass = 0; pass < 2 && found == -1; pass++) {
+                for (uint32_t e = 0; e < conn.count_encoders && found == -1; e++) {
+                    if (pass == 0 && (conn.encoder_id == 0 || encoders[e] != conn.encoder_id)) continue;
+                    struct drm_mode_get_encoder enc = { 0 };
+                    enc.encoder_id = encoders[e];
+                    if (ioctl(fd, DRM_IOCTL_MODE_GETENCODER, &enc) == -1) continue;
+                    for (uint32_t i = 0; i < res.count_crtcs; i++) {
+                        if ((pass == 0 && enc.crtc_id != 0) ? crtcs[i] == enc.crtc_id : (enc.possible_crtcs & (1u << i)) != 0) {
+                            drm->crtc_id = crtcs[i];
+                            drm->connector_id = conn.connector_id;
+                            found = 0;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+        free(modes);
+        free(encoders);
+    }
+
+    free(crtcs);
+    free(connectors);
+    if (found == -1) {
+        printf("No connected DRM output found\n");
+    }
+    return found;
+}
+
+framebuffer *framebuffer_create_drm(const char *device) {
+    framebuffer *fb = calloc(1, sizeof(framebuffer));
+    drm_output *drm = calloc(1, sizeof(drm_output));
+    if (fb == NULL || drm == NULL) {
+        printf("Failed to allocate framebuffer struct\n");
+        free(fb);
+        free(drm);
+        return NULL;
+    }
+    fb->drm = drm;
+
+    fb->fd = open(device, O_RDWR | O_CLOEXEC);
+    if (fb->fd == -1) {
+        printf("Failed to open DRM device\n");
+        free(drm);
+        free(fb);
+        return NULL;
+    }
+
+    struct drm_get_cap cap = { DRM_CAP_DUMB_BUFFER, 0 };
+    if (ioctl(fb->fd, DRM_IOCTL_GET_CAP, &cap) == -1 || !cap.value) {
+        printf("DRM device does not support dumb buffers\n");
+        framebuffer_destroy_drm(fb);
+        return NULL;
+    }
+
+    struct drm_mode_modeinfo mode;
+    if (drm_find_output(fb->fd, drm, &mode) == -1) {
+        framebuffer_destroy_drm(fb);
+        return NULL;
+    }
+    fb->width = mode.hdisplay;
+    fb->height = mode.vdisplay;
+    fb->bpp = 4;
+
+    if (drm_create_buffer(fb, drm, 0) == -1 || drm_create_buffer(fb, drm, 1) == -1) {
+        framebuffer_destroy_drm(fb);
+        return NULL;
+    }
+
+    // remember the current configuration so it can be restored on exit
+    drm->saved_crtc.crtc_id = drm->crtc_id;
+    ioctl(fb->fd, DRM_IOCTL_MODE_GETCRTC, &drm->saved_crtc);
+
+    struct drm_mode_crtc crtc = { 0 };
+    crtc.crtc_id = drm->crtc_id;
+    crtc.fb_id = drm->fb_id[0];
+    crtc.set_connectors_ptr = (uintptr_t) &drm->connector_id;
+    crtc.count_connectors = 1;
+    crtc.mode = mode;
+    crtc.mode_valid = 1;
+    if (ioctl(fb->fd, DRM_IOCTL_MODE_SETCRTC, &crtc) == -1) {
+        printf("Failed to set DRM mode\n");
+        drm->saved_crtc.crtc_id = 0; // nothing to restore
+        framebuffer_destroy_drm(fb);
+        return NULL;
+    }
+
+    drm->front = 0;
+    fb->fbp = drm->map[0];
+    fb->buffer = drm->map[1];
+    if (mode.clock > 0 && mode.htotal > 0 && mode.vtotal > 0) {
+        fb->refresh_seconds = (double) mode.htotal * mode.vtotal / (mode.clock * 1000.0);
+    }
+    printf("DRM output opened: %dx%d@%d, 32 bpp, page flipping\n", fb->width, fb->height, mode.vrefresh);
+    return fb;
+}
+
+void framebuffer_destroy_drm(framebuffer *fb) {
+    drm_output *drm = fb->drm;
+    if (drm->saved_crtc.crtc_id != 0) {
+        drm->saved_crtc.set_connectors_ptr = (uintptr_t) &drm->connector_id;
+        drm->saved_crtc.count_connectors = 1;
+        ioctl(fb->fd, DRM_IOCTL_MODE_SETCRTC, &drm->saved_crtc);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (drm->map[i] != NULL) {
+            munmap(drm->map[i], drm->size);
+        }
+        if (drm->fb_id[i] != 0) {
+            ioctl(fb->fd, DRM_IOCTL_MODE_RMFB, &drm->fb_id[i]);
+        }
+        if (drm->handle[i] != 0) {
+            struct drm_mode_destroy_dumb destroy = { drm->handle[i] };
+            ioctl(fb->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+        }
+    }
+    close(fb->fd);
+    free(drm);
+    free(fb);
+}
+
+// waits up to a second for the queued flip's completion event
+static int drm_wait_flip(framebuffer *fb) {
+    while (1) {
+        struct pollfd pfd = { fb->fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 1000) <= 0) {
+            printf("Timed out waiting for DRM page flip\n");
+            return 0;
+        }
+
+        char events[1024];
+        ssize_t len = read(fb->fd, events, sizeof(events));
+        int flipped = 0;
+        for (ssize_t i = 0; i + (ssize_t) sizeof(struct drm_event) <= len; ) {
+            struct drm_event *event = (struct drm_event *) (events + i);
+            if (event->length < sizeof(struct drm_event)) break; // malformed
+            if (event->type == DRM_EVENT_FLIP_COMPLETE) {
+                flipped = 1;
+            }
+            i += event->length;
+        }
+        if (flipped) return 1;
+    }
+}
+
+static void drm_flipped(framebuffer *fb, drm_output *drm) {
+    drm->front = !drm->front;
+    fb->fbp = drm->map[drm->front];
+    fb->buffer = drm->map[!drm->front];
+}
+
+// flips the back buffer onto the screen at the next vblank and waits for
+// the kernel to report that it is being scanned out
+void framebuffer_update_drm(framebuffer *fb) {
+    drm_output *drm = fb->drm;
+    fb->updates++;
+    fb->bytes_written = 0; // scanout reads the buffer we drew into
+
+    // a flip that timed out is still queued, and another would fail with
+    // EBUSY. Until it lands, frames keep being drawn into the buffer it
+    // shows, so once it does that buffer already holds this frame.
+    if (drm->flip_pending) {
+        if (drm_wait_flip(fb)) {
+            drm->flip_pending = 0;
+            drm_flipped(fb, drm);
+        }
+        return;
+    }
+
+    struct drm_mode_crtc_page_flip flip = { 0 };
+    flip.crtc_id = drm->crtc_id;
+    flip.fb_id = drm->fb_id[!drm->front];
+    flip.flags = DRM_MODE_PAGE_FLIP_EVENT;
+    if (ioctl(fb->fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip) == -1) {
+        printf("Failed to queue DRM page flip\n");
+        return;
+    }
+    if (!drm_wait_flip(fb)) {
+        drm->flip_pending = 1;
+        return;
+    }
+    drm_flipped(fb, drm);
+}
+
+#else
+
+framebuffer *framebuffer_create_drm(const char *device) {
+    printf("Cannot open %s: zfbv was built without DRM/KMS support\n", device);
+    return NULL;
+}
+
+void framebuffer_destroy_drm(framebuffer *fb) {
+    (void) fb;
+}
+
+void framebuffer_update_drm(framebuffer *fb) {
+    (void) fb;
+}
+
+#endif
+
+
+// ordered dither thresholds in 1/64 steps
+static const uint8_t bayer8[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+static const uint8_t bayer4[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+// fills the (r, g, b, 0) offsets added to 8 consecutive pixels starting at
+// screen position (x, y) before they are truncated to 5/6/5 bits; without
+// dithering every pixel gets half a step, which rounds to nearest
+void rgb565_dither_row(uint8_t *out, int dither, int x, int y) {
+    for (int i = 0; i < 8; i++) {
+        int t = 32;
+        if (dither == 8) {
+            t = bayer8[y & 7][(x + i) & 7];
+        }
+        else if (dither == 4) {
+            t = bayer4[y & 3][(x + i) & 3] * 4;
+        }
+        out[i * 4 + 0] = t >> 3;
+        out[i * 4 + 1] = t >> 4;
+        out[i * 4 + 2] = t >> 3;
+        out[i * 4 + 3] = 0;
+    }
+}
+
+// converts 'count' RGB(A) pixels to RGB565 with the offsets from rgb565_dither_row
+void rgb565_blit_row(uint16_t *dst, const uint8_t *src, int count, int src_bpp, const uint8_t *dither) {
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i d0 = _mm_loadu_si128((const __m128i *) dither);
+    __m128i d1 = _mm_loadu_si128((const __m128i *) (dither + 16));
+    __m128i mask_r = _mm_set1_epi32(0xF800);
+    __m128i mask_g = _mm_set1_epi32(0x07E0);
+    __m128i mask_b = _mm_set1_epi32(0x001F);
+
+    // pixels are fetched as 32-bit words, which reads one byte past each
+    // RGB pixel, so the last pixel of the row always goes to the scalar loop
+    for (; i + 8 < count; i += 8) {
+        uint32_t w[8];
+        for (int k = 0; k < 8; k++) {
+            memcpy(&w[k], src + (i + k) * src_bpp, 4);
+        }
+        __m128i a = _mm_set_epi32(w[3], w[2], w[1], w[0]);
+        __m128i b = _mm_set_epi32(w[7], w[6], w[5], w[4]);
+        a = _mm_adds_epu8(a, d0);
+        b = _mm_adds_epu8(b, d1);
+
+        a = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_slli_epi32(a, 8), mask_r),
+                                      _mm_and_si128(_mm_srli_epi32(a, 5), mask_g)),
+                         _mm_and_si128(_mm_srli_epi32(a, 19), mask_b));
+        b = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_slli_epi32(b, 8), mask_r),
+                                      _mm_and_si128(_mm_srli_epi32(b, 5), mask_g)),
+                         _mm_and_si128(_mm_srli_epi32(b, 19), mask_b));
+
+        // sign-extend so the signed 32->16 pack keeps all 16 bits
+        a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+        b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_packs_epi32(a, b));
+    }
+#endif
+
+    for (; i < count; i++) {
+        const uint8_t *p = src + i * src_bpp;
+        const uint8_t *d = dither + (i & 7) * 4;
+        int r = p[0] + d[0];
+        int g = p[1] + d[1];
+        int b = p[2] + d[2];
+        r = r > 255 ? 255 : r;
+        g = g > 255 ? 255 : g;
+        b = b > 255 ? 255 : b;
+        dst[i] = ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
+    }
+}
+
+// converts 'count' RGB(A) pixels to BT.601 luma
+void gray_blit_row(uint8_t *dst, const uint8_t *src, int count, int src_bpp) {
+    for (int i = 0; i < count; i++) {
+        const uint8_t *p = src + i * src_bpp;
+        dst[i] = (77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8;
+    }
+}
+
+// packs 'count' RGB(A) pixels into 32-bit words with each channel at 'shift'
+void rgb30_blit_row(uint32_t *dst, const uint8_t *src, int count, int src_bpp, const int shift[3]) {
+    int rs = shift[0], gs = shift[1], bs = shift[2];
+    for (int i = 0; i < count; i++) {
+        const uint8_t *p = src + i * src_bpp;
+        dst[i] = rgb30_channel(p[0]) << rs | rgb30_channel(p[1]) << gs | rgb30_channel(p[2]) << bs;
+    }
+}
+
+// rgb30_blit_row for 16-bit RGB pixels
+void rgb30_blit_row16(uint32_t *dst, const uint16_t *src, int count, const int shift[3]) {
+    int rs = shift[0], gs = shift[1], bs = shift[2];
+    for (int i = 0; i < count; i++) {
+        const uint16_t *p = src + i * 3;
+        dst[i] = rgb30_channel16(p[0]) << rs | rgb30_channel16(p[1]) << gs | rgb30_channel16(p[2]) << bs;
+    }
+}
+
+
+
+static Image *Image_load_traced(const char *filename);
+
+Image *Image_load(const char *filename) {
+    trace_begin("load", 0);
+    Image *img = Image_load_traced(filename);
+    trace_end("load");
+    return img;
+}
+
+static Image *Image_load_traced(const char *filename) {
+    Image *img = calloc(1, sizeof(Image));
+    if (img == NULL) {
+        printf("Failed to allocate Image struct\n");
+        return NULL;
+    }
+
+    // JPEGs stay as YCbCr planes when they can
+    int chroma_x = 0, chroma_y = 0;
+    img->data = stbi_load_jpeg_ycbcr(filename, &img->width, &img->height, &chroma_x, &chroma_y);
+    // no second try for files refused by the decode limits
+    const char *reason = stbi_failure_reason();
+    if (img->data == NULL && (reason == NULL || strcmp(reason, "over budget") != 0)) {
+        img->data = stbi_load(filename, &img->width, &img->height, NULL, 3);
+        reason = stbi_failure_reason();
+    }
+    if (img->data == NULL) {
+        printf("Failed to load image: %s (%s)\n", filename, reason != NULL ? reason : "unknown error");
+        free(img);
+        return NULL;
+    }
+    img->icc = stbi_icc_profile(&img->icc_len);
+    img->bpp = 3;
+    img->stride = img->width * img->bpp;
+    img->format = IMAGE_RGB;
+    if (chroma_x > 0) {
+        Image_set_planes(img, img->data, chroma_x, chroma_y);
+    }
+    return img;
+}
+
+// Image_load for displays with more than 8 bits per channel: 16-bit PNGs
+// and PSDs are kept at 16 bits as IMAGE_RGB16 instead of being truncated
+Image *Image_load_deep(const char *filename) {
+    if (!stbi_is_16_bit(filename)) {
+        return Image_load(filename);
+    }
+
+    Image *img = calloc(1, sizeof(Image));
+    if (img == NULL) {
+        printf("Failed to allocate Image struct\n");
+        return NULL;
+    }
+    trace_begin("load", 0);
+    img->data = (uint8_t *) stbi_load_16(filename, &img->width, &img->height, NULL, 3);
+    trace_end("load");
+    if (img->data == NULL) {
+        const char *reason = stbi_failure_reason();
+        printf("Failed to load image: %s (%s)\n", filename, reason != NULL ? reason : "unknown error");
+        free(img);
+        return NULL;
+    }
+    img->icc = stbi_icc_profile(&img->icc_len);
+    img->bpp = 6;
+    img->stride = img->width * img->bpp;
+    img->format = IMAGE_RGB16;
+    return img;
+}
+
+// makes 'img' a planar YCbCr image whose planes are packed in 'data'
+void Image_set_planes(Image *img, uint8_t *data, int chroma_x, int chroma_y) {
+    img->format = IMAGE_YCBCR;
+    img->data = data;
+    img->stride = 0;
+    img->chroma_x = chroma_x;
+    img->chroma_y = chroma_y;
+    img->plane_width[0] = img->width;
+    img->plane_height[0] = img->height;
+    img->plane_width[1] = img->plane_width[2] = (img->width + chroma_x - 1) / chroma_x;
+    img->plane_height[1] = img->plane_height[2] = (img->height + chroma_y - 1) / chroma_y;
+    img->planes[0] = data;
+    img->planes[1] = img->planes[0] + (size_t) img->plane_width[0] * img->plane_height[0];
+    img->planes[2] = img->planes[1] + (size_t) img->plane_width[1] * img->plane_height[1];
+}
+
+// JFIF YCbCr -> RGB in the fixed point stb_image uses
+#define YCC_FIXED(x) (((int) ((x) * 4096.0f + 0.5f)) << 8)
+
+static uint8_t ycc_clamp(int v) {
+    v >>= 20;
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// 'cb' and 'cr' centred on 0
+static inline void ycc_to_rgb(int luma, int cb, int cr, uint8_t *rgb) {
+    int y_fixed = (luma << 20) + (1 << 19);
+    rgb[0] = ycc_clamp(y_fixed + cr * YCC_FIXED(1.40200f));
+    rgb[1] = ycc_clamp(y_fixed + cr * -YCC_FIXED(0.71414f) + ((cb * -YCC_FIXED(0.34414f)) & 0xffff0000));
+    rgb[2] = ycc_clamp(y_fixed + cb * YCC_FIXED(1.77200f));
+}
+
+// converts columns x0..x0+count-1 of row 'y' of a planar image to RGB. Chroma
+// is interpolated linearly between sample centres, like stb_image's
+// upsampler; 'chroma' is scratch space for two chroma plane rows.
+void Image_ycbcr_row(const Image *img, int y, int x0, int count, uint8_t *rgb, uint8_t *chroma) {
+    int cx = img->chroma_x, cy = img->chroma_y;
+    int cw = img->plane_width[1], ch = img->plane_height[1];
+
+    // chroma position of a luma pixel in 1/256 sample units
+    int fy = ((2 * y + 1) * 128) / cy - 128;
+    int r0 = fy >> 8, wy = fy & 255;
+    int r1 = r0 + 1 < ch ? r0 + 1 : ch - 1;
+    r0 = r0 < 0 ? 0 : r0;
+
+    int c_lo = (((2 * x0 + 1) * 128) / cx - 128) >> 8;
+    int c_hi = ((((2 * (x0 + count - 1) + 1) * 128) / cx - 128) >> 8) + 1;
+    c_lo = c_lo < 0 ? 0 : c_lo;
+    c_hi = c_hi > cw - 1 ? cw - 1 : c_hi;
+
+    // blend the two chroma rows
+    uint8_t *cb_line = chroma, *cr_line = chroma + cw + 2;
+    const uint8_t *cb0 = img->planes[1] + (size_t) r0 * cw, *cb1 = img->planes[1] + (size_t) r1 * cw;
+    const uint8_t *cr0 = img->planes[2] + (size_t) r0 * cw, *cr1 = img->planes[2] + (size_t) r1 * cw;
+    for (int c = c_lo; c <= c_hi; c++) {
+        cb_line[c] = (cb0[c] * (256 - wy) + cb1[c] * wy + 128) >> 8;
+        cr_line[c] = (cr0[c] * (256 - wy) + cr1[c] * wy + 128) >> 8;
+    }
+
+    // luma pixel q * cx + phase sits at chroma position q * 256 + offset[phase]
+    int offset[4]; // JPEG sampling factors are at most 4
+    for (int phase = 0; phase < cx; phase++) {
+        offset[phase] = ((2 * phase + 1) * 128) / cx - 128;
+    }
+    int q = x0 / cx, phase = x0 % cx;
+
+    const uint8_t *luma = img->planes[0] + (size_t) y * img->plane_width[0] + x0;
+    for (int i = 0; i < count; i++) {
+        int fx = (q << 8) + offset[phase];
+        if (++phase == cx) {
+            phase = 0;
+            q++;
+        }
+        int i0 = fx >> 8, wx = fx & 255;
+        int i1 = i0 + 1 < cw ? i0 + 1 : cw - 1;
+        i0 = i0 < 0 ? 0 : i0;
+        int cb = ((cb_line[i0] * (256 - wx) + cb_line[i1] * wx + 128) >> 8) - 128;
+        int cr = ((cr_line[i0] * (256 - wx) + cr_line[i1] * wx + 128) >> 8) - 128;
+
+        ycc_to_rgb(luma[i], cb, cr, rgb + i * 3);
+    }
+}
+
+typedef struct decode_task {
+    task_group group;
+    stbi_task_func *fn;
+    void *arg;
+    task_priority priority;
+} decode_task;
+
+// the priority of the decode running on this thread: its subtasks are
+// submitted at it, so a prefetch's pipeline stays below the visible decode
+static _Thread_local task_priority decode_priority = TASK_VISIBLE;
+
+static void decode_task_run(void *arg, int index) {
+    decode_task *task = arg;
+    task_priority outer = decode_priority;
+    decode_priority = task->priority;
+    trace_begin("decode", index);
+    task->fn(task->arg, index);
+    trace_end("decode");
+    decode_priority = outer;
+}
+
+static void *decode_task_start(void *user, stbi_task_func *fn, void *arg, int index) {
+    decode_task *task = malloc(sizeof(decode_task));
+    if (task == NULL) {
+        trace_begin("decode", index);
+        fn(arg, index);
+        trace_end("decode");
+        return NULL;
+    }
+    task->fn = fn;
+    task->arg = arg;
+    task->priority = decode_priority;
+    task_group_init(&task->group);
+    task_submit(user, task->priority, NULL, &task->group, decode_task_run, task, index);
+    return task;
+}
+
+static void decode_task_finish(void *user, void *task) {
+    decode_task *t = task;
+    task_group_wait(user, &t->group);
+    task_group_destroy(&t->group);
+    free(t);
+}
+
+// run stb_image's decode tasks (pipelined JPEG) on 'pool'; NULL decodes on
+// the calling thread only
+void Image_decode_on(task_pool *pool) {
+    stbi_thread_pool hooks = { decode_task_start, decode_task_finish, task_pool_concurrency(pool), pool };
+    stbi_set_thread_pool(pool != NULL ? &hooks : NULL);
+}
+
+void Image_free(Image *img) {
+    if (img == NULL) return;
+    if (img->data != NULL) {
+        stbi_image_free(img->data);
+    }
+    stbi_image_free(img->icc);
+    free(img);
+}
+
+// colour management: images are mapped from their embedded ICC profile (sRGB
+// when they have none) to the panel's profile through a 33x33x33 LUT that is
+// built once per pair of profiles, cached on disk and interpolated
+// tetrahedrally by the blit. The LUT holds linear panel RGB, unclamped, and a
+// per-channel shaper table applies the panel's response after interpolating:
+// interpolating the encoded values instead is off by up to 17 levels where a
+// channel leaves the panel's gamut or is near black. Only matrix/TRC RGB
+// profiles (the usual camera, editing and display profiles) are understood;
+// others leave colours unmanaged.
+
+#define LUT_GRID 33
+#define LUT_ONE 16384 // linear 1.0 in the LUT; entries cover -2 to 2
+#define LUT_INVERSE_SAMPLES 4096
+
+typedef struct icc_curve {
+    int function;          // ICC parametric curve type 0-4, or -1 for a table
+    float params[7];       // g, a, b, c, d, e, f
+    int count;             // table entries, 0 for the identity
+    const uint8_t *table;  // big-endian 16-bit entries
+} icc_curve;
+
+typedef struct icc_rgb {
+    float to_xyz[3][3]; // linear RGB -> D50 XYZ, the colorants as columns
+    icc_curve trc[3];
+} icc_rgb;
+
+struct color_lut {
+    int16_t table[LUT_GRID * LUT_GRID * LUT_GRID * 4]; // linear RGB and a pad, blue fastest
+    uint8_t shaper[3][LUT_ONE + 1]; // linear -> panel encoding
+    uint16_t shaper16[3][LUT_ONE + 1]; // the same at 16 bits, for IMAGE_RGB16 images
+    uint8_t index[256]; // grid cell of each 8-bit input
+    uint16_t frac[256]; // position in the cell, 0-256
+};
+
+static uint32_t icc_be32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static float icc_s15fixed16(const uint8_t *p) {
+    return (int32_t) icc_be32(p) / 65536.0f;
+}
+
+// returns the data of tag 'sig', checking that it lies inside the profile
+static const uint8_t *icc_find_tag(const uint8_t *icc, int len, const char *sig, uint32_t *size) {
+    uint32_t tags = icc_be32(icc + 128);
+    if (tags > (uint32_t) (len - 132) / 12) return NULL;
+    for (uint32_t i = 0; i < tags; i++) {
+        const uint8_t *entry = icc + 132 + i * 12;
+        uint32_t offset = icc_be32(entry + 4);
+        *size = icc_be32(entry + 8);
+        if (memcmp(entry, sig, 4) == 0 && offset <= (uint32_t) len && *size <= (uint32_t) len - offset) {
+            return icc + offset;
+        }
+    }
+    return NULL;
+}
+
+static int icc_read_curve(const uint8_t *icc, int len, const char *sig, icc_curve *curve) {
+    static const int param_counts[5] = { 1, 3, 4, 5, 7 };
+    uint32_t size;
+    const uint8_t *tag = icc_find_tag(icc, len, sig, &size);
+    if (tag == NULL || size < 12) return 0;
+
+    memset(curve, 0, sizeof(*curve));
+    if (memcmp(tag, "curv", 4) == 0) {
+        uint32_t count = icc_be32(tag + 8);
+        if (count > (size - 12) / 2) return 0;
+        if (count == 1) {
+            curve->function = 0;
+            curve->params[0] = ((tag[12] << 8) | tag[13]) / 256.0f;
+        }
+        else {
+            curve->function = -1;
+            curve->count = count;
+            curve->table = tag + 12;
+        }
+        return 1;
+    }
+    if (memcmp(tag, "para", 4) == 0) {
+        int function = (tag[8] << 8) | tag[9];
+        if (function > 4 || size < 12 + 4 * (uint32_t) param_counts[function]) return 0;
+        curve->function = function;
+        for (int i = 0; i < param_counts[function]; i++) {
+            curve->params[i] = icc_s15fixed16(tag + 12 + i * 4);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static float icc_curve_eval(const icc_curve *c, float x) {
+    const float *p = c->params;
+    float v;
+    if (c->function < 0) {
+        if (c->count == 0) return x;
+        float pos = x * (c->count - 1);
+        int i = (int) pos;
+        if (i >= c->count - 1) i = c->count - 2;
+        float t = pos - i;
+        const uint8_t *e = c->table + i * 2;
+        return (((e[0] << 8) | e[1]) * (1 - t) + ((e[2] << 8) | e[3]) * t) / 65535.0f;
+    }
+    switch (c->function) {
+    case 0: v = powf(x, p[0]); break;
+    case 1: v = x >= -p[2] / p[1] ? powf(p[1] * x + p[2], p[0]) : 0; break;
+    case 2: v = x >= -p[2] / p[1] ? powf(p[1] * x + p[2], p[0]) + p[3] : p[3]; break;
+    case 3: v = x >= p[4] ? powf(p[1] * x + p[2], p[0]) : p[3] * x; break;
+    default: v = x >= p[4] ? powf(p[1] * x + p[2], p[0]) + p[5] : p[3] * x + p[6]; break;
+    }
+    return isfinite(v) ? v : 0; // nonsense parameters
+}
+
+// parses a matrix/TRC RGB profile; NULL is sRGB
+static int icc_parse_rgb(const uint8_t *icc, int len, icc_rgb *out) {
+    if (icc == NULL) {
+        static const float srgb[3][3] = {
+            { 0.4361f, 0.3851f, 0.1431f },
+            { 0.2225f, 0.7169f, 0.0606f },
+            { 0.0139f, 0.0971f, 0.7141f },
+        };
+        memcpy(out->to_xyz, srgb, sizeof(srgb));
+        for (int c = 0; c < 3; c++) {
+            icc_curve curve = { 3, { 2.4f, 1 / 1.055f, 0.055f / 1.055f, 1 / 12.92f, 0.04045f }, 0, NULL };
+            out->trc[c] = curve;
+        }
+        return 1;
+    }
+    if (len < 132 || icc_be32(icc) > (uint32_t) len ||
+        memcmp(icc + 16, "RGB ", 4) != 0 || memcmp(icc + 20, "XYZ ", 4) != 0) {
+        return 0;
+    }
+
+    static const char *colorants[3] = { "rXYZ", "gXYZ", "bXYZ" };
+    static const char *curves[3] = { "rTRC", "gTRC", "bTRC" };
+    for (int c = 0; c < 3; c++) {
+        uint32_t size;
+        const uint8_t *tag = icc_find_tag(icc, len, colorants[c], &size);
+        if (tag == NULL || size < 20 || memcmp(tag, "XYZ ", 4) != 0) return 0;
+        for (int k = 0; k < 3; k++) {
+            out->to_xyz[k][c] = icc_s15fixed16(tag + 8 + k * 4);
+        }
+        if (!icc_read_curve(icc, len, curves[c], &out->trc[c])) return 0;
+    }
+    return 1;
+}
+
+// 1 if converting from 'a' to 'b' would move no 8-bit value by half a level
+// or more: the same colorants within the precision profiles store them in,
+// and curves that agree to under half a step of 'b' at every input level.
+// Embedded sRGB profiles differ in the bytes but not in this.
+static int icc_rgb_same(const icc_rgb *a, const icc_rgb *b) {
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            if (fabsf(a->to_xyz[i][j] - b->to_xyz[i][j]) > 0.002f) return 0;
+        }
+    }
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 256; v++) {
+            float lo = icc_curve_eval(&b->trc[c], (v > 0 ? v - 1 : v) / 255.0f);
+            float hi = icc_curve_eval(&b->trc[c], (v < 255 ? v + 1 : v) / 255.0f);
+            float step = (hi - lo) / ((v > 0) + (v < 255));
+            float diff = fabsf(icc_curve_eval(&a->trc[c], v / 255.0f) - icc_curve_eval(&b->trc[c], v / 255.0f));
+            if (diff > 0.5f * step && diff > 1e-6f) return 0;
+        }
+    }
+    return 1;
+}
+
+static int mat3_invert(const float m[3][3], float inv[3][3]) {
+    float det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+              - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+              + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    if (fabsf(det) < 1e-6f) return 0;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            // cofactor of m[j][i]
+            int r0 = (j + 1) % 3, r1 = (j + 2) % 3, c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+            inv[i][j] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) / det;
+        }
+    }
+    return 1;
+}
+
+// encoded value whose linear value is 'y', from 'samples' taken at even steps
+// of the encoded value (made non-decreasing by the caller)
+static float curve_invert(const float *samples, float y) {
+    if (y <= samples[0]) return 0;
+    if (y >= samples[LUT_INVERSE_SAMPLES - 1]) return 1;
+    int lo = 0, hi = LUT_INVERSE_SAMPLES - 1;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (samples[mid] < y) lo = mid;
+        else hi = mid;
+    }
+    float span = samples[hi] - samples[lo];
+    float t = span > 0 ? (y - samples[lo]) / span : 0;
+    return (lo + t) / (LUT_INVERSE_SAMPLES - 1);
+}
+
+static int color_lut_build(color_lut *lut, const icc_rgb *src, const icc_rgb *dst) {
+    // linear source RGB -> linear panel RGB
+    float from_xyz[3][3], m[3][3];
+    if (!mat3_invert(dst->to_xyz, from_xyz)) return 0;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            m[i][j] = from_xyz[i][0] * src->to_xyz[0][j] + from_xyz[i][1] * src->to_xyz[1][j] +
+                      from_xyz[i][2] * src->to_xyz[2][j];
+        }
+    }
+
+    float linear[3][LUT_GRID];
+    for (int c = 0; c < 3; c++) {
+        for (int i = 0; i < LUT_GRID; i++) {
+            linear[c][i] = icc_curve_eval(&src->trc[c], (float) i / (LUT_GRID - 1));
+        }
+    }
+    float *samples = malloc(3 * LUT_INVERSE_SAMPLES * sizeof(float));
+    if (samples == NULL) return 0;
+    for (int c = 0; c < 3; c++) {
+        float *s = samples + c * LUT_INVERSE_SAMPLES;
+        for (int i = 0; i < LUT_INVERSE_SAMPLES; i++) {
+            s[i] = icc_curve_eval(&dst->trc[c], (float) i / (LUT_INVERSE_SAMPLES - 1));
+            if (i > 0 && s[i] < s[i - 1]) s[i] = s[i - 1];
+        }
+    }
+
+    int16_t *out = lut->table;
+    for (int r = 0; r < LUT_GRID; r++) {
+        for (int g = 0; g < LUT_GRID; g++) {
+            for (int b = 0; b < LUT_GRID; b++) {
+                for (int c = 0; c < 3; c++) {
+                    float v = m[c][0] * linear[0][r] + m[c][1] * linear[1][g] + m[c][2] * linear[2][b];
+                    v = v * LUT_ONE + (v < 0 ? -0.5f : 0.5f);
+                    out[c] = v < -32768 ? -32768 : v > 32767 ? 32767 : (int16_t) v;
+                }
+                out[3] = 0;
+                out += 4;
+            }
+        }
+    }
+    for (int c = 0; c < 3; c++) {
+        for (int i = 0; i <= LUT_ONE; i++) {
+            float v = curve_invert(samples + c * LUT_INVERSE_SAMPLES, (float) i / LUT_ONE);
+            lut->shaper[c][i] = (uint8_t) (v * 255 + 0.5f);
+            lut->shaper16[c][i] = (uint16_t) (v * 65535 + 0.5f);
+        }
+    }
+    free(samples);
+    return 1;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// $XDG_CACHE_HOME/zfbv/<key>.lut, or ~/.cache/zfbv/; creates the directories
+static int color_lut_cache_path(char *path, size_t size, uint64_t key) {
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char dir[4096];
+    if (cache != NULL && cache[0] != '\0') {
+        mkdir(cache, 0755);
+        snprintf(dir, sizeof(dir), "%s/zfbv", cache);
+    }
+    else if (home != NULL && home[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+        mkdir(dir, 0755);
+        snprintf(dir, sizeof(dir), "%s/.cache/zfbv", home);
+    }
+    else {
+        return 0;
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return 0;
+    }
+    return snprintf(path, size, "%s/%016llx.lut", dir, (unsigned long long) key) < (int) size;
+}
+
+static const char lut_magic[8] = "zfbvLUT3";
+
+static int color_lut_cache_read(color_lut *lut, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return 0;
+    char magic[8];
+    int ok = fread(magic, 1, 8, f) == 8 && memcmp(magic, lut_magic, 8) == 0 &&
+             fread(lut->table, 1, sizeof(lut->table), f) == sizeof(lut->table) &&
+             fread(lut->shaper, 1, sizeof(lut->shaper), f) == sizeof(lut->shaper) &&
+             fread(lut->shaper16, 1, sizeof(lut->shaper16), f) == sizeof(lut->shaper16);
+    fclose(f);
+    return ok;
+}
+
+// written to a temporary name and renamed, so readers never see half a LUT
+static void color_lut_cache_write(const color_lut *lut, const char *path) {
+    char tmp[4200];
+    // prefetches may build the same LUT on two threads at once
+    snprintf(tmp, sizeof(tmp), "%s.%d.%lx", path, (int) getpid(), (unsigned long) pthread_self());
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) return;
+    int ok = fwrite(lut_magic, 1, 8, f) == 8 && fwrite(lut->table, 1, sizeof(lut->table), f) == sizeof(lut->table) &&
+             fwrite(lut->shaper, 1, sizeof(lut->shaper), f) == sizeof(lut->shaper) &&
+             fwrite(lut->shaper16, 1, sizeof(lut->shaper16), f) == sizeof(lut->shaper16);
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+    }
+}
+
+uint8_t *icc_load_file(const char *filename, int *len) {
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        printf("Failed to open ICC profile: %s\n", filename);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *icc = size > 0 && size < (1 << 24) ? malloc(size) : NULL;
+    if (icc == NULL || fread(icc, 1, size, f) != (size_t) size) {
+        printf("Failed to read ICC profile: %s\n", filename);
+        free(icc);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    *len = (int) size;
+    return icc;
+}
+
+// transform from 'src_icc' to 'dst_icc' (either NULL for sRGB); NULL when the
+// two are the same or a profile is not supported
+color_lut *color_lut_create(const uint8_t *src_icc, int src_len, const uint8_t *dst_icc, int dst_len) {
+    if (src_icc == NULL && dst_icc == NULL) return NULL;
+    if (src_icc != NULL && dst_icc != NULL && src_len == dst_len && memcmp(src_icc, dst_icc, src_len) == 0) {
+        return NULL;
+    }
+
+    icc_rgb src, dst;
+    if (!icc_parse_rgb(src_icc, src_len, &src)) {
+        printf("Unsupported image ICC profile, colours are not managed\n");
+        return NULL;
+    }
+    if (!icc_parse_rgb(dst_icc, dst_len, &dst)) {
+        printf("Unsupported panel ICC profile, colours are not managed\n");
+        return NULL;
+    }
+    if (icc_rgb_same(&src, &dst)) {
+        return NULL; // the LUT would change nothing, and only slow the blit down
+    }
+
+    color_lut *lut = malloc(sizeof(color_lut));
+    if (lut == NULL) {
+        printf("Failed to allocate colour LUT\n");
+        return NULL;
+    }
+    for (int i = 0; i < 256; i++) {
+        int pos = (i * (LUT_GRID - 1) * 256 + 127) / 255;
+        lut->index[i] = pos >> 8;
+        lut->frac[i] = pos & 255;
+        if (lut->index[i] == LUT_GRID - 1) {
+            lut->index[i] = LUT_GRID - 2;
+            lut->frac[i] = 256;
+        }
+    }
+
+    uint64_t key = fnv1a(0xcbf29ce484222325ULL, lut_magic, sizeof(lut_magic));
+    key = fnv1a(key, &src_len, sizeof(src_len));
+    key = fnv1a(key, src_icc != NULL ? src_icc : (const uint8_t *) "", src_icc != NULL ? src_len : 0);
+    key = fnv1a(key, &dst_len, sizeof(dst_len));
+    key = fnv1a(key, dst_icc != NULL ? dst_icc : (const uint8_t *) "", dst_icc != NULL ? dst_len : 0);
+
+    char path[4096];
+    int cached = color_lut_cache_path(path, sizeof(path), key);
+    if (cached && color_lut_cache_read(lut, path)) {
+        return lut;
+    }
+    if (!color_lut_build(lut, &src, &dst)) {
+        printf("Failed to build colour LUT\n");
+        free(lut);
+        return NULL;
+    }
+    if (cached) {
+        color_lut_cache_write(lut, path);
+    }
+    return lut;
+}
+
+void color_lut_free(color_lut *lut) {
+    free(lut);
+}
+
+// picks the tetrahedron of a grid cell from the position in it (0 to 'one'
+// per channel): the offsets of the two corners between the cell's black and
+// white corners, and the weights of the four corners (summing to 'one')
+static inline void color_lut_weights(int fr, int fg, int fb, int one, int *o1, int *o2, int w[4]) {
+    const int sr = LUT_GRID * LUT_GRID * 4, sg = LUT_GRID * 4, sb = 4;
+    int f1, f2, f3;
+    if (fr >= fg) {
+        if (fg >= fb)      { *o1 = sr; *o2 = sr + sg; f1 = fr; f2 = fg; f3 = fb; }
+        else if (fr >= fb) { *o1 = sr; *o2 = sr + sb; f1 = fr; f2 = fb; f3 = fg; }
+        else               { *o1 = sb; *o2 = sb + sr; f1 = fb; f2 = fr; f3 = fg; }
+    }
+    else {
+        if (fr >= fb)      { *o1 = sg; *o2 = sg + sr; f1 = fg; f2 = fr; f3 = fb; }
+        else if (fg >= fb) { *o1 = sg; *o2 = sg + sb; f1 = fg; f2 = fb; f3 = fr; }
+        else               { *o1 = sb; *o2 = sb + sg; f1 = fb; f2 = fg; f3 = fr; }
+    }
+    w[0] = one - f1;
+    w[1] = f1 - f2;
+    w[2] = f2 - f3;
+    w[3] = f3;
+}
+
+// color_lut_weights for 8-bit pixel 'p'; returns the offset of its cell
+static inline int color_lut_tetrahedron(const color_lut *lut, const uint8_t *p, int *o1, int *o2, int w[4]) {
+    const int sr = LUT_GRID * LUT_GRID * 4, sg = LUT_GRID * 4, sb = 4;
+    color_lut_weights(lut->frac[p[0]], lut->frac[p[1]], lut->frac[p[2]], 256, o1, o2, w);
+    return lut->index[p[0]] * sr + lut->index[p[1]] * sg + lut->index[p[2]] * sb;
+}
+
+static inline int color_lut_clamp(int v) {
+    return v < 0 ? 0 : v > LUT_ONE ? LUT_ONE : v;
+}
+
+#ifdef __SSE2__
+// the interpolated linear RGB of one pixel as four 32-bit lanes: corners are
+// paired with their weights and summed by pmaddwd
+static inline __m128i color_lut_tetra_sse2(const int16_t *cell, int o1, int o2, const int w[4]) {
+    const int white = (LUT_GRID * LUT_GRID + LUT_GRID + 1) * 4;
+    __m128i c0 = _mm_loadl_epi64((const __m128i *) cell);
+    __m128i c1 = _mm_loadl_epi64((const __m128i *) (cell + o1));
+    __m128i c2 = _mm_loadl_epi64((const __m128i *) (cell + o2));
+    __m128i c3 = _mm_loadl_epi64((const __m128i *) (cell + white));
+    __m128i w01 = _mm_set1_epi32(w[0] | (w[1] << 16));
+    __m128i w23 = _mm_set1_epi32(w[2] | (w[3] << 16));
+    __m128i sum = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(c0, c1), w01),
+                                _mm_madd_epi16(_mm_unpacklo_epi16(c2, c3), w23));
+    return _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(128)), 8);
+}
+#endif
+
+// maps 'count' pixels of 'src' (RGB or RGBA) to packed RGB in 'dst', which may be 'src'
+void color_lut_apply_row(const color_lut *lut, uint8_t *dst, const uint8_t *src, int count, int src_bpp) {
+    const int white = (LUT_GRID * LUT_GRID + LUT_GRID + 1) * 4;
+    int o1, o2, w[4];
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i one = _mm_set1_epi16(LUT_ONE);
+    for (; i + 2 <= count; i += 2) {
+        const uint8_t *p = src + i * src_bpp;
+        int cell = color_lut_tetrahedron(lut, p, &o1, &o2, w);
+        __m128i a = color_lut_tetra_sse2(lut->table + cell, o1, o2, w);
+        cell = color_lut_tetrahedron(lut, p + src_bpp, &o1, &o2, w);
+        __m128i b = color_lut_tetra_sse2(lut->table + cell, o1, o2, w);
+
+        // saturate to 16 bits, clamp to 0..LUT_ONE, then look up the shaper
+        __m128i v = _mm_min_epi16(_mm_max_epi16(_mm_packs_epi32(a, b), zero), one);
+        uint16_t linear[8];
+        _mm_storeu_si128((__m128i *) linear, v);
+        uint8_t *d = dst + i * 3;
+        d[0] = lut->shaper[0][linear[0]];
+        d[1] = lut->shaper[1][linear[1]];
+        d[2] = lut->shaper[2][linear[2]];
+        d[3] = lut->shaper[0][linear[4]];
+        d[4] = lut->shaper[1][linear[5]];
+        d[5] = lut->shaper[2][linear[6]];
+    }
+#endif
+
+    for (; i < count; i++) {
+        int cell = color_lut_tetrahedron(lut, src + i * src_bpp, &o1, &o2, w);
+        const int16_t *c = lut->table + cell;
+        for (int k = 0; k < 3; k++) {
+            int v = (w[0] * c[k] + w[1] * c[o1 + k] + w[2] * c[o2 + k] + w[3] * c[white + k] + 128) >> 8;
+            dst[i * 3 + k] = lut->shaper[k][color_lut_clamp(v)];
+        }
+    }
+}
+
+// color_lut_apply_row for 16-bit RGB pixels, to 16-bit RGB: the position in
+// the grid cell keeps 12 bits and the shaper 16, so deep images are not cut
+// to 8 bits by their colour transform
+void color_lut_apply_row16(const color_lut *lut, uint16_t *dst, const uint16_t *src, int count) {
+    const int sr = LUT_GRID * LUT_GRID * 4, sg = LUT_GRID * 4, sb = 4;
+    const int white = (LUT_GRID * LUT_GRID + LUT_GRID + 1) * 4;
+    int o1, o2, w[4], index[3], frac[3];
+    for (int i = 0; i < count; i++) {
+        for (int k = 0; k < 3; k++) {
+            int pos = (int) (((int64_t) src[i * 3 + k] * ((LUT_GRID - 1) << 12) + 32767) / 65535);
+            index[k] = pos >> 12;
+            frac[k] = pos & 4095;
+            if (index[k] == LUT_GRID - 1) {
+                index[k] = LUT_GRID - 2;
+                frac[k] = 4096;
+            }
+        }
+        color_lut_weights(frac[0], frac[1], frac[2], 4096, &o1, &o2, w);
+        const int16_t *c = lut->table + index[0] * sr + index[1] * sg + index[2] * sb;
+        for (int k = 0; k < 3; k++) {
+            int v = (w[0] * c[k] + w[1] * c[o1 + k] + w[2] * c[o2 + k] + w[3] * c[white + k] + 2048) >> 12;
+            dst[i * 3 + k] = lut->shaper16[k][color_lut_clamp(v)];
+        }
+    }
+}
+
+// 8 bpp colour output. Each image gets its own palette: a histogram of
+// RGB555 cells is taken from a subsample of its pixels (after its colour
+// transform), and median cut splits the cells into up to 255 boxes whose
+// mean colours become the entries; entry 0 stays black for the background.
+// An inverse colour LUT then maps every RGB555 cell to its nearest entry, so
+// the blit is one table lookup per pixel.
+
+#define PALETTE_SAMPLES 262144 // at most this many pixels go into the histogram
+#define PALETTE_CELLS 32768
+
+struct palette {
+    uint8_t rgb[256][3];
+    int colors;
+    int spread;  // ordered dither amplitude: mean distance from an entry to its nearest neighbour
+    unsigned id; // tells palettes apart for framebuffer_show_palette, even at the same address
+    uint8_t index[PALETTE_CELLS]; // RGB555 -> nearest entry
+};
+
+static atomic_uint palette_ids;
+
+static inline int palette_cell(int r, int g, int b) {
+    return (r >> 3) << 10 | (g >> 3) << 5 | (b >> 3);
+}
+
+// channel 'c' (0 red, 1 green, 2 blue) of a cell, as the 8-bit value at its centre
+static inline int palette_cell_value(int cell, int c) {
+    return ((cell >> (10 - 5 * c)) & 31) << 3 | 4;
+}
+
+// fills the inverse LUT and the dither spread, and gives the palette its
+// id; 0 if out of memory. Entries are swept over every cell in turn, keeping
+// each cell's nearest so far: the squared distance is a sum of per-axis
+// tables, so the inner loop over blue needs no multiplies.
+static int palette_finish(palette *pal) {
+    int *nearest = malloc(2 * PALETTE_CELLS * sizeof(int)); // distance and entry of each cell
+    if (nearest == NULL) {
+        printf("Failed to allocate palette\n");
+        return 0;
+    }
+    int *nearest_entry = nearest + PALETTE_CELLS;
+    for (int cell = 0; cell < PALETTE_CELLS; cell++) {
+        nearest[cell] = INT_MAX;
+        nearest_entry[cell] = 0;
+    }
+    for (int i = 0; i < pal->colors; i++) {
+        int d2[3][32];
+        for (int c = 0; c < 3; c++) {
+            for (int v = 0; v < 32; v++) {
+                int d = (v << 3 | 4) - pal->rgb[i][c];
+                d2[c][v] = d * d;
+            }
+        }
+        for (int rg = 0; rg < 1024; rg++) {
+            int base = d2[0][rg >> 5] + d2[1][rg & 31];
+            int *dist = nearest + rg * 32;
+            int *entry = nearest_entry + rg * 32;
+            int b = 0;
+#ifdef __SSE2__
+            __m128i vbase = _mm_set1_epi32(base);
+            __m128i vi = _mm_set1_epi32(i);
+            for (; b < 32; b += 4) {
+                __m128i d = _mm_add_epi32(vbase, _mm_loadu_si128((const __m128i *) (d2[2] + b)));
+                __m128i old = _mm_loadu_si128((const __m128i *) (dist + b));
+                __m128i closer = _mm_cmplt_epi32(d, old);
+                __m128i e = _mm_loadu_si128((const __m128i *) (entry + b));
+                _mm_storeu_si128((__m128i *) (dist + b),
+                                 _mm_or_si128(_mm_and_si128(closer, d), _mm_andnot_si128(closer, old)));
+                _mm_storeu_si128((__m128i *) (entry + b),
+                                 _mm_or_si128(_mm_and_si128(closer, vi), _mm_andnot_si128(closer, e)));
+            }
+#endif
+            for (; b < 32; b++) {
+                int d = base + d2[2][b];
+                if (d < dist[b]) {
+                    dist[b] = d;
+                    entry[b] = i;
+                }
+            }
+        }
+    }
+    for (int cell = 0; cell < PALETTE_CELLS; cell++) {
+        pal->index[cell] = nearest_entry[cell];
+    }
+    free(nearest);
+
+    double sum = 0.0;
+    for (int i = 0; i < pal->colors; i++) {
+        int nearest = INT_MAX;
+        for (int j = 0; j < pal->colors; j++) {
+            int dr = pal->rgb[i][0] - pal->rgb[j][0], dg = pal->rgb[i][1] - pal->rgb[j][1];
+            int db = pal->rgb[i][2] - pal->rgb[j][2];
+            int d = dr * dr + dg * dg + db * db;
+            if (j != i && d < nearest) nearest = d;
+        }
+        sum += pal->colors > 1 ? sqrt(nearest) : 0.0;
+    }
+    pal->spread = (int) (sum / pal->colors + 0.5);
+    pal->id = atomic_fetch_add(&palette_ids, 1) + 1;
+    return 1;
+}
+
+static palette uniform_palette;
+static pthread_once_t uniform_palette_once = PTHREAD_ONCE_INIT;
+
+static void palette_init_uniform(void) {
+    int n = 0;
+    for (int r = 0; r < 6; r++) {
+        for (int g = 0; g < 6; g++) {
+            for (int b = 0; b < 6; b++) {
+                uniform_palette.rgb[n][0] = r * 51;
+                uniform_palette.rgb[n][1] = g * 51;
+                uniform_palette.rgb[n][2] = b * 51;
+                n++;
+            }
+        }
+    }
+    uniform_palette.colors = n;
+    palette_finish(&uniform_palette);
+}
+
+// a 6x6x6 colour cube, for 8 bpp colour displays before an image has its own palette
+const palette *palette_uniform(void) {
+    pthread_once(&uniform_palette_once, palette_init_uniform);
+    return &uniform_palette;
+}
+
+static palette gray_palette;
+static pthread_once_t gray_palette_once = PTHREAD_ONCE_INIT;
+
+static void palette_init_gray(void) {
+    for (int i = 0; i < 256; i++) {
+        gray_palette.rgb[i][0] = gray_palette.rgb[i][1] = gray_palette.rgb[i][2] = i;
+    }
+    gray_palette.colors = 256;
+    gray_palette.id = atomic_fetch_add(&palette_ids, 1) + 1;
+}
+
+// a grey ramp for the colormap of 8 bpp greyscale displays; only its
+// entries are set, greyscale pixels are not looked up
+const palette *palette_gray(void) {
+    pthread_once(&gray_palette_once, palette_init_gray);
+    return &gray_palette;
+}
+
+typedef struct palette_box {
+    int lo, hi; // its cells, a range of the cell array
+    long count; // pixels in them
+    int min[3], max[3];
+} palette_box;
+
+typedef struct palette_cell_count {
+    uint16_t cell;
+    uint32_t count;
+} palette_cell_count;
+
+static void palette_box_shrink(palette_box *box, const palette_cell_count *cells) {
+    box->count = 0;
+    for (int c = 0; c < 3; c++) {
+        box->min[c] = 255;
+        box->max[c] = 0;
+    }
+    for (int i = box->lo; i < box->hi; i++) {
+        box->count += cells[i].count;
+        for (int c = 0; c < 3; c++) {
+            int v = palette_cell_value(cells[i].cell, c);
+            box->min[c] = v < box->min[c] ? v : box->min[c];
+            box->max[c] = v > box->max[c] ? v : box->max[c];
+        }
+    }
+}
+
+static int palette_box_axis(const palette_box *box) {
+    int axis = 0;
+    for (int c = 1; c < 3; c++) {
+        if (box->max[c] - box->min[c] > box->max[axis] - box->min[axis]) axis = c;
+    }
+    return axis;
+}
+
+// sorts the box's cells along 'axis' (a counting sort: there are 32
+// values) and splits it where half its pixels are on either side
+static void palette_box_split(palette_box *box, palette_box *upper, palette_cell_count *cells,
+                              palette_cell_count *scratch, int axis) {
+    int start[33] = { 0 };
+    long pixels[32] = { 0 };
+    for (int i = box->lo; i < box->hi; i++) {
+        int v = palette_cell_value(cells[i].cell, axis) >> 3;
+        start[v + 1]++;
+        pixels[v] += cells[i].count;
+    }
+    for (int v = 0; v < 32; v++) {
+        start[v + 1] += start[v];
+    }
+    int next[32];
+    memcpy(next, start, sizeof(next));
+    for (int i = box->lo; i < box->hi; i++) {
+        scratch[next[palette_cell_value(cells[i].cell, axis) >> 3]++] = cells[i];
+    }
+    memcpy(cells + box->lo, scratch, (box->hi - box->lo) * sizeof(palette_cell_count));
+
+    // the lower box gets values up to 'v', which leaves the upper one at
+    // least the largest value
+    int lo = box->min[axis] >> 3, hi = box->max[axis] >> 3;
+    int v = lo;
+    long below = pixels[lo];
+    while (v + 1 < hi && below * 2 < box->count) {
+        below += pixels[++v];
+    }
+    upper->lo = box->lo + start[v + 1];
+    upper->hi = box->hi;
+    box->hi = upper->lo;
+    palette_box_shrink(box, cells);
+    palette_box_shrink(upper, cells);
+}
+
+// the RGB pixels of row 'y' at every 'step'th column, colour transformed;
+// returns how many. Planar images take the nearest chroma sample, which is
+// close enough for a histogram.
+static int palette_sample_row(const Image *img, const color_lut *lut, int y, int step, uint8_t *out) {
+    int n = 0;
+    int x0 = step / 2;
+    if (img->format == IMAGE_YCBCR) {
+        const uint8_t *luma = img->planes[0] + (size_t) y * img->plane_width[0];
+        size_t chroma_row = (size_t) (y / img->chroma_y) * img->plane_width[1];
+        const uint8_t *cb = img->planes[1] + chroma_row, *cr = img->planes[2] + chroma_row;
+        for (int x = x0; x < img->width; x += step, n++) {
+            int c = x / img->chroma_x;
+            ycc_to_rgb(luma[x], cb[c] - 128, cr[c] - 128, out + n * 3);
+        }
+    }
+    else if (img->format == IMAGE_RGB16) {
+        const uint16_t *row = (const uint16_t *) (img->data + (size_t) y * img->stride);
+        for (int x = x0; x < img->width; x += step, n++) {
+            for (int c = 0; c < 3; c++) {
+                out[n * 3 + c] = row[x * 3 + c] >> 8;
+            }
+        }
+    }
+    else {
+        const uint8_t *row = img->data + (size_t) y * img->stride;
+        for (int x = x0; x < img->width; x += step, n++) {
+            memcpy(out + n * 3, row + x * img->bpp, 3);
+        }
+    }
+    if (lut != NULL) {
+        color_lut_apply_row(lut, out, out, n, 3);
+    }
+    return n;
+}
+
+// the palette for showing 'img' (with 'lut', if not NULL) on an 8 bpp
+// colour display; NULL on failure
+palette *palette_create(const Image *img, const color_lut *lut) {
+    if (img->bpp < 3 && img->format != IMAGE_YCBCR) return NULL;
+    double pixels = (double) img->width * img->height;
+    int step = pixels > PALETTE_SAMPLES ? (int) ceil(sqrt(pixels / PALETTE_SAMPLES)) : 1;
+
+    palette *pal = calloc(1, sizeof(palette));
+    uint32_t *hist = calloc(PALETTE_CELLS, sizeof(uint32_t));
+    palette_cell_count *cells = malloc(2 * PALETTE_CELLS * sizeof(palette_cell_count));
+    uint8_t *samples = malloc((size_t) img->width * 3);
+    if (pal == NULL || hist == NULL || cells == NULL || samples == NULL) {
+        printf("Failed to allocate palette\n");
+        free(pal);
+        free(hist);
+        free(cells);
+        free(samples);
+        return NULL;
+    }
+
+    for (int y = step / 2; y < img->height; y += step) {
+        int n = palette_sample_row(img, lut, y, step, samples);
+        for (int i = 0; i < n; i++) {
+            hist[palette_cell(samples[i * 3], samples[i * 3 + 1], samples[i * 3 + 2])]++;
+        }
+    }
+    int used = 0;
+    for (int cell = 0; cell < PALETTE_CELLS; cell++) {
+        if (hist[cell] > 0) {
+            cells[used++] = (palette_cell_count) { cell, hist[cell] };
+        }
+    }
+
+    // median cut: keep splitting the box with the most pixels times extent
+    palette_box boxes[255];
+    int count = 0;
+    if (used > 0) {
+        boxes[0] = (palette_box) { 0, used };
+        palette_box_shrink(&boxes[0], cells);
+        count = 1;
+    }
+    while (count < 255) {
+        int best = -1;
+        double best_score = 0.0;
+        for (int i = 0; i < count; i++) {
+            int axis = palette_box_axis(&boxes[i]);
+            double score = (double) boxes[i].count * (boxes[i].max[axis] - boxes[i].min[axis]);
+            if (score > best_score) {
+                best_score = score;
+                best = i;
+            }
+        }
+        if (best < 0) break; // every box is down to one cell
+        palette_box_split(&boxes[best], &boxes[count], cells, cells + PALETTE_CELLS,
+                          palette_box_axis(&boxes[best]));
+        count++;
+    }
+
+    pal->colors = count + 1;
+    for (int i = 0; i < count; i++) {
+        double sum[3] = { 0.0, 0.0, 0.0 };
+        for (int k = boxes[i].lo; k < boxes[i].hi; k++) {
+            for (int c = 0; c < 3; c++) {
+                sum[c] += (double) cells[k].count * palette_cell_value(cells[k].cell, c);
+            }
+        }
+        for (int c = 0; c < 3; c++) {
+            pal->rgb[i + 1][c] = (uint8_t) (sum[c] / boxes[i].count + 0.5);
+        }
+    }
+    free(hist);
+    free(cells);
+    free(samples);
+    if (!palette_finish(pal)) {
+        free(pal);
+        return NULL;
+    }
+    return pal;
+}
+
+void palette_free(palette *pal) {
+    free(pal);
+}
+
+uint8_t palette_lookup(const palette *pal, int r, int g, int b) {
+    return pal->index[palette_cell(r, g, b)];
+}
+
+// fills the offsets added to all three channels of 8 consecutive pixels
+// starting at screen position (x, y) before they are looked up: up to half
+// the palette's spread either way, or none without dithering
+void palette_dither_row(int8_t *out, int dither, const palette *pal, int x, int y) {
+    for (int i = 0; i < 8; i++) {
+        int t = 32;
+        if (dither == 8) {
+            t = bayer8[y & 7][(x + i) & 7];
+        }
+        else if (dither == 4) {
+            t = bayer4[y & 3][(x + i) & 3] * 4 + 2;
+        }
+        int offset = (t - 32) * pal->spread / 64;
+        out[i] = offset < -127 ? -127 : offset > 127 ? 127 : offset;
+    }
+}
+
+// maps 'count' RGB(A) pixels to palette entries with the offsets from palette_dither_row
+void palette_blit_row(uint8_t *dst, const uint8_t *src, int count, int src_bpp, const palette *pal,
+                      const int8_t *dither) {
+    for (int i = 0; i < count; i++) {
+        const uint8_t *p = src + i * src_bpp;
+        int d = dither[i & 7];
+        int r = p[0] + d, g = p[1] + d, b = p[2] + d;
+        r = r < 0 ? 0 : r > 255 ? 255 : r;
+        g = g < 0 ? 0 : g > 255 ? 255 : g;
+        b = b < 0 ? 0 : b > 255 ? 255 : b;
+        dst[i] = pal->index[palette_cell(r, g, b)];
+    }
+}
+
+// keeps the console's colormap, so framebuffer_restore_cmap can put it back
+// over the images' palettes; without it (the driver cannot read it back) the
+// last palette stays
+void framebuffer_save_cmap(framebuffer *fb) {
+    uint16_t *saved = malloc(3 * 256 * sizeof(uint16_t));
+    if (saved == NULL) return;
+    struct fb_cmap cmap = { .start = 0, .len = 256, .red = saved, .green = saved + 256, .blue = saved + 512 };
+    if (ioctl(fb->fd, FBIOGETCMAP, &cmap) == -1) {
+        free(saved);
+        return;
+    }
+    fb->saved_cmap = saved;
+}
+
+void framebuffer_restore_cmap(framebuffer *fb) {
+    if (fb->saved_cmap == NULL || fb->pal_shown == 0) return;
+    uint16_t *saved = fb->saved_cmap;
+    struct fb_cmap cmap = { .start = 0, .len = 256, .red = saved, .green = saved + 256, .blue = saved + 512 };
+    if (ioctl(fb->fd, FBIOPUTCMAP, &cmap) == -1) {
+        printf("Failed to restore framebuffer colormap\n");
+    }
+    fb->pal_shown = 0;
+}
+
+// loads the palette the buffer was drawn with into the colormap, unless it
+// is there already
+void framebuffer_show_palette(framebuffer *fb) {
+    const palette *pal = fb->pal;
+    if (pal == NULL || pal->id == fb->pal_shown) return;
+    uint16_t red[256], green[256], blue[256];
+    for (int i = 0; i < pal->colors; i++) {
+        red[i] = pal->rgb[i][0] * 257;
+        green[i] = pal->rgb[i][1] * 257;
+        blue[i] = pal->rgb[i][2] * 257;
+    }
+    struct fb_cmap cmap = { .start = 0, .len = pal->colors, .red = red, .green = green, .blue = blue };
+    if (ioctl(fb->fd, FBIOPUTCMAP, &cmap) == -1) {
+        printf("Failed to set framebuffer colormap\n");
+    }
+    fb->pal_shown = pal->id;
+}
+
+// separable resampler: a tent filter, widened to the scale factor when
+// shrinking so every source pixel contributes. Source rows are filtered
+// horizontally into a ring of float rows, then destination rows are filtered
+// vertically from the ring. The image is done in chunks of destination rows;
+// within a chunk the new source rows are filtered in parallel, then the
+// destination rows in parallel bands. Rows the filter windows of neighbouring
+// bands (and chunks) overlap on are filtered once and shared. The float rows
+// carry 16-bit samples without loss, so IMAGE_RGB16 images only differ in
+// how rows are read and stored.
+//
+// Downscaled images can be sharpened in the same vertical pass: each band
+// keeps its last three filtered rows and stores the middle one with an
+// unsharp mask against their 3x3 binomial blur, so the only extra filtering
+// is one row above and below each band.
+
+#define RESIZE_BAND_ROWS 16
+
+// unsharp mask amount for downscaled images, 0 turns it off
+float resize_sharpen = 0.0f;
+
+typedef struct resample_axis {
+    int *start;     // first source pixel of each destination pixel
+    int *count;     // number of source pixels it uses
+    float *weights; // 'taps' per destination pixel
+    int taps;
+} resample_axis;
+
+typedef struct resize_job {
+    Image *src;
+    Image *dst;
+    resample_axis x_axis;
+    resample_axis y_axis;
+    float *ring;
+    int ring_rows;
+    int row_floats;
+    int first, last; // rows of the current chunk: source rows for the horizontal pass, destination rows for the vertical
+    int bands;
+    float sharpen;
+} resize_job;
+
+static void resample_axis_free(resample_axis *axis) {
+    free(axis->start);
+    free(axis->count);
+    free(axis->weights);
+}
+
+static int resample_axis_init(resample_axis *axis, int src_len, int dst_len) {
+    float scale = (float) dst_len / (float) src_len;
+    float support = scale < 1.0f ? 1.0f / scale : 1.0f;
+    axis->taps = (int) ceilf(2.0f * support) + 1;
+    axis->start = malloc(dst_len * sizeof(int));
+    axis->count = malloc(dst_len * sizeof(int));
+    axis->weights = malloc((size_t) dst_len * axis->taps * sizeof(float));
+    if (axis->start == NULL || axis->count == NULL || axis->weights == NULL) {
+        return 0;
+    }
+
+    for (int i = 0; i < dst_len; i++) {
+        float center = (i + 0.5f) / scale;
+        int lo = (int) floorf(center - support);
+        int hi = (int) ceilf(center + support);
+        lo = lo < 0 ? 0 : lo;
+        hi = hi > src_len ? src_len : hi;
+
+        float *w = axis->weights + (size_t) i * axis->taps;
+        float sum = 0.0f;
+        int first = -1, n = 0;
+        for (int j = lo; j < hi && n < axis->taps; j++) {
+            float weight = 1.0f - fabsf(j + 0.5f - center) / support;
+            if (weight <= 0.0f) {
+                if (first < 0) continue;
+                break;
+            }
+            if (first < 0) first = j;
+            w[n++] = weight;
+            sum += weight;
+        }
+        if (n == 0) { // window fell between pixels at an edge: take the nearest
+            first = (int) center < src_len ? (int) center : src_len - 1;
+            w[n++] = sum = 1.0f;
+        }
+        for (int k = 0; k < n; k++) {
+            w[k] /= sum;
+        }
+        axis->start[i] = first;
+        axis->count[i] = n;
+    }
+    return 1;
+}
+
+// inlined with a constant 'bpp' so the channel loops unroll
+static inline void resize_row_horizontal(const uint8_t *in, float *out, const resample_axis *axis, int width, const int bpp) {
+    for (int x = 0; x < width; x++) {
+        const uint8_t *p = in + axis->start[x] * bpp;
+        const float *w = axis->weights + (size_t) x * axis->taps;
+        float acc[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        for (int k = 0; k < axis->count[x]; k++) {
+            for (int c = 0; c < bpp; c++) {
+                acc[c] += w[k] * p[k * bpp + c];
+            }
+        }
+        for (int c = 0; c < bpp; c++) {
+            out[x * bpp + c] = acc[c];
+        }
+    }
+}
+
+// resize_row_horizontal for 16-bit samples; 'bpp' counts channels
+static inline void resize_row_horizontal16(const uint16_t *in, float *out, const resample_axis *axis, int width, const int bpp) {
+    for (int x = 0; x < width; x++) {
+        const uint16_t *p = in + axis->start[x] * bpp;
+        const float *w = axis->weights + (size_t) x * axis->taps;
+        float acc[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        for (int k = 0; k < axis->count[x]; k++) {
+            for (int c = 0; c < bpp; c++) {
+                acc[c] += w[k] * p[k * bpp + c];
+            }
+        }
+        for (int c = 0; c < bpp; c++) {
+            out[x * bpp + c] = acc[c];
+        }
+    }
+}
+
+static void resize_horizontal_band(void *arg, int band) {
+    resize_job *job = arg;
+    Image *src = job->src;
+    int bpp = src->bpp;
+    int width = job->dst->width;
+    resample_axis *axis = &job->x_axis;
+
+    int rows = job->last - job->first;
+    int y_start = job->first + (int) ((long) rows * band / job->bands);
+    int y_end = job->first + (int) ((long) rows * (band + 1) / job->bands);
+
+    trace_begin("resize h", band);
+    for (int y = y_start; y < y_end; y++) {
+        const uint8_t *in = src->data + (size_t) y * src->stride;
+        float *out = job->ring + (size_t) (y % job->ring_rows) * job->row_floats;
+        if (src->format == IMAGE_RGB16) {
+            resize_row_horizontal16((const uint16_t *) in, out, axis, width, 3);
+        }
+        else if (bpp == 1) {
+            resize_row_horizontal(in, out, axis, width, 1);
+        }
+        else if (bpp == 3) {
+            resize_row_horizontal(in, out, axis, width, 3);
+        }
+        else {
+            resize_row_horizontal(in, out, axis, width, bpp);
+        }
+    }
+    trace_end("resize h");
+}
+
+// filters destination row 'y' vertically from the ring
+static void resize_row_vertical(const resize_job *job, int y, float *acc) {
+    int n = job->row_floats;
+    const resample_axis *axis = &job->y_axis;
+    const float *w = axis->weights + (size_t) y * axis->taps;
+    for (int i = 0; i < n; i++) {
+        acc[i] = 0.0f;
+    }
+    for (int k = 0; k < axis->count[y]; k++) {
+        const float *row = job->ring + (size_t) ((axis->start[y] + k) % job->ring_rows) * n;
+        for (int i = 0; i < n; i++) {
+            acc[i] += w[k] * row[i];
+        }
+    }
+}
+
+static inline uint8_t resize_clamp(float v) {
+    v += 0.5f;
+    return v <= 0.0f ? 0 : v >= 255.0f ? 255 : (uint8_t) v;
+}
+
+static inline uint16_t resize_clamp16(float v) {
+    v += 0.5f;
+    return v <= 0.0f ? 0 : v >= 65535.0f ? 65535 : (uint16_t) v;
+}
+
+// stores a filtered row of IMAGE_RGB16 samples
+static void resize_store_row16(uint16_t *out, const float *acc, int n) {
+    int i = 0;
+
+#ifdef __SSE2__
+    // truncated like resize_clamp16; SSE2 only packs to signed 16 bits, so
+    // the samples are offset into that range and the sign bit flipped back
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 zero = _mm_setzero_ps();
+    __m128 max = _mm_set1_ps(65535.0f);
+    __m128i offset = _mm_set1_epi32(32768);
+    __m128i flip = _mm_set1_epi16((short) 0x8000);
+    for (; i + 8 <= n; i += 8) {
+        __m128 a = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_loadu_ps(acc + i), half), zero), max);
+        __m128 b = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_loadu_ps(acc + i + 4), half), zero), max);
+        __m128i v = _mm_packs_epi32(_mm_sub_epi32(_mm_cvttps_epi32(a), offset),
+                                    _mm_sub_epi32(_mm_cvttps_epi32(b), offset));
+        _mm_storeu_si128((__m128i *) (out + i), _mm_xor_si128(v, flip));
+    }
+#endif
+
+    for (; i < n; i++) {
+        out[i] = resize_clamp16(acc[i]);
+    }
+}
+
+// stores 'cur' plus 'amount' times its difference from the [1 2 1] x [1 2 1]
+// blur of the three rows; 'sum' is scratch for the vertical part of the blur
+static void resize_sharpen_row(const float *prev, const float *cur, const float *next, float *sum,
+                               uint8_t *out, int n, int bpp, float amount) {
+    for (int i = 0; i < n; i++) {
+        sum[i] = prev[i] + 2.0f * cur[i] + next[i];
+    }
+
+    // (1 + amount) * cur - amount * blur, with the blur's 1/16 folded in;
+    // edge pixels stand in for their missing neighbours
+    float gain = 1.0f + amount;
+    float blur_gain = -amount / 16.0f;
+    int i = 0;
+    for (; i < bpp && i < n; i++) {
+        float blur = (sum[i] + (i + bpp < n ? sum[i + bpp] : sum[i])) + (sum[i] + sum[i]);
+        out[i] = resize_clamp(gain * cur[i] + blur_gain * blur);
+    }
+
+#ifdef __SSE2__
+    __m128 g = _mm_set1_ps(gain);
+    __m128 bg = _mm_set1_ps(blur_gain);
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 zero = _mm_setzero_ps();
+    for (; i + 8 <= n - bpp; i += 8) {
+        __m128i v[2];
+        for (int h = 0; h < 2; h++) {
+            const float *s = sum + i + h * 4;
+            __m128 blur = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(s - bpp), _mm_loadu_ps(s + bpp)),
+                                     _mm_add_ps(_mm_loadu_ps(s), _mm_loadu_ps(s)));
+            __m128 x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(g, _mm_loadu_ps(cur + i + h * 4)),
+                                             _mm_mul_ps(bg, blur)), half);
+            // truncated like resize_clamp; the packs saturate to 0..255
+            v[h] = _mm_cvttps_epi32(_mm_max_ps(x, zero));
+        }
+        __m128i px = _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_setzero_si128());
+        _mm_storel_epi64((__m128i *) (out + i), px);
+    }
+#endif
+
+    for (; i < n; i++) {
+        float blur = (sum[i - bpp] + (i + bpp < n ? sum[i + bpp] : sum[i])) + (sum[i] + sum[i]);
+        out[i] = resize_clamp(gain * cur[i] + blur_gain * blur);
+    }
+}
+
+// resize_sharpen_row for IMAGE_RGB16 rows: the sharpened row is left in
+// 'sharp' and stored by resize_store_row16
+static void resize_sharpen_row16(const float *prev, const float *cur, const float *next, float *sum,
+                                 float *sharp, int n, int bpp, float amount) {
+    for (int i = 0; i < n; i++) {
+        sum[i] = prev[i] + 2.0f * cur[i] + next[i];
+    }
+    float gain = 1.0f + amount;
+    float blur_gain = -amount / 16.0f;
+    for (int i = 0; i < n; i++) {
+        float left = i >= bpp ? sum[i - bpp] : sum[i];
+        float right = i + bpp < n ? sum[i + bpp] : sum[i];
+        sharp[i] = gain * cur[i] + blur_gain * ((left + right) + (sum[i] + sum[i]));
+    }
+}
+
+static void resize_vertical_rows(resize_job *job, int y_start, int y_end) {
+    Image *dst = job->dst;
+    int n = job->row_floats;
+    int deep = dst->format == IMAGE_RGB16;
+
+    if (job->sharpen == 0.0f) {
+        float *acc = malloc(n * sizeof(float));
+        if (acc == NULL) return;
+        for (int y = y_start; y < y_end; y++) {
+            resize_row_vertical(job, y, acc);
+            uint8_t *out = dst->data + (size_t) y * dst->stride;
+            if (deep) {
+                resize_store_row16((uint16_t *) out, acc, n);
+                continue;
+            }
+            for (int i = 0; i < n; i++) {
+                out[i] = resize_clamp(acc[i]);
+            }
+        }
+        free(acc);
+        return;
+    }
+
+    // rows y - 1, y and y + 1 (repeating the edge rows of the image), and
+    // scratch (two rows for 16-bit images)
+    float *buf = malloc((deep ? 5 : 4) * (size_t) n * sizeof(float));
+    if (buf == NULL) return;
+    float *window[3] = { buf, buf + n, buf + 2 * (size_t) n };
+    float *sum = buf + 3 * (size_t) n;
+    float *sharp = buf + 4 * (size_t) n;
+    int last = dst->height - 1;
+    resize_row_vertical(job, y_start > 0 ? y_start - 1 : 0, window[0]);
+    resize_row_vertical(job, y_start, window[1]);
+    for (int y = y_start; y < y_end; y++) {
+        resize_row_vertical(job, y < last ? y + 1 : last, window[2]);
+        uint8_t *out = dst->data + (size_t) y * dst->stride;
+        if (deep) {
+            resize_sharpen_row16(window[0], window[1], window[2], sum, sharp, n, 3, job->sharpen);
+            resize_store_row16((uint16_t *) out, sharp, n);
+        }
+        else {
+            resize_sharpen_row(window[0], window[1], window[2], sum, out, n, dst->bpp, job->sharpen);
+        }
+        float *oldest = window[0];
+        window[0] = window[1];
+        window[1] = window[2];
+        window[2] = oldest;
+    }
+    free(buf);
+}
+
+static void resize_vertical_band(void *arg, int band) {
+    resize_job *job = arg;
+    int rows = job->last - job->first;
+    int y_start = job->first + (int) ((long) rows * band / job->bands);
+    int y_end = job->first + (int) ((long) rows * (band + 1) / job->bands);
+    trace_begin("resize v", band);
+    resize_vertical_rows(job, y_start, y_end);
+    trace_end("resize v");
+}
+
+Image *Image_resize_linear(Image *src, int new_width, int new_height) {
+    return Image_resize_linear_pool(src, new_width, new_height, task_pool_shared());
+}
+
+// resamples interleaved 'src' into the already allocated 'dst', with an
+// unsharp mask of 'sharpen' (0 for none)
+static int resize_into(Image *src, Image *dst, float sharpen, task_pool *pool) {
+    int new_width = dst->width;
+    int new_height = dst->height;
+    int channels = src->format == IMAGE_RGB16 ? src->bpp / 2 : src->bpp;
+    resize_job job = { .src = src, .dst = dst, .row_floats = dst->width * channels, .sharpen = sharpen };
+    if (!resample_axis_init(&job.x_axis, src->width, new_width) ||
+        !resample_axis_init(&job.y_axis, src->height, new_height)) {
+        printf("Failed to allocate resize filter\n");
+        resample_axis_free(&job.x_axis);
+        resample_axis_free(&job.y_axis);
+        return 0;
+    }
+
+    // the ring holds every source row one chunk needs, including those of
+    // the rows just outside it that sharpening looks at
+    int chunk = task_pool_concurrency(pool) * 2 * RESIZE_BAND_ROWS;
+    int margin = sharpen != 0.0f ? 1 : 0;
+    resample_axis *ya = &job.y_axis;
+    for (int y0 = 0; y0 < new_height; y0 += chunk) {
+        int y1 = y0 + chunk < new_height ? y0 + chunk : new_height;
+        int lo = y0 - margin > 0 ? y0 - margin : 0;
+        int hi = y1 - 1 + margin < new_height ? y1 - 1 + margin : new_height - 1;
+        int span = ya->start[hi] + ya->count[hi] - ya->start[lo];
+        job.ring_rows = span > job.ring_rows ? span : job.ring_rows;
+    }
+    job.ring = malloc((size_t) job.ring_rows * job.row_floats * sizeof(float));
+    if (job.ring == NULL) {
+        printf("Failed to allocate resize buffer\n");
+        resample_axis_free(&job.x_axis);
+        resample_axis_free(&job.y_axis);
+        return 0;
+    }
+
+    int filtered = 0; // source rows below this are in the ring (or no longer needed)
+    for (int y0 = 0; y0 < new_height; y0 += chunk) {
+        int y1 = y0 + chunk < new_height ? y0 + chunk : new_height;
+        int lo = y0 - margin > 0 ? y0 - margin : 0;
+        int hi = y1 - 1 + margin < new_height ? y1 - 1 + margin : new_height - 1;
+        int need_start = ya->start[lo];
+        int need_end = ya->start[hi] + ya->count[hi];
+
+        job.first = filtered > need_start ? filtered : need_start;
+        job.last = need_end;
+        if (job.last > job.first) {
+            job.bands = task_bands(pool, job.last - job.first, RESIZE_BAND_ROWS);
+            task_parallel_for(pool, TASK_INTERACTIVE, NULL, job.bands, resize_horizontal_band, &job);
+            filtered = job.last;
+        }
+
+        job.first = y0;
+        job.last = y1;
+        job.bands = task_bands(pool, y1 - y0, RESIZE_BAND_ROWS);
+        task_parallel_for(pool, TASK_INTERACTIVE, NULL, job.bands, resize_vertical_band, &job);
+    }
+
+    free(job.ring);
+    resample_axis_free(&job.x_axis);
+    resample_axis_free(&job.y_axis);
+    return 1;
+}
+
+static Image *resize_region(Image *src, int x, int y, int width, int height, int new_width, int new_height,
+                            task_pool *pool);
+
+Image *Image_resize_linear_pool(Image *src, int new_width, int new_height, task_pool *pool) {
+    return resize_region(src, 0, 0, src->width, src->height, new_width, new_height, pool);
+}
+
+// resamples only the 'width' x 'height' window of 'src' at (x, y), which
+// must lie inside it; planar images need x and y on their chroma grid
+Image *Image_resize_region(Image *src, int x, int y, int width, int height, int new_width, int new_height) {
+    return resize_region(src, x, y, width, height, new_width, new_height, task_pool_shared());
+}
+
+static Image *resize_region(Image *src, int x, int y, int width, int height, int new_width, int new_height,
+                            task_pool *pool) {
+    new_width = new_width < 1 ? 1 : new_width;
+    new_height = new_height < 1 ? 1 : new_height;
+
+    Image *resized = calloc(1, sizeof(Image));
+    if (resized == NULL) {
+        printf("Failed to allocate resized Image struct\n");
+        return NULL;
+    }
+
+    resized->width = new_width;
+    resized->height = new_height;
+    resized->bpp = src->bpp;
+    resized->stride = resized->width * resized->bpp;
+    resized->format = src->format;
+
+    int shrinking = (long) new_width * new_height < (long) width * height;
+    float sharpen = shrinking ? resize_sharpen : 0.0f;
+
+    // planar images keep their subsampling: chroma is resized at its own,
+    // smaller size, plane by plane
+    if (src->format == IMAGE_YCBCR) {
+        int chroma_width = (new_width + src->chroma_x - 1) / src->chroma_x;
+        int chroma_height = (new_height + src->chroma_y - 1) / src->chroma_y;
+        size_t size = (size_t) new_width * new_height + 2 * (size_t) chroma_width * chroma_height;
+        uint8_t *data = malloc(size);
+        if (data == NULL) {
+            printf("Failed to allocate resized image data\n");
+            free(resized);
+            return NULL;
+        }
+        Image_set_planes(resized, data, src->chroma_x, src->chroma_y);
+
+        // only luma is sharpened; sharpening chroma just adds colour fringes
+        for (int k = 0; k < 3; k++) {
+            int cx = k == 0 ? 1 : src->chroma_x;
+            int cy = k == 0 ? 1 : src->chroma_y;
+            Image from = { (width + cx - 1) / cx, (height + cy - 1) / cy, 1, src->plane_width[k],
+                           src->planes[k] + (size_t) (y / cy) * src->plane_width[k] + x / cx };
+            Image to = { resized->plane_width[k], resized->plane_height[k], 1, resized->plane_width[k], resized->planes[k] };
+            if (!resize_into(&from, &to, k == 0 ? sharpen : 0.0f, pool)) {
+                Image_free(resized);
+                return NULL;
+            }
+        }
+        return resized;
+    }
+
+    resized->data = malloc((size_t) resized->height * resized->stride);
+    if (resized->data == NULL) {
+        printf("Failed to allocate resized image data\n");
+        free(resized);
+        return NULL;    
+    }
+    Image from = *src;
+    from.width = width;
+    from.height = height;
+    from.data = src->data + (size_t) y * src->stride + (size_t) x * src->bpp;
+    if (!resize_into(&from, resized, sharpen, pool)) {
+        Image_free(resized);
+        return NULL;
+    }
+    return resized;
+}
+
+
+
+float fit_scale(framebuffer *fb, int width, int height) {
+    float scale_w = (float) fb->width / (float) width;
+    float scale_h = (float) fb->height / (float) height;
+    float scale = scale_w < scale_h ? scale_w : scale_h;
+    return scale * 0.8f;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// library API (zfbv.h): a display is a framebuffer plus the panel's ICC
+// profile; an image is the decoded Image, its colour transform to that panel
+// and the resized copy last drawn
+
+// what a back buffer holds: render number 'render' of its display, with
+// the loupe drawn over it at 'loupe' (empty for none)
+typedef struct zfbv_drawn {
+    char *buffer;
+    unsigned render;
+    fb_rect loupe;
+} zfbv_drawn;
+
+struct zfbv_display {
+    framebuffer *fb;
+    int progressive;
+    uint8_t *panel_icc; // NULL for sRGB
+    int panel_icc_len;
+    zfbv_stats stats;
+
+    // zfbv_render_loupe: the rendition it composites over, numbered by
+    // 'renders'; what each buffer holds (two for DRM, which gets back the
+    // one presented before last); and the rects changed since the last
+    // present (damage_count -1 for the whole screen)
+    unsigned renders;
+    zfbv_image *base;
+    float base_scale;
+    int base_x, base_y;
+    zfbv_drawn drawn[2];
+    fb_rect damage[2];
+    int damage_count;
+};
+
+struct zfbv_image {
+    zfbv_display *display;
+    Image *img; // NULL if decoding failed
+    color_lut *lut;
+    palette *pal; // 8 bpp colour displays
+    Image *resized;
+    float resized_scale;
+
+    // zfbv_prefetch: decoded by prefetch_task on the pool
+    char *filename;
+    int pending;
+    task_group group;
+    task_token token;
+};
+
+void zfbv_default_options(zfbv_options *opt) {
+    memset(opt, 0, sizeof(*opt));
+    opt->dither = 4;
+    opt->limit_megapixels = 256;
+    opt->limit_megabytes = 2048;
+    opt->limit_seconds = 10;
+}
+
+// the process-wide settings: pool size (until the pool has started), sharpen
+// amount and decode limits
+static void zfbv_apply_options(const zfbv_options *opt) {
+    task_pool_threads = opt->threads;
+    resize_sharpen = opt->sharpen;
+    stbi_decode_limits limits = { opt->limit_megapixels * 1e6, (size_t) (opt->limit_megabytes * 1024 * 1024),
+                                  opt->limit_seconds };
+    stbi_set_decode_limits(&limits);
+    Image_decode_on(task_pool_shared());
+}
+
+// benchmark cases get a warm-up run and then 'runs' timed ones, and are
+// summarised by their median and median absolute deviation, which a few
+// runs slowed down by other jobs on the host hardly move. The samples can be
+// saved as JSON and a later run compared with them: a case has regressed
+// when its median is more than the threshold slower and a one-sided
+// Mann-Whitney U test makes noise an unlikely explanation.
+#define BENCH_MAX_CASES 16
+#define BENCH_MAX_RUNS 1000
+#define BENCH_SIGNIFICANCE 0.01
+
+typedef struct bench_case {
+    char name[32];
+    int count;
+    double samples[BENCH_MAX_RUNS]; // seconds
+    double median, mad;
+} bench_case;
+
+typedef struct bench_results {
+    int count;
+    bench_case cases[BENCH_MAX_CASES];
+} bench_results;
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+// sorts 'v'
+static double median_sorted(double *v, int n) {
+    qsort(v, n, sizeof(double), compare_double);
+    return n % 2 ? v[n / 2] : 0.5 * (v[n / 2 - 1] + v[n / 2]);
+}
+
+static bench_case *bench_add(bench_results *results, const char *name) {
+    if (results->count == BENCH_MAX_CASES) return NULL;
+    bench_case *c = &results->cases[results->count++];
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    c->count = 0;
+    return c;
+}
+
+static void bench_sample(bench_case *c, double seconds) {
+    if (c != NULL && c->count < BENCH_MAX_RUNS) {
+        c->samples[c->count++] = seconds;
+    }
+}
+
+static void bench_summarise(bench_case *c) {
+    double v[BENCH_MAX_RUNS];
+    memcpy(v, c->samples, c->count * sizeof(double));
+    c->median = median_sorted(v, c->count);
+    for (int i = 0; i < c->count; i++) {
+        v[i] = fabs(c->samples[i] - c->median);
+    }
+    c->mad = median_sorted(v, c->count);
+}
+
+static bench_case *bench_find(bench_results *results, const char *name) {
+    for (int i = 0; i < results->count; i++) {
+        if (strcmp(results->cases[i].name, name) == 0) return &results->cases[i];
+    }
+    return NULL;
+}
+
+// one-sided p-value of 'a' being slower than 'b' by chance: the Mann-Whitney
+// U test in its normal approximation with tie correction, good from about 8
+// samples each
+static double bench_slower_p(const bench_case *a, const bench_case *b) {
+    int n1 = a->count, n2 = b->count, n = n1 + n2;
+    if (n1 == 0 || n2 == 0) return 1.0;
+    double *all = malloc(n * sizeof(double));
+    if (all == NULL) return 1.0;
+    memcpy(all, a->samples, n1 * sizeof(double));
+    memcpy(all + n1, b->samples, n2 * sizeof(double));
+    qsort(all, n, sizeof(double), compare_double);
+
+    // rank sum of 'a', tied values sharing their mean rank
+    double rank_sum = 0.0, ties = 0.0;
+    for (int i = 0; i < n; ) {
+        int j = i;
+        while (j < n && all[j] == all[i]) j++;
+        double t = j - i;
+        double rank = 0.5 * (i + 1 + j);
+        for (int k = 0; k < n1; k++) {
+            if (a->samples[k] == all[i]) rank_sum += rank;
+        }
+        ties += t * t * t - t;
+        i = j;
+    }
+    free(all);
+
+    double u = rank_sum - n1 * (n1 + 1) / 2.0;
+    double var = n1 * (double) n2 / 12.0 * ((n + 1) - ties / ((double) n * (n - 1)));
+    if (var <= 0.0) return 1.0;
+    double z = (u - n1 * (double) n2 / 2.0 - 0.5) / sqrt(var);
+    return 0.5 * erfc(z / sqrt(2.0));
+}
+
+static void json_write_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+        else if ((unsigned char) *s < ' ') fprintf(f, "\\u%04x", *s);
+        else fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static int bench_save(const bench_results *results, const char *path, const char *image) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        printf("Failed to open %s\n", path);
+        return 0;
+    }
+    fprintf(f, "{\n  \"zfbv_benchmark\": 1,\n  \"image\": ");
+    json_write_string(f, image);
+    fprintf(f, ",\n  \"cases\": [");
+    for (int i = 0; i < results->count; i++) {
+        const bench_case *c = &results->cases[i];
+        fprintf(f, "%s\n    {\"name\": ", i > 0 ? "," : "");
+        json_write_string(f, c->name);
+        fprintf(f, ", \"median_ms\": %.6f, \"mad_ms\": %.6f, \"samples_ms\": [", c->median * 1e3, c->mad * 1e3);
+        for (int k = 0; k < c->count; k++) {
+            fprintf(f, "%s%.6f", k > 0 ? ", " : "", c->samples[k] * 1e3);
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "\n  ]\n}\n");
+    if (fclose(f) != 0) {
+        printf("Failed to write %s\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+// reads the names and samples of a file written by bench_save
+static int bench_load(bench_results *results, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        printf("Failed to open baseline %s\n", path);
+        return 0;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *text = size > 0 ? malloc(size + 1) : NULL;
+    if (text == NULL || fread(text, 1, size, f) != (size_t) size) {
+        printf("Failed to read baseline %s\n", path);
+        free(text);
+        fclose(f);
+        return 0;
+    }
+    text[size] = '\0';
+    fclose(f);
+
+    results->count = 0;
+    const char *p = text;
+    while ((p = strstr(p, "\"name\"")) != NULL) {
+        const char *q = strchr(p + 6, '"');
+        const char *end = q != NULL ? strchr(q + 1, '"') : NULL;
+        p = end != NULL ? strstr(end, "\"samples_ms\"") : NULL;
+        p = p != NULL ? strchr(p, '[') : NULL;
+        if (p == NULL) break;
+        char name[32];
+        snprintf(name, sizeof(name), "%.*s", (int) (end - q - 1), q + 1);
+        bench_case *c = bench_add(results, name);
+        if (c == NULL) break;
+
+        p++;
+        while (1) {
+            char *next;
+            double ms = strtod(p, &next);
+            if (next == p) break;
+            bench_sample(c, ms * 1e-3);
+            p = next;
+            while (*p == ' ' || *p == ',' || *p == '\n') p++;
+        }
+        if (c->count == 0) results->count--;
+        else bench_summarise(c);
+    }
+    free(text);
+    if (results->count == 0) {
+        printf("No benchmark results in baseline %s\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+static int bench_regressed(const bench_case *c, const bench_case *b, double threshold) {
+    return 100.0 * (c->median / b->median - 1.0) > threshold && bench_slower_p(c, b) < BENCH_SIGNIFICANCE;
+}
+
+// prints each case against the baseline; returns how many regressed
+static int bench_compare(const bench_results *results, bench_results *baseline, double threshold) {
+    printf("\ncase               baseline ms   now ms   change        p\n");
+    int regressed = 0;
+    for (int i = 0; i < results->count; i++) {
+        const bench_case *c = &results->cases[i];
+        const bench_case *b = bench_find(baseline, c->name);
+        if (b == NULL) {
+            printf("%-18s %11s %8.2f\n", c->name, "-", c->median * 1e3);
+            continue;
+        }
+        int slower = bench_regressed(c, b, threshold);
+        printf("%-18s %11.2f %8.2f %+7.1f%% %8.4f%s\n", c->name, b->median * 1e3, c->median * 1e3,
+               100.0 * (c->median / b->median - 1.0), bench_slower_p(c, b), slower ? "  REGRESSED" : "");
+        regressed += slower;
+    }
+
+    if (regressed == 0) {
+        printf("no case is more than %.1f%% slower than the baseline\n", threshold);
+        return 0;
+    }
+    printf("regressed by more than %.1f%%:", threshold);
+    const char *sep = " ";
+    for (int i = 0; i < results->count; i++) {
+        const bench_case *c = &results->cases[i];
+        const bench_case *b = bench_find(baseline, c->name);
+        if (b != NULL && bench_regressed(c, b, threshold)) {
+            printf("%s%s", sep, c->name);
+            sep = ", ";
+        }
+    }
+    printf("\n");
+    return regressed;
+}
+
+// memory-bandwidth roofline: each kernel's traffic (the bytes of its real
+// input and output formats, read plus written) against a STREAM-style copy
+// and fill of buffers far larger than the caches, run on as many threads as
+// the kernel. Kernels well under the peak are limited by their arithmetic,
+// not by memory, and are the ones worth optimising.
+#define STREAM_BYTES ((size_t) 128 << 20)
+#define ROOFLINE_COMPUTE_BOUND 0.5 // fraction of the peak below which a kernel is flagged
+
+typedef struct stream_job {
+    char *dst;
+    const char *src; // NULL fills
+    size_t len;
+    int bands;
+} stream_job;
+
+static void stream_band(void *arg, int band) {
+    stream_job *job = arg;
+    size_t start = job->len * band / job->bands;
+    size_t end = job->len * (band + 1) / job->bands;
+    if (job->src != NULL) {
+        memcpy(job->dst + start, job->src + start, end - start);
+    }
+    else {
+        memset(job->dst + start, band, end - start);
+    }
+}
+
+// GB/s of a copy (counting the read and the write) or a fill on 'pool', at
+// its fastest run: the peak is what the machine can do, not what it usually does
+static double stream_peak(task_pool *pool, char *dst, const char *src, bench_case *c, int runs) {
+    stream_job job = { dst, src, STREAM_BYTES, task_pool_concurrency(pool) };
+    double best = 1e30;
+    for (int run = 0; run <= runs; run++) {
+        double start = now_seconds();
+        task_parallel_for(pool, TASK_INTERACTIVE, NULL, job.bands, stream_band, &job);
+        double elapsed = now_seconds() - start;
+        if (run == 0) continue; // warm-up
+        bench_sample(c, elapsed);
+        best = elapsed < best ? elapsed : best;
+    }
+    if (c != NULL) bench_summarise(c);
+    return (src != NULL ? 2.0 : 1.0) * STREAM_BYTES / best * 1e-9;
+}
+
+// bytes of pixel data in 'img', all planes
+static size_t image_bytes(const Image *img) {
+    if (img->format == IMAGE_YCBCR) {
+        size_t bytes = 0;
+        for (int k = 0; k < 3; k++) {
+            bytes += (size_t) img->plane_width[k] * img->plane_height[k];
+        }
+        return bytes;
+    }
+    return (size_t) img->height * img->stride;
+}
+
+static void roofline_report(const bench_case *c, size_t bytes, double peak) {
+    double rate = bytes / c->median * 1e-9;
+    printf("%-8s %8.2f %7.2f %8.1f %8.2f %7.0f%%  %s\n", c->name, c->median * 1e3, c->mad * 1e3, bytes / 1e6,
+           rate, 100.0 * rate / peak, rate < ROOFLINE_COMPUTE_BOUND * peak ? "compute-bound" : "memory-bound");
+}
+
+// times resize, clear, blit and present of 'img' into a 3840x2160 XRGB8888
+// framebuffer in memory on the shared pool; present (a single memcpy) is
+// measured against the peak of one thread
+static int benchmark_roofline(bench_results *results, Image *img, int width, int height, int runs) {
+    task_pool *pool = task_pool_shared();
+    framebuffer fb = { .fd = -1, .width = 3840, .height = 2160, .bpp = 4, .stride = 3840 * 4, .dither = 4 };
+    size_t frame = (size_t) fb.height * fb.stride;
+    char *a = malloc(STREAM_BYTES);
+    char *b = malloc(STREAM_BYTES);
+    fb.fbp = malloc(frame);
+    fb.buffer = malloc(frame);
+    if (a == NULL || b == NULL || fb.fbp == NULL || fb.buffer == NULL) {
+        printf("Failed to allocate roofline buffers\n");
+        free(a);
+        free(b);
+        free(fb.fbp);
+        free(fb.buffer);
+        return 0;
+    }
+    // touch every page first so the copies below do not time page faults
+    memset(a, 1, STREAM_BYTES);
+    memset(b, 2, STREAM_BYTES);
+    memset(fb.fbp, 0, frame);
+    memset(fb.buffer, 0, frame);
+
+    double copy = stream_peak(pool, b, a, bench_add(results, "copy"), runs);
+    double fill = stream_peak(pool, b, NULL, bench_add(results, "fill"), runs);
+    double copy1 = stream_peak(NULL, b, a, bench_add(results, "copy 1 thread"), runs);
+    double fill1 = stream_peak(NULL, b, NULL, bench_add(results, "fill 1 thread"), runs);
+    double peak = copy > fill ? copy : fill;
+    double peak1 = copy1 > fill1 ? copy1 : fill1;
+    free(a);
+    free(b);
+    printf("\nmemory peak: copy %.2f GB/s, fill %.2f GB/s on %d threads; copy %.2f GB/s, fill %.2f GB/s on 1\n",
+           copy, fill, task_pool_concurrency(pool), copy1, fill1);
+    printf("kernel         ms     mad       MB     GB/s  of peak\n");
+
+    bench_case *cases[4] = { bench_add(results, "resize"), bench_add(results, "clear"),
+                             bench_add(results, "blit"), bench_add(results, "present") };
+    if (cases[3] == NULL) {
+        printf("Too many benchmark cases\n");
+        free(fb.fbp);
+        free(fb.buffer);
+        return 0;
+    }
+    Image *resized = NULL;
+    for (int run = 0; run <= runs; run++) {
+        double t0 = now_seconds();
+        Image *r = Image_resize_linear_pool(img, width, height, pool);
+        double t1 = now_seconds();
+        if (r == NULL) {
+            Image_free(resized);
+            free(fb.fbp);
+            free(fb.buffer);
+            return 0;
+        }
+        Image_free(resized);
+        resized = r;
+        framebuffer_clear_color(&fb, 0, 0, 0);
+        double t2 = now_seconds();
+        framebuffer_draw_image(&fb, (fb.width - width) / 2, (fb.height - height) / 2, resized);
+        double t3 = now_seconds();
+        framebuffer_update(&fb);
+        double t4 = now_seconds();
+
+        if (run == 0) continue; // warm-up
+        double t[4] = { t1 - t0, t2 - t1, t3 - t2, t4 - t3 };
+        for (int k = 0; k < 4; k++) {
+            bench_sample(cases[k], t[k]);
+        }
+    }
+    for (int k = 0; k < 4; k++) {
+        bench_summarise(cases[k]);
+    }
+
+    // the blit reads the resized image and writes the part of the frame it covers
+    size_t covered = (size_t) (width < fb.width ? width : fb.width) * (height < fb.height ? height : fb.height);
+    roofline_report(cases[0], image_bytes(img) + image_bytes(resized), peak);
+    roofline_report(cases[1], frame, peak);
+    roofline_report(cases[2], image_bytes(resized) + covered * fb.bpp, peak);
+    roofline_report(cases[3], 2 * frame, peak1);
+
+    Image_free(resized);
+    free(fb.fbp);
+    free(fb.buffer);
+    return 1;
+}
+
+void zfbv_default_benchmark_options(zfbv_benchmark_options *bench) {
+    memset(bench, 0, sizeof(*bench));
+    bench->runs = 15;
+    bench->threshold = 5.0;
+}
+
+int zfbv_benchmark(const char *filename, const zfbv_options *opt) {
+    return zfbv_benchmark_run(filename, opt, NULL);
+}
+
+// decode time of 'filename' and the speedup curve of the resampler fitting
+// it into 3840x2160 with pools of 1 to 16 threads (the caller counts as
+// one), then the memory-bandwidth roofline of the whole pipeline on the
+// shared pool
+int zfbv_benchmark_run(const char *filename, const zfbv_options *opt, const zfbv_benchmark_options *bench) {
+    zfbv_options defaults;
+    if (opt == NULL) {
+        zfbv_default_options(&defaults);
+        opt = &defaults;
+    }
+    zfbv_benchmark_options bench_defaults;
+    if (bench == NULL) {
+        zfbv_default_benchmark_options(&bench_defaults);
+        bench = &bench_defaults;
+    }
+    if (bench->runs < 1 || bench->runs > BENCH_MAX_RUNS || bench->threshold < 0.0) {
+        printf("Benchmark runs must be 1 to %d and the threshold not negative\n", BENCH_MAX_RUNS);
+        return 1;
+    }
+    int runs = bench->runs;
+    zfbv_apply_options(opt);
+
+    bench_results *results = calloc(1, sizeof(bench_results));
+    bench_results *baseline = bench->baseline != NULL ? calloc(1, sizeof(bench_results)) : NULL;
+    if (results == NULL || (bench->baseline != NULL && baseline == NULL)) {
+        printf("Failed to allocate benchmark results\n");
+        free(results);
+        free(baseline);
+        return 1;
+    }
+    // a missing baseline fails before anything is timed
+    if (baseline != NULL && !bench_load(baseline, bench->baseline)) {
+        free(results);
+        free(baseline);
+        return 1;
+    }
+
+    Image *img = Image_load(filename);
+    if (img == NULL) {
+        free(results);
+        free(baseline);
+        return 1;
+    }
+
+    float scale_w = 3840.0f / img->width;
+    float scale_h = 2160.0f / img->height;
+    float scale = scale_w < scale_h ? scale_w : scale_h;
+    int width = (int) (img->width * scale);
+    int height = (int) (img->height * scale);
+    printf("resize %dx%d -> %dx%d, %ld CPUs online, median of %d runs after a warm-up\n", img->width, img->height,
+           width, height, sysconf(_SC_NPROCESSORS_ONLN), runs);
+
+    // decoding goes through the shared pool, as when viewing
+    int ok = 1;
+    bench_case *decode = bench_add(results, "decode");
+    for (int run = 0; run <= runs && ok; run++) {
+        double start = now_seconds();
+        Image *decoded = Image_load(filename);
+        double elapsed = now_seconds() - start;
+        ok = decoded != NULL;
+        Image_free(decoded);
+        if (run > 0) bench_sample(decode, elapsed);
+    }
+    if (ok) {
+        bench_summarise(decode);
+        printf("decode %.2f ms, mad %.2f\n", decode->median * 1e3, decode->mad * 1e3);
+    }
+
+    printf("threads       ms     mad  speedup\n");
+    double base = 0.0;
+    for (int threads = 1; threads <= 16 && ok; threads *= 2) {
+        task_pool *pool = threads > 1 ? task_pool_create(threads - 1) : NULL;
+        if (threads > 1 && pool == NULL) break;
+
+        char name[32];
+        snprintf(name, sizeof(name), "resize %d thread%s", threads, threads > 1 ? "s" : "");
+        bench_case *c = bench_add(results, name);
+        for (int run = 0; run <= runs; run++) {
+            double start = now_seconds();
+            Image *resized = Image_resize_linear_pool(img, width, height, pool);
+            double elapsed = now_seconds() - start;
+            if (resized == NULL) {
+                ok = 0;
+                break;
+            }
+            Image_free(resized);
+            if (run > 0) bench_sample(c, elapsed); // the first is a warm-up
+        }
+        task_pool_destroy(pool);
+        if (!ok) break;
+
+        bench_summarise(c);
+        if (threads == 1) base = c->median;
+        printf("%7d %8.2f %7.2f %8.2fx\n", threads, c->median * 1e3, c->mad * 1e3, base / c->median);
+    }
+
+    ok = ok && benchmark_roofline(results, img, width, height, runs);
+    Image_free(img);
+
+    int ret = ok ? 0 : 1;
+    if (ok && bench->save != NULL && !bench_save(results, bench->save, filename)) {
+        ret = 1;
+    }
+    if (ok && baseline != NULL && bench_compare(results, baseline, bench->threshold) > 0) {
+        ret = 2;
+    }
+    free(results);
+    free(baseline);
+    return ret;
+}
+
+// stb_image pass callback: draws the block-replicated preview of an
+// interlaced PNG the same way the finished image will be drawn. 'user' is
+// the display; zfbv_load sets it for its own decode only, so prefetches on
+// other threads are not shown.
+void show_png_pass(void *user, const stbi_uc *pixels, int width, int height, int channels, int pass) {
+    zfbv_display *d = user;
+    framebuffer *fb = d->fb;
+    if (fb->bpp == 1 && !fb->gray) {
+        fb->pal = palette_uniform();
+    }
+    Image preview = { width, height, channels, width * channels, (uint8_t *) pixels };
+
+    float scale = fit_scale(fb, width, height);
+    Image *resized = Image_resize_linear(&preview, (int) (width * scale), (int) (height * scale));
+    if (resized == NULL) return;
+
+    framebuffer_clear_color(fb, 0, 0, 0);
+    framebuffer_draw_image(fb, (fb->width - resized->width) / 2, (fb->height - resized->height) / 2, resized);
+    framebuffer_update(fb);
+    d->renders++; // the loupe must not composite over this
+    Image_free(resized);
+    (void) pass;
+}
+
+
+
+zfbv_display *zfbv_open(const char *device, const zfbv_options *opt) {
+    zfbv_options defaults;
+    if (opt == NULL) {
+        zfbv_default_options(&defaults);
+        opt = &defaults;
+    }
+    if (opt->dither != 0 && opt->dither != 4 && opt->dither != 8) {
+        printf("Unsupported dither matrix size: %d\n", opt->dither);
+        return NULL;
+    }
+    if (opt->sharpen < 0.0f || opt->sharpen > 4.0f) {
+        printf("Unsupported sharpen amount: %g\n", opt->sharpen);
+        return NULL;
+    }
+
+    zfbv_display *d = calloc(1, sizeof(zfbv_display));
+    if (d == NULL) {
+        printf("Failed to allocate display\n");
+        return NULL;
+    }
+    zfbv_apply_options(opt);
+    d->fb = framebuffer_create(device);
+    if (d->fb == NULL) {
+        free(d);
+        return NULL;
+    }
+    d->fb->dither = opt->dither;
+    d->fb->diff_present = opt->diff_present;
+    if (opt->panel_profile != NULL) {
+        d->panel_icc = icc_load_file(opt->panel_profile, &d->panel_icc_len);
+    }
+    d->progressive = opt->progressive;
+    return d;
+}
+
+void zfbv_close(zfbv_display *d) {
+    if (d == NULL) return;
+    framebuffer_destroy(d->fb);
+    free(d->panel_icc);
+    free(d);
+}
+
+// decodes 'filename' into 'image' and builds its colour transform to the panel
+static void zfbv_image_decode(zfbv_image *image, const char *filename) {
+    zfbv_display *d = image->display;
+    image->img = d->fb->rgb30 ? Image_load_deep(filename) : Image_load(filename);
+    if (image->img != NULL) {
+        image->lut = color_lut_create(image->img->icc, image->img->icc_len, d->panel_icc, d->panel_icc_len);
+    }
+    if (image->img != NULL && d->fb->bpp == 1 && !d->fb->gray) {
+        image->pal = palette_create(image->img, image->lut);
+    }
+}
+
+zfbv_image *zfbv_load(zfbv_display *d, const char *filename) {
+    double start = now_seconds();
+    zfbv_image *image = calloc(1, sizeof(zfbv_image));
+    if (image == NULL) {
+        printf("Failed to allocate image\n");
+        return NULL;
+    }
+    image->display = d;
+
+    if (d->progressive) {
+        stbi_set_png_pass_callback(show_png_pass, d);
+    }
+    zfbv_image_decode(image, filename);
+    if (d->progressive) {
+        stbi_set_png_pass_callback(NULL, NULL);
+    }
+    if (image->img == NULL) {
+        free(image);
+        return NULL;
+    }
+    d->stats.load_seconds = now_seconds() - start;
+    return image;
+}
+
+static void prefetch_task(void *arg, int index) {
+    zfbv_image *image = arg;
+    task_priority outer = decode_priority;
+    decode_priority = TASK_PREFETCH;
+    zfbv_image_decode(image, image->filename);
+    decode_priority = outer;
+    (void) index;
+}
+
+zfbv_image *zfbv_prefetch(zfbv_display *d, const char *filename) {
+    zfbv_image *image = calloc(1, sizeof(zfbv_image));
+    if (image == NULL || (image->filename = strdup(filename)) == NULL) {
+        printf("Failed to allocate image\n");
+        free(image);
+        return NULL;
+    }
+    image->display = d;
+    image->pending = 1;
+    task_token_init(&image->token);
+    task_group_init(&image->group);
+    task_submit(task_pool_shared(), TASK_PREFETCH_START, &image->token, &image->group, prefetch_task, image, 0);
+    return image;
+}
+
+// waits for a prefetched image (the waiting thread helps with queued tasks)
+static void zfbv_image_finish(zfbv_image *image) {
+    if (!image->pending) return;
+    task_group_wait(task_pool_shared(), &image->group);
+    task_group_destroy(&image->group);
+    free(image->filename);
+    image->filename = NULL;
+    image->pending = 0;
+}
+
+static void zfbv_image_wait(zfbv_image *image) {
+    if (!image->pending) return;
+    double start = now_seconds();
+    zfbv_image_finish(image);
+    image->display->stats.load_seconds = now_seconds() - start;
+}
+
+int zfbv_image_size(zfbv_image *image, int *width, int *height) {
+    zfbv_image_wait(image);
+    if (image->img == NULL) return 0;
+    if (width != NULL) *width = image->img->width;
+    if (height != NULL) *height = image->img->height;
+    return 1;
+}
+
+void zfbv_image_free(zfbv_image *image) {
+    if (image == NULL) return;
+    if (image->pending) {
+        task_token_cancel(&image->token);
+        zfbv_image_finish(image);
+    }
+    Image_free(image->img);
+    Image_free(image->resized);
+    color_lut_free(image->lut);
+    if (image->pal != NULL && image->display->fb->pal == image->pal) {
+        image->display->fb->pal = palette_uniform();
+    }
+    if (image->display->base == image) {
+        image->display->base = NULL;
+    }
+    palette_free(image->pal);
+    free(image);
+}
+
+float zfbv_fit_scale(zfbv_display *d, zfbv_image *image) {
+    zfbv_image_wait(image);
+    if (image->img == NULL) return 0.0f;
+    return fit_scale(d->fb, image->img->width, image->img->height);
+}
+
+// resizes 'image' for 'transform' if its scale changed and works out where
+// it goes; 0 if there is nothing to draw
+static int zfbv_place(zfbv_display *d, zfbv_image *image, const zfbv_transform *transform, int *x, int *y) {
+    framebuffer *fb = d->fb;
+    Image *img = image->img;
+    float scale = transform != NULL && transform->scale > 0.0f ? transform->scale
+                                                                : fit_scale(fb, img->width, img->height);
+    if (image->resized == NULL || scale != image->resized_scale) {
+        int width = (int) (img->width * scale);
+        int height = (int) (img->height * scale);
+        Image *resized = Image_resize_linear(img, width > 0 ? width : 1, height > 0 ? height : 1);
+        if (resized != NULL) {
+            Image_free(image->resized);
+            image->resized = resized;
+            image->resized_scale = scale;
+        }
+        else if (image->resized == NULL) {
+            return 0;
+        }
+    }
+
+    *x = (fb->width - image->resized->width) / 2;
+    *y = (fb->height - image->resized->height) / 2;
+    if (transform != NULL) {
+        *x += transform->offset_x;
+        *y += transform->offset_y;
+    }
+    return 1;
+}
+
+// blits of 'image' go through its colour LUT and palette until zfbv_blit_end
+static void zfbv_blit_begin(framebuffer *fb, zfbv_image *image) {
+    fb->lut = image->lut;
+    if (fb->bpp == 1 && !fb->gray) {
+        fb->pal = image->pal != NULL ? image->pal : palette_uniform();
+    }
+}
+
+static void zfbv_blit_end(framebuffer *fb) {
+    fb->lut = NULL;
+}
+
+// the buffer being drawn into; the other DRM buffer is one presented earlier
+static zfbv_drawn *zfbv_back(zfbv_display *d) {
+    if (d->drawn[0].buffer == d->fb->buffer || d->drawn[0].buffer == NULL) {
+        return &d->drawn[0];
+    }
+    return &d->drawn[1];
+}
+
+// draws the base rendition over the whole back buffer
+static void zfbv_draw_base(zfbv_display *d) {
+    framebuffer *fb = d->fb;
+    zfbv_blit_begin(fb, d->base);
+    framebuffer_clear_color(fb, 0, 0, 0);
+    framebuffer_draw_image(fb, d->base_x, d->base_y, d->base->resized);
+    zfbv_blit_end(fb);
+
+    zfbv_drawn *back = zfbv_back(d);
+    back->buffer = fb->buffer;
+    back->render = d->renders;
+    back->loupe = (fb_rect) { 0, 0, 0, 0 };
+    d->damage_count = -1;
+}
+
+static fb_rect rect_union(fb_rect a, fb_rect b) {
+    fb_rect r = { a.x0 < b.x0 ? a.x0 : b.x0, a.y0 < b.y0 ? a.y0 : b.y0,
+                  a.x1 > b.x1 ? a.x1 : b.x1, a.y1 > b.y1 ? a.y1 : b.y1 };
+    return r;
+}
+
+// adds 'r' to what the next present copies: overlapping rects are merged,
+// and a third one merges all of them into their bounding box
+static void zfbv_damage(zfbv_display *d, fb_rect r) {
+    if (d->damage_count < 0 || r.x0 >= r.x1 || r.y0 >= r.y1) return;
+    for (int i = 0; i < d->damage_count; i++) {
+        fb_rect *o = &d->damage[i];
+        if (r.x0 < o->x1 && o->x0 < r.x1 && r.y0 < o->y1 && o->y0 < r.y1) {
+            *o = rect_union(*o, r);
+            return;
+        }
+    }
+    if (d->damage_count < 2) {
+        d->damage[d->damage_count++] = r;
+        return;
+    }
+    d->damage[0] = rect_union(rect_union(d->damage[0], d->damage[1]), r);
+    d->damage_count = 1;
+}
+
+int zfbv_render(zfbv_display *d, zfbv_image *image, const zfbv_transform *transform) {
+    zfbv_image_wait(image);
+    if (image->img == NULL) return 0;
+
+    double start = now_seconds();
+    trace_begin("render", 0);
+    int x, y;
+    if (!zfbv_place(d, image, transform, &x, &y)) {
+        trace_end("render");
+        return 0;
+    }
+    d->renders++;
+    d->base = image;
+    d->base_scale = image->resized_scale;
+    d->base_x = x;
+    d->base_y = y;
+    zfbv_draw_base(d);
+    trace_end("render");
+    d->stats.render_seconds = now_seconds() - start;
+    return 1;
+}
+
+// resamples the part of the original image under 'lens' (clipped to the
+// screen) at 'scale' and draws it there
+static void zfbv_draw_loupe(zfbv_display *d, const zfbv_loupe *loupe, fb_rect lens, float scale) {
+    framebuffer *fb = d->fb;
+    Image *img = d->base->img;
+    Image *resized = d->base->resized;
+
+    // the image point under the loupe's centre, and the window of the image
+    // the lens shows plus a margin for the filter, which clamps at its edges
+    float kx = (float) img->width / resized->width;
+    float ky = (float) img->height / resized->height;
+    float cx = (loupe->x - d->base_x) * kx;
+    float cy = (loupe->y - d->base_y) * ky;
+    int margin = (int) (1.0f / scale) + 2;
+    int x0 = (int) floorf(cx + (lens.x0 - loupe->x) / scale) - margin;
+    int y0 = (int) floorf(cy + (lens.y0 - loupe->y) / scale) - margin;
+    int x1 = (int) ceilf(cx + (lens.x1 - loupe->x) / scale) + margin;
+    int y1 = (int) ceilf(cy + (lens.y1 - loupe->y) / scale) + margin;
+    x0 = x0 < 0 ? 0 : x0;
+    y0 = y0 < 0 ? 0 : y0;
+    x1 = x1 > img->width ? img->width : x1;
+    y1 = y1 > img->height ? img->height : y1;
+    if (img->format == IMAGE_YCBCR) {
+        x0 -= x0 % img->chroma_x;
+        y0 -= y0 % img->chroma_y;
+    }
+
+    framebuffer_clear_rect(fb, &lens, 0, 0, 0);
+    if (x0 < x1 && y0 < y1) {
+        int width = (int) ((x1 - x0) * scale + 0.5f);
+        int height = (int) ((y1 - y0) * scale + 0.5f);
+        Image *view = Image_resize_region(img, x0, y0, x1 - x0, y1 - y0, width, height);
+        if (view != NULL) {
+            float sx = (float) view->width / (x1 - x0);
+            float sy = (float) view->height / (y1 - y0);
+            int x = (int) floorf(loupe->x - (cx - x0) * sx + 0.5f);
+            int y = (int) floorf(loupe->y - (cy - y0) * sy + 0.5f);
+            zfbv_blit_begin(fb, d->base);
+            framebuffer_draw_image_clipped(fb, x, y, view, &lens);
+            zfbv_blit_end(fb);
+            Image_free(view);
+        }
+    }
+
+    // a grey frame, where it is on screen
+    int left = loupe->x - loupe->width / 2, top = loupe->y - loupe->height / 2;
+    fb_rect edges[4] = {
+        { left, top, left + loupe->width, top + 1 },
+        { left, top + loupe->height - 1, left + loupe->width, top + loupe->height },
+        { left, top, left + 1, top + loupe->height },
+        { left + loupe->width - 1, top, left + loupe->width, top + loupe->height },
+    };
+    for (int i = 0; i < 4; i++) {
+        framebuffer_clear_rect(fb, &edges[i], 128, 128, 128);
+    }
+}
+
+int zfbv_render_loupe(zfbv_display *d, zfbv_image *image, const zfbv_transform *transform,
+                      const zfbv_loupe *loupe) {
+    zfbv_image_wait(image);
+    if (image->img == NULL) return 0;
+
+    double start = now_seconds();
+    trace_begin("render loupe", 0);
+    framebuffer *fb = d->fb;
+    int x, y;
+    if (!zfbv_place(d, image, transform, &x, &y)) {
+        trace_end("render loupe");
+        return 0;
+    }
+    if (d->base != image || d->base_scale != image->resized_scale || d->base_x != x || d->base_y != y) {
+        d->renders++;
+        d->base = image;
+        d->base_scale = image->resized_scale;
+        d->base_x = x;
+        d->base_y = y;
+    }
+
+    // a buffer that already holds the base only needs the old lens put back
+    zfbv_drawn *back = zfbv_back(d);
+    if (back->buffer != fb->buffer || back->render != d->renders) {
+        zfbv_draw_base(d);
+    }
+    else if (back->loupe.x0 < back->loupe.x1) {
+        zfbv_blit_begin(fb, image);
+        framebuffer_clear_rect(fb, &back->loupe, 0, 0, 0);
+        framebuffer_draw_image_clipped(fb, x, y, image->resized, &back->loupe);
+        zfbv_blit_end(fb);
+        zfbv_damage(d, back->loupe);
+    }
+
+    fb_rect lens = { 0, 0, 0, 0 };
+    if (loupe != NULL && loupe->width > 0 && loupe->height > 0) {
+        lens.x0 = loupe->x - loupe->width / 2;
+        lens.y0 = loupe->y - loupe->height / 2;
+        lens.x1 = lens.x0 + loupe->width;
+        lens.y1 = lens.y0 + loupe->height;
+        lens.x0 = lens.x0 < 0 ? 0 : lens.x0;
+        lens.y0 = lens.y0 < 0 ? 0 : lens.y0;
+        lens.x1 = lens.x1 > fb->width ? fb->width : lens.x1;
+        lens.y1 = lens.y1 > fb->height ? fb->height : lens.y1;
+    }
+    if (lens.x0 < lens.x1 && lens.y0 < lens.y1) {
+        zfbv_draw_loupe(d, loupe, lens, loupe->scale > 0.0f ? loupe->scale : 1.0f);
+        zfbv_damage(d, lens);
+    }
+    else {
+        lens = (fb_rect) { 0, 0, 0, 0 };
+    }
+    back->loupe = lens;
+
+    trace_end("render loupe");
+    d->stats.render_seconds = now_seconds() - start;
+    return 1;
+}
+
+void zfbv_present(zfbv_display *d) {
+    double start = now_seconds();
+    if (d->damage_count > 0) {
+        framebuffer_update_rects(d->fb, d->damage, d->damage_count);
+    }
+    else {
+        framebuffer_update(d->fb);
+    }
+    d->damage_count = 0;
+    double elapsed = now_seconds() - start;
+    d->stats.present_seconds = elapsed;
+    if (elapsed > d->stats.worst_present_seconds) {
+        d->stats.worst_present_seconds = elapsed;
+    }
+    // a flip waits at most one refresh period for its vblank; longer and it missed one
+    if (d->fb->refresh_seconds > 0.0 && elapsed > 1.1 * d->fb->refresh_seconds) {
+        d->stats.late_presents++;
+    }
+}
+
+// real-time mode: memory is locked and the buffers, the stack and enough heap
+// for the renditions and scratch rows of a few frames are faulted in up front.
+// Freed memory is kept in the (locked) heap rather than returned to the
+// kernel, so the next rendition reuses those pages instead of faulting new ones.
+#define REALTIME_HEAP_FRAMES 4
+#define REALTIME_STACK_BYTES (256 * 1024)
+
+static void __attribute__((noinline)) prefault_stack(void) {
+    volatile char stack[REALTIME_STACK_BYTES];
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < sizeof(stack); i += page) {
+        stack[i] = 0;
+    }
+}
+
+// "0,2-3" into 'set'; 0 if the list is malformed or empty
+static int parse_cpu_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p != '\0') {
+        char *end;
+        long lo = strtol(p, &end, 10);
+        if (end == p || lo < 0 || lo >= CPU_SETSIZE) return 0;
+        long hi = lo;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo || hi >= CPU_SETSIZE) return 0;
+        }
+        for (long c = lo; c <= hi; c++) {
+            CPU_SET(c, set);
+        }
+        if (*end == ',') end++;
+        else if (*end != '\0') return 0;
+        p = end;
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+// with a finite RLIMIT_MEMLOCK, MCL_FUTURE would make every allocation past
+// the limit fail, decodes included, so memory is only locked without one
+static int realtime_lock_memory(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        limit.rlim_cur = limit.rlim_max = RLIM_INFINITY;
+        if (setrlimit(RLIMIT_MEMLOCK, &limit) == -1) {
+            printf("Not locking memory: RLIMIT_MEMLOCK is limited (needs root or CAP_SYS_RESOURCE)\n");
+            return 0;
+        }
+    }
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+        printf("Failed to lock memory: %s\n", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+int zfbv_realtime(zfbv_display *d, const zfbv_realtime_options *rt) {
+    cpu_set_t render_cpus, worker_cpus;
+    if ((rt->render_cpus != NULL && !parse_cpu_list(rt->render_cpus, &render_cpus)) ||
+        (rt->worker_cpus != NULL && !parse_cpu_list(rt->worker_cpus, &worker_cpus))) {
+        printf("Invalid CPU list\n");
+        return 0;
+    }
+    if (rt->priority < 0 || rt->priority > sched_get_priority_max(SCHED_FIFO)) {
+        printf("Unsupported SCHED_FIFO priority: %d\n", rt->priority);
+        return 0;
+    }
+
+    int ok = 1;
+    if (rt->lock_memory) {
+        mallopt(M_TRIM_THRESHOLD, -1);
+        mallopt(M_MMAP_MAX, 0);
+        ok = realtime_lock_memory();
+        framebuffer_prefault(d->fb);
+        prefault_stack();
+        size_t reserve = REALTIME_HEAP_FRAMES * (size_t) d->fb->width * d->fb->height * 4;
+        char *heap = malloc(reserve);
+        if (heap != NULL) {
+            prefault_pages(heap, reserve, 1);
+            free(heap);
+        }
+    }
+
+    if (rt->render_cpus != NULL && pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &render_cpus) != 0) {
+        printf("Failed to pin the render thread to CPUs %s\n", rt->render_cpus);
+        ok = 0;
+    }
+    if (rt->priority > 0) {
+        struct sched_param param = { .sched_priority = rt->priority };
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0) {
+            printf("Failed to set SCHED_FIFO priority %d: %s\n", rt->priority, strerror(err));
+            ok = 0;
+        }
+    }
+    // the workers draw the blit bands the render thread waits for, so they
+    // run just below it
+    if (!task_pool_realtime(task_pool_shared(), rt->worker_cpus != NULL ? &worker_cpus : NULL,
+                            rt->priority > 1 ? rt->priority - 1 : rt->priority)) {
+        ok = 0;
+    }
+    return ok;
+}
+
+int zfbv_trace_start(void) {
+    return trace_start();
+}
+
+int zfbv_trace_write(const char *path) {
+    return trace_write(path);
+}
+
+void zfbv_get_stats(const zfbv_display *d, zfbv_stats *stats) {
+    const framebuffer *fb = d->fb;
+    *stats = d->stats;
+    stats->width = fb->width;
+    stats->height = fb->height;
+    stats->updates = fb->updates;
+    stats->frame_bytes = (size_t) fb->width * fb->height * fb->bpp;
+    stats->bytes_written = fb->bytes_written;
+    stats->total_bytes_written = fb->total_bytes_written;
+}
+
+
+
+// shared work-stealing task pool. Every worker owns one deque per priority;
+// it pops its own work from the back and steals from the front of the
+// others'. A thread waiting on a group runs queued tasks of the group's
+// priority or above instead of blocking, so the pool has one thread less
+// than the machine has cores and is never oversubscribed.
+
+typedef struct task {
+    task_fn fn;
+    void *arg;
+    int index;
+    task_token *token;
+    task_group *group;
+} task;
+
+typedef struct task_deque {
+    pthread_mutex_t lock;
+    task *items; // ring buffer
+    int head;
+    atomic_int count; // written under 'lock', peeked without it
+    int capacity;
+} task_deque;
+
+struct task_pool {
+    int threads;
+    pthread_t *workers;
+    task_deque *deques; // threads * TASK_PRIORITIES
+    atomic_int queued;
+    atomic_int queued_at[TASK_PRIORITIES];
+    atomic_uint next; // round-robin target for submits from outside the pool
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+int task_pool_threads = 0; // 0: one per online CPU
+
+static __thread task_pool *worker_pool = NULL;
+static __thread int worker_index = -1;
+
+static int task_deque_push(task_deque *d, const task *t) {
+    pthread_mutex_lock(&d->lock);
+    if (d->count == d->capacity) {
+        int capacity = d->capacity ? d->capacity * 2 : 64;
+        task *items = malloc(capacity * sizeof(task));
+        if (items == NULL) {
+            pthread_mutex_unlock(&d->lock);
+            return 0;
+        }
+        for (int i = 0; i < d->count; i++) {
+            items[i] = d->items[(d->head + i) % d->capacity];
+        }
+        free(d->items);
+        d->items = items;
+        d->head = 0;
+        d->capacity = capacity;
+    }
+    d->items[(d->head + d->count) % d->capacity] = *t;
+    d->count++;
+    pthread_mutex_unlock(&d->lock);
+    return 1;
+}
+
+// the owner takes the newest task (cache-warm), thieves take the oldest
+static int task_deque_pop(task_deque *d, task *t, int steal) {
+    if (d->count == 0) return 0; // rechecked under the lock
+    pthread_mutex_lock(&d->lock);
+    if (d->count == 0) {
+        pthread_mutex_unlock(&d->lock);
+        return 0;
+    }
+    if (steal) {
+        *t = d->items[d->head];
+        d->head = (d->head + 1) % d->capacity;
+    }
+    else {
+        *t = d->items[(d->head + d->count - 1) % d->capacity];
+    }
+    d->count--;
+    pthread_mutex_unlock(&d->lock);
+    return 1;
+}
+
+// takes a task at priority 'lowest' or above
+static int task_pool_find(task_pool *pool, task *t, task_priority lowest) {
+    int self = worker_pool == pool ? worker_index : -1;
+    int start = self >= 0 ? self : (int) (atomic_load(&pool->next) % pool->threads);
+
+    // all of the interactive work anywhere in the pool goes before any visible
+    // decode, which goes before any prefetch
+    for (int p = 0; p <= (int) lowest; p++) {
+        if (atomic_load(&pool->queued_at[p]) == 0) continue;
+        if (self >= 0 && task_deque_pop(&pool->deques[self * TASK_PRIORITIES + p], t, 0)) {
+            atomic_fetch_sub(&pool->queued_at[p], 1);
+            atomic_fetch_sub(&pool->queued, 1);
+            return 1;
+        }
+        for (int i = 0; i < pool->threads; i++) {
+            int victim = (start + i) % pool->threads;
+            if (victim == self) continue;
+            if (task_deque_pop(&pool->deques[victim * TASK_PRIORITIES + p], t, 1)) {
+                atomic_fetch_sub(&pool->queued_at[p], 1);
+                atomic_fetch_sub(&pool->queued, 1);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// tasks queued at priority 'lowest' or above
+static int task_pool_queued(task_pool *pool, task_priority lowest) {
+    int queued = 0;
+    for (int p = 0; p <= (int) lowest; p++) {
+        queued += atomic_load(&pool->queued_at[p]);
+    }
+    return queued;
+}
+
+static void task_run(task *t) {
+    if (!task_cancelled(t->token)) {
+        t->fn(t->arg, t->index);
+    }
+    // the waiter may destroy the group as soon as it sees pending reach 0, so
+    // it only does that after taking the lock held here
+    task_group *group = t->group;
+    if (group != NULL) {
+        pthread_mutex_lock(&group->lock);
+        if (atomic_fetch_sub(&group->pending, 1) == 1) {
+            pthread_cond_broadcast(&group->done);
+        }
+        pthread_mutex_unlock(&group->lock);
+    }
+}
+
+static void *task_worker(void *arg) {
+    task_pool *pool = arg;
+    worker_pool = pool;
+    pthread_mutex_lock(&pool->lock);
+    worker_index = 0;
+    while (!pthread_equal(pool->workers[worker_index], pthread_self())) worker_index++;
+    pthread_mutex_unlock(&pool->lock);
+
+    task t;
+    while (1) {
+        if (task_pool_find(pool, &t, TASK_PREFETCH_START)) {
+            task_run(&t);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        if (!pool->stop && atomic_load(&pool->queued) == 0) {
+            trace_begin("idle", 0);
+            while (!pool->stop && atomic_load(&pool->queued) == 0) {
+                pthread_cond_wait(&pool->wake, &pool->lock);
+            }
+            trace_end("idle");
+        }
+        int stop = pool->stop && atomic_load(&pool->queued) == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) break;
+    }
+    return NULL;
+}
+
+task_pool *task_pool_create(int threads) {
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 1 ? (int) cpus - 1 : 1; // the waiting thread is the last core
+    }
+
+    task_pool *pool = calloc(1, sizeof(task_pool));
+    if (pool == NULL) {
+        printf("Failed to allocate task pool\n");
+        return NULL;
+    }
+    pool->workers = calloc(threads, sizeof(pthread_t));
+    pool->deques = calloc(threads * TASK_PRIORITIES, sizeof(task_deque));
+    if (pool->workers == NULL || pool->deques == NULL) {
+        printf("Failed to allocate task pool\n");
+        free(pool->workers);
+        free(pool->deques);
+        free(pool);
+        return NULL;
+    }
+    for (int i = 0; i < threads * TASK_PRIORITIES; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    // workers look themselves up in 'workers', so hold the lock until all exist
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool->workers[i], NULL, task_worker, pool) != 0) {
+            printf("Failed to start task pool thread %d\n", i);
+            break;
+        }
+        pool->threads++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (pool->threads == 0) {
+        task_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void task_pool_destroy(task_pool *pool) {
+    if (pool == NULL) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->threads; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    for (int i = 0; i < pool->threads * TASK_PRIORITIES; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].items);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    free(pool->workers);
+    free(pool->deques);
+    free(pool);
+}
+
+static task_pool *shared_pool = NULL;
+static pthread_once_t shared_pool_once = PTHREAD_ONCE_INIT;
+
+static void task_pool_create_shared(void) {
+    shared_pool = task_pool_create(task_pool_threads);
+}
+
+// the pool every subsystem submits to; NULL if it could not be started, in
+// which case task_submit runs tasks inline
+task_pool *task_pool_shared(void) {
+    pthread_once(&shared_pool_once, task_pool_create_shared);
+    return shared_pool;
+}
+
+// how many threads can run tasks at once, counting the one that waits
+int task_pool_concurrency(task_pool *pool) {
+    return pool != NULL ? pool->threads + 1 : 1;
+}
+
+void task_submit(task_pool *pool, task_priority priority, task_token *token, task_group *group,
+                 task_fn fn, void *arg, int index) {
+    task t = { fn, arg, index, token, group };
+    if (group != NULL) {
+        atomic_fetch_add(&group->pending, 1);
+        int lowest = atomic_load(&group->priority);
+        while ((int) priority > lowest && !atomic_compare_exchange_weak(&group->priority, &lowest, priority)) {
+        }
+    }
+
+    int target = worker_pool == pool ? worker_index : -1;
+    if (pool != NULL && target < 0) {
+        target = (int) (atomic_fetch_add(&pool->next, 1) % pool->threads);
+    }
+    if (pool == NULL || !task_deque_push(&pool->deques[target * TASK_PRIORITIES + priority], &t)) {
+        task_run(&t);
+        return;
+    }
+
+    atomic_fetch_add(&pool->queued_at[priority], 1);
+    atomic_fetch_add(&pool->queued, 1);
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void task_group_init(task_group *group) {
+    atomic_init(&group->pending, 0);
+    atomic_init(&group->priority, TASK_INTERACTIVE);
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->done, NULL);
+}
+
+void task_group_destroy(task_group *group) {
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->done);
+}
+
+// runs queued tasks (of any group, highest priority first) until every task
+// in 'group' has finished. Only tasks at the group's priority or above are
+// run: a render waiting for its blit bands must not pick up a whole prefetch
+// decode, so with nothing that urgent queued it blocks instead.
+void task_group_wait(task_pool *pool, task_group *group) {
+    task t;
+    while (atomic_load(&group->pending) > 0) {
+        task_priority lowest = atomic_load(&group->priority);
+        if (pool != NULL && task_pool_find(pool, &t, lowest)) {
+            task_run(&t);
+            continue;
+        }
+        pthread_mutex_lock(&group->lock);
+        if (atomic_load(&group->pending) > 0 && (pool == NULL || task_pool_queued(pool, lowest) == 0)) {
+            trace_begin("wait", 0);
+            pthread_cond_wait(&group->done, &group->lock);
+            trace_end("wait");
+        }
+        pthread_mutex_unlock(&group->lock);
+    }
+    pthread_mutex_lock(&group->lock);
+    pthread_mutex_unlock(&group->lock);
+}
+
+// calls fn(arg, i) for i in [0, count) on the pool and returns when all are done
+void task_parallel_for(task_pool *pool, task_priority priority, task_token *token,
+                       int count, task_fn fn, void *arg) {
+    if (count <= 0) return;
+    if (count == 1 || pool == NULL) {
+        for (int i = 0; i < count && !task_cancelled(token); i++) {
+            fn(arg, i);
+        }
+        return;
+    }
+
+    task_group group;
+    task_group_init(&group);
+    for (int i = 1; i < count; i++) {
+        task_submit(pool, priority, token, &group, fn, arg, i);
+    }
+    if (!task_cancelled(token)) {
+        fn(arg, 0);
+    }
+    task_group_wait(pool, &group);
+    task_group_destroy(&group);
+}
+
+// pins the workers to 'cpus' (NULL leaves them where they are) and runs them
+// under SCHED_FIFO at 'priority' (0 leaves their policy); 0 if that failed
+int task_pool_realtime(task_pool *pool, const cpu_set_t *cpus, int priority) {
+    if (pool == NULL) return 1;
+    int ok = 1;
+    for (int i = 0; i < pool->threads; i++) {
+        if (cpus != NULL && pthread_setaffinity_np(pool->workers[i], sizeof(cpu_set_t), cpus) != 0) {
+            ok = 0;
+        }
+        struct sched_param param = { .sched_priority = priority };
+        if (priority > 0 && pthread_setschedparam(pool->workers[i], SCHED_FIFO, &param) != 0) {
+            ok = 0;
+        }
+    }
+    if (!ok) {
+        printf("Failed to set the CPUs or priority of the task pool\n");
+    }
+    return ok;
+}
+
+// number of bands to split 'rows' rows into, at least 'min_rows' rows each
+int task_bands(task_pool *pool, int rows, int min_rows) {
+    int bands = task_pool_concurrency(pool) * 4;
+    if (bands > rows / min_rows) bands = rows / min_rows;
+    return bands > 1 ? bands : 1;
+}
+
+void task_token_init(task_token *token) {
+    atomic_init(&token->cancelled, 0);
+}
+
+void task_token_cancel(task_token *token) {
+    atomic_store(&token->cancelled, 1);
+}
+
+int task_cancelled(task_token *token) {
+    return token != NULL && atomic_load_explicit(&token->cancelled, memory_order_relaxed);
+}
+
+
+
+// timeline tracing in the Chrome trace event format (chrome://tracing,
+// Perfetto). Every thread appends begin/end events to its own buffer, so
+// recording takes no locks; a buffer is allocated the first time its thread
+// records while tracing is on and is kept for the life of the process, so
+// trace_write can still read it after the thread has exited. Events past
+// TRACE_EVENTS per thread are dropped and counted.
+
+#define TRACE_EVENTS 65536
+
+typedef struct trace_record {
+    const char *name; // a string literal
+    uint64_t ns;
+    int index;
+    char phase; // 'B' or 'E'
+} trace_record;
+
+typedef struct trace_buffer {
+    struct trace_buffer *next;
+    int tid;
+    char name[32];
+    atomic_int count;   // records published to trace_write
+    atomic_int dropped;
+    trace_record records[TRACE_EVENTS];
+} trace_buffer;
+
+atomic_int trace_enabled = 0;
+static uint64_t trace_epoch;
+static _Atomic(trace_buffer *) trace_buffers = NULL;
+static atomic_int trace_next_tid = 1;
+static __thread trace_buffer *trace_local = NULL;
+
+static uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static trace_buffer *trace_buffer_create(void) {
+    trace_buffer *buf = malloc(sizeof(trace_buffer));
+    if (buf == NULL) return NULL;
+    buf->tid = atomic_fetch_add(&trace_next_tid, 1);
+    if (worker_pool != NULL) {
+        snprintf(buf->name, sizeof(buf->name), "worker %d", worker_index);
+    }
+    else if (prctl(PR_GET_NAME, buf->name) != 0 || buf->name[0] == '\0') { // the comm name, 16 bytes
+        snprintf(buf->name, sizeof(buf->name), "thread %d", buf->tid);
+    }
+    for (char *c = buf->name; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\' || (unsigned char) *c < ' ') *c = '_'; // kept out of the JSON
+    }
+    atomic_init(&buf->count, 0);
+    atomic_init(&buf->dropped, 0);
+
+    buf->next = atomic_load(&trace_buffers);
+    while (!atomic_compare_exchange_weak(&trace_buffers, &buf->next, buf)) {
+    }
+    return buf;
+}
+
+void trace_event(char phase, const char *name, int index) {
+    trace_buffer *buf = trace_local;
+    if (buf == NULL) {
+        buf = trace_local = trace_buffer_create();
+        if (buf == NULL) return;
+    }
+    int n = atomic_load_explicit(&buf->count, memory_order_relaxed);
+    if (n == TRACE_EVENTS) {
+        atomic_fetch_add_explicit(&buf->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    trace_record *r = &buf->records[n];
+    r->name = name;
+    r->ns = trace_now();
+    r->index = index;
+    r->phase = phase;
+    atomic_store_explicit(&buf->count, n + 1, memory_order_release);
+}
+
+static pthread_once_t trace_epoch_once = PTHREAD_ONCE_INIT;
+
+static void trace_set_epoch(void) {
+    trace_epoch = trace_now();
+}
+
+// starts recording; timestamps in the trace count from the first call
+int trace_start(void) {
+    pthread_once(&trace_epoch_once, trace_set_epoch);
+    atomic_store(&trace_enabled, 1);
+    return 1;
+}
+
+// writes everything recorded so far, by every thread; recording goes on.
+// Returns 0 if the file could not be written.
+int trace_write(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        printf("Failed to open trace file %s\n", path);
+        return 0;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    const char *sep = "";
+    for (trace_buffer *buf = atomic_load(&trace_buffers); buf != NULL; buf = buf->next) {
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                sep, buf->tid, buf->name);
+        sep = ",\n";
+        int count = atomic_load_explicit(&buf->count, memory_order_acquire);
+        for (int i = 0; i < count; i++) {
+            const trace_record *r = &buf->records[i];
+            double us = (double) (int64_t) (r->ns - trace_epoch) / 1000.0;
+            if (r->phase == 'B') {
+                fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"index\":%d}}",
+                        r->name, us, buf->tid, r->index);
+            }
+            else {
+                fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}",
+                        r->name, us, buf->tid);
+            }
+        }
+        int dropped = atomic_load_explicit(&buf->dropped, memory_order_relaxed);
+        if (dropped > 0) {
+            printf("Trace buffer of %s full, %d events dropped\n", buf->name, dropped);
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    if (fclose(f) != 0) {
+        printf("Failed to write trace file %s\n", path);
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,174 @@
+#ifndef ZFBV_H
+#define ZFBV_H
+
+// libzfbv: the viewer as a library, for programs that show image after image
+// and want the display, the task pool and the colour LUTs to stay open
+// between them instead of starting zfbv for each one.
+//
+//     zfbv_options opt;
+//     zfbv_default_options(&opt);
+//     zfbv_display *d = zfbv_open("/dev/fb0", &opt);
+//     zfbv_image *img = zfbv_load(d, "a.jpg");
+//     zfbv_image *next = zfbv_prefetch(d, "b.jpg"); // decodes in the background
+//     zfbv_render(d, img, NULL);
+//     zfbv_present(d);
+//     ...
+//     zfbv_image_free(img);
+//     zfbv_close(d);
+//
+// Functions taking a display must not be called on the same display from
+// two threads at once. Images belong to the display they were loaded for.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// bumped whenever a struct below changes layout or a function changes meaning
+#define ZFBV_API_VERSION 2
+
+#if defined(__GNUC__)
+#define ZFBV_API __attribute__((visibility("default")))
+#else
+#define ZFBV_API
+#endif
+
+typedef struct zfbv_display zfbv_display;
+typedef struct zfbv_image zfbv_image;
+
+typedef struct zfbv_options {
+    int dither;                // ordered dither matrix on 16 and 8 bpp displays: 0 (off), 4 or 8
+    int diff_present;          // only write changed spans to the framebuffer
+    int progressive;           // show interlaced PNGs pass by pass while zfbv_load runs
+    int threads;               // task pool worker threads, 0 for one less than the CPUs
+    const char *panel_profile; // ICC profile of the display, NULL for sRGB
+    float sharpen;             // unsharp mask amount for downscaled images, 0 to 4
+    // decode limits for untrusted files, 0 for no limit
+    double limit_megapixels;
+    double limit_megabytes;
+    double limit_seconds;
+} zfbv_options;
+
+// where to draw an image: 'scale' times its size (0 fits it to the display
+// with a margin), centred, then moved by (offset_x, offset_y) display pixels
+typedef struct zfbv_transform {
+    float scale;
+    int offset_x;
+    int offset_y;
+} zfbv_transform;
+
+typedef struct zfbv_stats {
+    int width, height;            // of the display
+    int updates;                  // zfbv_present calls
+    size_t frame_bytes;           // bytes in one full frame
+    size_t bytes_written;         // by the last zfbv_present
+    size_t total_bytes_written;   // by all of them
+    double load_seconds;          // last zfbv_load, or wait for a prefetched image
+    double render_seconds;        // last zfbv_render, including any resize
+    double present_seconds;       // last zfbv_present
+    double worst_present_seconds; // longest zfbv_present
+    int late_presents;            // DRM: presents that took over a refresh period (a missed vblank)
+} zfbv_stats;
+
+ZFBV_API void zfbv_default_options(zfbv_options *opt);
+
+// opens an fbdev node (/dev/fb0) or a DRM card (/dev/dri/card0); NULL on
+// failure. The task pool size, sharpen amount and decode limits are process
+// wide: the pool is started by the first display opened, the others follow
+// the last display opened.
+ZFBV_API zfbv_display *zfbv_open(const char *device, const zfbv_options *opt);
+ZFBV_API void zfbv_close(zfbv_display *d);
+
+// decodes 'filename' on the calling thread; NULL on failure
+ZFBV_API zfbv_image *zfbv_load(zfbv_display *d, const char *filename);
+// starts decoding 'filename' on the task pool and returns at once; the image
+// is waited for by the first call that needs it. NULL only if it could not be
+// queued; a failed decode shows up as zfbv_image_size returning 0.
+ZFBV_API zfbv_image *zfbv_prefetch(zfbv_display *d, const char *filename);
+// 1 and the image's size, or 0 if it failed to load
+ZFBV_API int zfbv_image_size(zfbv_image *img, int *width, int *height);
+// also cancels a prefetch that has not started yet
+ZFBV_API void zfbv_image_free(zfbv_image *img);
+
+// the scale zfbv_render uses when transform->scale is 0; 0 if 'img' failed to load
+ZFBV_API float zfbv_fit_scale(zfbv_display *d, zfbv_image *img);
+
+// clears the display to black and draws 'img' with 'transform' (NULL for
+// fit and centre) into the back buffer. The resized image is kept for the
+// next render at the same scale; if resizing to a new scale fails, the last
+// one is drawn again. Returns 0 if there was nothing to draw: the image
+// failed to load, or its first resize failed.
+ZFBV_API int zfbv_render(zfbv_display *d, zfbv_image *img, const zfbv_transform *transform);
+// a magnified view of the original image over the rendition: a 'width' x
+// 'height' lens centred on display pixel (x, y), showing the image at
+// 'scale' display pixels per image pixel (1 for 1:1)
+typedef struct zfbv_loupe {
+    int x, y;
+    int width, height;
+    float scale;
+} zfbv_loupe;
+
+// zfbv_render with 'loupe' (NULL for none) drawn over it. Only the lens is
+// resampled, from the original image; while the image and transform stay
+// the same, later calls only redraw the old and new lens areas and the next
+// zfbv_present only writes those, so moving the lens keeps up with the
+// refresh rate even on very large images.
+ZFBV_API int zfbv_render_loupe(zfbv_display *d, zfbv_image *img, const zfbv_transform *transform,
+                               const zfbv_loupe *loupe);
+// shows what has been rendered
+ZFBV_API void zfbv_present(zfbv_display *d);
+
+ZFBV_API void zfbv_get_stats(const zfbv_display *d, zfbv_stats *stats);
+
+typedef struct zfbv_realtime_options {
+    int priority;            // SCHED_FIFO priority of the calling thread (the task pool runs one
+                             // below it), 1 to 99; 0 leaves the scheduling policy alone
+    int lock_memory;         // mlockall and fault in the buffers and heap now
+    const char *render_cpus; // CPUs to pin the calling thread to, like "3" or "2-3"; NULL for any
+    const char *worker_cpus; // CPUs to pin the task pool to; NULL for any
+} zfbv_realtime_options;
+
+// for displays that must present every frame on time: call it from the
+// thread that renders and presents, after zfbv_open. Priority and locking
+// need root (or CAP_SYS_NICE and CAP_SYS_RESOURCE). lock_memory changes the
+// whole process: mlockall, and mallopt so that malloc never returns memory
+// to the system (M_TRIM_THRESHOLD -1) or serves blocks with mmap
+// (M_MMAP_MAX 0). Returns 0 if any part could not be applied; the rest still
+// is. Watch worst_present_seconds and late_presents in the stats to check
+// frames land on every vblank.
+ZFBV_API int zfbv_realtime(zfbv_display *d, const zfbv_realtime_options *rt);
+
+// records a timeline of every pipeline thread (decode, resize and blit bands,
+// present, queue waits) from now on, for the whole process
+ZFBV_API int zfbv_trace_start(void);
+// writes what has been recorded so far as a Chrome trace event file (open it
+// in chrome://tracing or ui.perfetto.dev); 0 if it could not be written
+ZFBV_API int zfbv_trace_write(const char *path);
+
+typedef struct zfbv_benchmark_options {
+    int runs;             // timed runs of each case after a warm-up run, 1 to 1000
+    const char *save;     // write every sample to this JSON file, NULL for none
+    const char *baseline; // compare with a file written by 'save', NULL for none
+    double threshold;     // percent slower than the baseline that is a regression
+} zfbv_benchmark_options;
+
+// 15 runs, a 5% threshold, nothing saved or compared
+ZFBV_API void zfbv_default_benchmark_options(zfbv_benchmark_options *bench);
+
+// decodes 'filename', resizes it to fit 3840x2160 on pools of 1 to 16 threads
+// and prints the speedup curve, then how close resize, clear, blit and present come to
+// the memory bandwidth of the machine; needs no display. Each case is
+// reported as the median and median absolute deviation of its runs. Returns
+// 0 on success, 1 on failure and 2 if a case is slower than the baseline by
+// more than the threshold and a significance test rules out noise.
+ZFBV_API int zfbv_benchmark_run(const char *filename, const zfbv_options *opt,
+                                const zfbv_benchmark_options *bench);
+// zfbv_benchmark_run with the default benchmark options
+ZFBV_API int zfbv_benchmark(const char *filename, const zfbv_options *opt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif